@@ -18,6 +18,67 @@ def human_readable(num, suffix='B'):
 def mean(a):
 	return sum(a)/len(a)
 
+def ratio(num, den, scale=1):
+	if num is None or den is None or den == 0:
+		return "n/a"
+	return "%.3f" % (scale*num/den)
+
+def print_profile(profile):
+	print("[*] Per-phase counters (n/a: not provided by this CPU/kernel, see /proc/sys/kernel/perf_event_paranoid):")
+	print("    {:<13}{:>6}{:>10}{:>8}{:>13}{:>14}{:>15}{:>12}{:>7}".format(
+		"phase", "runs", "wall (s)", "IPC", "bytes/cycle", "LLC miss/KiB", "dTLB miss/KiB", "ctx sw/run", "CPUs"
+	))
+	for phase, stats in profile.items():
+		if stats["runs"] == 0:
+			continue
+		print("    {:<13}{:>6}{:>10}{:>8}{:>13}{:>14}{:>15}{:>12}{:>7}".format(
+			phase,
+			stats["runs"],
+			round(stats["wall_ns"]/1e9, NUM_DECIMALS),
+			ratio(stats["instructions"], stats["cycles"]),
+			ratio(stats["bytes"], stats["cycles"]),
+			ratio(stats["cache_misses"], stats["bytes"], 1024),
+			ratio(stats["dtlb_misses"], stats["bytes"], 1024),
+			ratio(stats["context_switches"], stats["runs"]),
+			ratio(stats["task_clock"], stats["wall_ns"])
+		))
+
+# Fastest each phase could have been, in seconds, from the raw primitive rates: the bulk passes are bound by the cipher,
+# fast search by one hash per candidate plus one RSA operation, slow search by RSA operations spread over the threads
+# that can run at once. None for phases without a ceiling.
+def phase_ceiling(phase, stats, baseline):
+	rsa_rate = baseline["rsa_ops_per_sec"]
+	if phase in ("encrypt", "decrypt"):
+		return stats["bytes"]/baseline["cipher_bytes_per_sec"]
+	if rsa_rate is None:
+		return None
+	if phase == "fast_search":
+		return stats["ops"]/baseline["hashes_per_sec"] + stats["runs"]/rsa_rate
+	if phase == "slow_search":
+		return stats["ops"]/(rsa_rate*min(baseline["search_threads"], baseline["cpus"]))
+	return None
+
+def print_efficiency(profile, baseline):
+	print("[*] Raw primitives on this host: {}/s cipher, {} hashes/s, {} RSA ops/s ({} search threads on {} CPUs)".format(
+		human_readable(baseline["cipher_bytes_per_sec"]), round(baseline["hashes_per_sec"]),
+		round(baseline["rsa_ops_per_sec"], 1) if baseline["rsa_ops_per_sec"] is not None else "n/a",
+		baseline["search_threads"], baseline["cpus"]
+	))
+	print("[*] Per-phase efficiency (time the raw primitives would take / wall time):")
+	print("    {:<13}{:>6}{:>10}{:>12}{:>12}{:>9}".format("phase", "runs", "ops", "wall (s)", "ceiling (s)", "% ceil"))
+	for phase, stats in profile.items():
+		ceiling = phase_ceiling(phase, stats, baseline)
+		if stats["runs"] == 0 or ceiling is None:
+			continue
+		print("    {:<13}{:>6}{:>10}{:>12}{:>12}{:>9}".format(
+			phase,
+			stats["runs"],
+			stats["ops"],
+			round(stats["wall_ns"]/1e9, NUM_DECIMALS),
+			round(ceiling, NUM_DECIMALS),
+			ratio(ceiling*1e9, stats["wall_ns"], 100)
+		))
+
 def loading_bar(val, mx):
 
 	width = 60
@@ -34,6 +95,7 @@ if __name__ == '__main__':
 		NTESTS = 10
 		FILE_SIZE = "10M"
 		NUM_DECIMALS = 3
+		FAST_MODE = True
 
 		# Get current and parent directories
 		current_directory = os.path.dirname(os.path.realpath(__file__))
@@ -67,7 +129,10 @@ if __name__ == '__main__':
 		print(" *** Using files with size: {} ***".format(FILE_SIZE))
 
 		# Generate RSA keypair and init context
-		gz = Giltzarrapo(dynamic_library, pubkey, privkey, passphrase="asdf", password="1234", fast_mode=True, generate_RSA_keypair=True)
+		gz = Giltzarrapo(dynamic_library, pubkey, privkey, passphrase="asdf", password="1234", fast_mode=FAST_MODE, generate_RSA_keypair=True)
+
+		# Collect perf_event_open() counters for each phase
+		gz.set_profiling(True)
 
 		# Perform tests
 		for i in range(NTESTS):
@@ -122,6 +187,21 @@ if __name__ == '__main__':
 			human_readable(mean(dec_throughput)), human_readable(max(dec_throughput)), human_readable(min(dec_throughput))
 		))
 
+		# Counters: low IPC with many cache/TLB misses points to memory behavior, many context switches with few CPUs
+		# busy points to lock contention
+		print_profile(gz.profile())
+
+		# How far each phase is from what libcrypto alone can do on this host
+		print_efficiency(gz.profile(), gz.baseline())
+
+		# Storage detected behind the files of the last decryption and what was decided from it
+		for side, policy in gz.io_policy().items():
+			print("[*] {} I/O: {} storage (queue depth {}), {} buffers, {} block selection, {} files at once".format(
+				side.capitalize(), policy["storage"], policy["queue_depth"] if policy["queue_depth"] > 0 else "n/a",
+				human_readable(policy["io_size"]), policy["select"],
+				policy["parallelism"] if policy["parallelism"] < 2**31 - 1 else "any"
+			))
+
 	except KeyboardInterrupt:
 		pass
 
@@ -12,21 +12,116 @@ class rsa_st(Structure):
                 ("d", c_void_p)
         ]
 
+# Names of CzarrapoStorageClass and CzarrapoSelectStrategy values, in order
+STORAGE_CLASSES = ("unknown", "ssd", "hdd", "network", "memory")
+SELECT_STRATEGIES = ("random", "preload")
+
+class CzarrapoIoPolicy(Structure):
+	_fields_ = [
+		("storage", c_int),
+		("queue_depth", c_int),
+		("io_size", c_int),
+		("select", c_int),
+		("parallelism", c_int),
+		("memory_budget", c_longlong)
+	]
+
+	def as_dict(self):
+		policy = {name: getattr(self, name) for name, _ in self._fields_}
+		policy["storage"] = STORAGE_CLASSES[self.storage]
+		policy["select"] = SELECT_STRATEGIES[self.select]
+		return policy
+
 class CzarrapoCtx(Structure):
 	_fields_ = [
 		("public_rsa", POINTER(rsa_st)),
 		("private_rsa", POINTER(rsa_st)),
 		("password", c_char_p),
-		("fast", c_bool)
+		("fast", c_bool),
+		("blinding", c_void_p),
+		("durability", c_int),
+		("batch", c_void_p),
+		("profile", c_void_p),
+		("cache", c_void_p),
+		("dedup_key", c_void_p),
+		("io", CzarrapoIoPolicy * 2)
+	]
+
+class CzarrapoCapabilities(Structure):
+	_fields_ = [
+		("avx2", c_bool),
+		("avx512", c_bool),
+		("block_compare", c_char_p)
+	]
+
+class CzarrapoS3Target(Structure):
+	_fields_ = [
+		("endpoint", c_char_p),
+		("region", c_char_p),
+		("bucket", c_char_p),
+		("key", c_char_p),
+		("access_key", c_char_p),
+		("secret_key", c_char_p)
+	]
+
+# Phases and counters reported by Giltzarrapo.profile(), in CzarrapoPhase and CzarrapoCounter order
+PHASES = ("block_select", "encrypt", "fast_search", "slow_search", "decrypt")
+COUNTERS = ("cycles", "instructions", "cache_misses", "dtlb_misses", "context_switches", "task_clock")
+
+class CzarrapoPhaseStats(Structure):
+	_fields_ = [
+		("runs", c_longlong),
+		("bytes", c_longlong),
+		("ops", c_longlong),
+		("wall_ns", c_longlong),
+		("counters", c_longlong * len(COUNTERS))
+	]
+
+class CzarrapoBaseline(Structure):
+	_fields_ = [
+		("cipher_bytes_per_sec", c_double),
+		("hashes_per_sec", c_double),
+		("rsa_ops_per_sec", c_double),
+		("search_threads", c_int),
+		("cpus", c_int)
+	]
+
+class CzarrapoCacheStats(Structure):
+	_fields_ = [
+		("hits", c_ulonglong),
+		("misses", c_ulonglong),
+		("insertions", c_ulonglong),
+		("slots", c_ulonglong),
+		("chunk_size", c_ulonglong)
+	]
+
+class CzarrapoWatchStats(Structure):
+	_fields_ = [
+		("files", c_ulonglong),
+		("failures", c_ulonglong),
+		("bytes", c_ulonglong),
+		("batches", c_ulonglong),
+		("pending", c_ulonglong),
+		("queue_latency_avg_ns", c_longlong),
+		("queue_latency_max_ns", c_longlong),
+		("latency_avg_ns", c_longlong),
+		("latency_max_ns", c_longlong),
+		("elapsed_ns", c_longlong)
 	]
 
+# Values for Giltzarrapo.set_durability()
+DURABILITY_NONE = 0
+DURABILITY_FILE = 1
+DURABILITY_BATCH = 2
+
 class Giltzarrapo():
 
-	__slots__ = ("lib", "ctx")
+	__slots__ = ("lib", "ctx", "cache")
 
 	def __init__(self, dynamic_library, pubkey, privkey, passphrase, password, fast_mode=True, generate_RSA_keypair=False):
 
 		self.lib = cdll.LoadLibrary(dynamic_library)
+		self.cache = None
 
 		# Encode params
 		pubkey, privkey = [c_char_p(key.encode()) if key else POINTER(c_char_p)() for key in (pubkey, privkey)]
@@ -62,6 +157,38 @@ class Giltzarrapo():
 		if res < 0:
 			raise TypeError("Error")
 
+	def encrypt_tee(self, infile, outfiles, selected_block=-1):
+		paths = (c_char_p * len(outfiles))(*[f.encode() for f in outfiles])
+		res = self.lib.czarrapo_encrypt_tee(
+			self.ctx,
+			c_char_p(infile.encode()),
+			paths,
+			c_int(len(outfiles)),
+			c_longlong(selected_block)
+		)
+
+		if res < 0:
+			raise TypeError("Error")
+
+	def encrypt_s3(self, infile, endpoint, region, bucket, key, access_key, secret_key, selected_block=-1):
+		target = CzarrapoS3Target(
+			endpoint.encode(),
+			region.encode(),
+			bucket.encode(),
+			key.encode(),
+			access_key.encode(),
+			secret_key.encode()
+		)
+		res = self.lib.czarrapo_encrypt_s3(
+			self.ctx,
+			c_char_p(infile.encode()),
+			byref(target),
+			c_longlong(selected_block)
+		)
+
+		if res < 0:
+			raise TypeError("Error")
+
 	def decrypt(self, infile, outfile, selected_block=-1):
 		res = self.lib.czarrapo_decrypt(
 			self.ctx,
@@ -73,6 +200,156 @@ class Giltzarrapo():
 		if res < 0:
 			raise TypeError("Error")
 
+	# Random access reads: returns a reader for pread() and close()
+	def open(self, infile, selected_block=-1):
+		self.lib.czarrapo_open.restype = c_void_p
+		reader = self.lib.czarrapo_open(self.ctx, c_char_p(infile.encode()), c_longlong(selected_block))
+
+		if not reader:
+			raise TypeError("Error")
+		return reader
+
+	def pread(self, reader, length, offset):
+		self.lib.czarrapo_pread.restype = c_longlong
+		buf = create_string_buffer(length)
+		res = self.lib.czarrapo_pread(c_void_p(reader), buf, c_longlong(length), c_longlong(offset))
+
+		if res < 0:
+			raise TypeError("Error")
+		return buf.raw[:res]
+
+	def close(self, reader):
+		self.lib.czarrapo_close(c_void_p(reader))
+
+	# Shares decrypted chunks with other processes: creates a cache of 'max_bytes', or attaches to the one behind 'fd'
+	def set_cache(self, max_bytes=None, fd=None):
+		self.lib.czarrapo_cache_create.restype = c_void_p
+		self.lib.czarrapo_cache_attach.restype = c_void_p
+		cache = self.lib.czarrapo_cache_attach(c_int(fd)) if fd is not None else self.lib.czarrapo_cache_create(c_size_t(max_bytes))
+
+		if not cache:
+			raise TypeError("Could not set up cache")
+		self.lib.czarrapo_set_cache(self.ctx, c_void_p(cache))
+		if self.cache:
+			self.lib.czarrapo_cache_free(c_void_p(self.cache))
+		self.cache = cache
+
+	# File descriptor to hand to other processes (see os.set_inheritable() and socket.send_fds())
+	def cache_fd(self):
+		return self.lib.czarrapo_cache_fd(c_void_p(self.cache))
+
+	def cache_stats(self):
+		stats = CzarrapoCacheStats()
+		self.lib.czarrapo_cache_stats(c_void_p(self.cache), byref(stats))
+		return {name: getattr(stats, name) for name, _ in CzarrapoCacheStats._fields_}
+
+	# Encrypts every file that appears in 'dirs' into 'output_dir' until watch_stop(); returns the service
+	def watch_start(self, dirs, output_dir, num_workers=4, remove_plaintext=False):
+		self.lib.czarrapo_watch_start.restype = c_void_p
+		paths = (c_char_p * len(dirs))(*[d.encode() for d in dirs])
+		watch = self.lib.czarrapo_watch_start(
+			self.ctx,
+			paths,
+			c_int(len(dirs)),
+			c_char_p(output_dir.encode()),
+			c_int(num_workers),
+			c_bool(remove_plaintext)
+		)
+
+		if not watch:
+			raise TypeError("Could not start watching")
+		return watch
+
+	def watch_stats(self, watch):
+		stats = CzarrapoWatchStats()
+		self.lib.czarrapo_watch_stats(c_void_p(watch), byref(stats))
+		return {name: getattr(stats, name) for name, _ in CzarrapoWatchStats._fields_}
+
+	def watch_stop(self, watch):
+		self.lib.czarrapo_watch_stop(c_void_p(watch))
+
+	# Same contents, same ciphertext: 'secret' (bytes) picks blocks by content. None goes back to random blocks.
+	def set_deterministic(self, secret):
+		res = self.lib.czarrapo_set_deterministic(
+			self.ctx,
+			c_char_p(secret) if secret is not None else None,
+			c_size_t(len(secret) if secret is not None else 0)
+		)
+
+		if res < 0:
+			raise TypeError("Error")
+
+	# Policies picked for the input and output of the last operation
+	def io_policy(self):
+		return {"input": self.ctx.contents.io[0].as_dict(), "output": self.ctx.contents.io[1].as_dict()}
+
+	# Policy the storage behind 'path' would get
+	def storage_policy(self, path):
+		policy = CzarrapoIoPolicy()
+		self.lib.czarrapo_storage_policy(c_char_p(path.encode()), byref(policy))
+		return policy.as_dict()
+
+	def set_durability(self, durability):
+		res = self.lib.czarrapo_set_durability(self.ctx, c_int(durability))
+
+		if res < 0:
+			raise TypeError("Error")
+
+	def sync(self):
+		res = self.lib.czarrapo_sync(self.ctx)
+
+		if res < 0:
+			raise TypeError("Error")
+
+	def set_profiling(self, enabled=True):
+		res = self.lib.czarrapo_set_profiling(self.ctx, c_bool(enabled))
+
+		if res < 0:
+			raise TypeError("Error")
+
+	# Per-phase totals since profiling was enabled, by phase name. Unavailable counters are None.
+	def profile(self):
+		self.lib.czarrapo_profile.restype = POINTER(CzarrapoPhaseStats)
+		stats = self.lib.czarrapo_profile(self.ctx)
+		if not stats:
+			return None
+
+		profile = {}
+		for i, phase in enumerate(PHASES):
+			profile[phase] = {
+				"runs": stats[i].runs,
+				"bytes": stats[i].bytes,
+				"ops": stats[i].ops,
+				"wall_ns": stats[i].wall_ns
+			}
+			for j, counter in enumerate(COUNTERS):
+				profile[phase][counter] = stats[i].counters[j] if stats[i].counters[j] >= 0 else None
+		return profile
+
+	# Rates of the raw primitives behind each phase on this host. The RSA rate is None without a private key.
+	def baseline(self):
+		baseline = CzarrapoBaseline()
+		res = self.lib.czarrapo_baseline(self.ctx, byref(baseline))
+
+		if res < 0:
+			raise TypeError("Error")
+
+		rates = {name: getattr(baseline, name) for name, _ in baseline._fields_}
+		if rates["rsa_ops_per_sec"] < 0:
+			rates["rsa_ops_per_sec"] = None
+		return rates
+
+	def capabilities(self):
+		self.lib.czarrapo_capabilities.restype = POINTER(CzarrapoCapabilities)
+		caps = self.lib.czarrapo_capabilities().contents
+		return {
+			"avx2": caps.avx2,
+			"avx512": caps.avx512,
+			"block_compare": caps.block_compare.decode()
+		}
+
 	def __free(self):
 		if self.lib and self.ctx:
 			self.lib.czarrapo_free(self.ctx)
+		if self.lib and self.cache:
+			self.lib.czarrapo_cache_free(c_void_p(self.cache))
@@ -0,0 +1,43 @@
+import os
+import sys
+import time
+
+from giltzarrapo import Giltzarrapo, DURABILITY_BATCH
+
+# Encrypts every file dropped into the given directories, reporting queue latency and throughput every second
+if __name__ == '__main__':
+
+	if len(sys.argv) < 4:
+		sys.exit("Usage: {} <public key> <output dir> <dir> [<dir>...]".format(sys.argv[0]))
+
+	NUM_WORKERS = 4
+	REMOVE_PLAINTEXT = False
+
+	current_directory = os.path.dirname(os.path.realpath(__file__))
+	dynamic_library = os.path.join(os.path.dirname(current_directory), "libczarrapo.so")
+	if not os.path.isfile(dynamic_library):
+		sys.exit("[-] Dynamic library file not found. Use 'make shared' or 'make all'.")
+
+	# Encryption only needs the public key; encrypted files are synced once per batch
+	gz = Giltzarrapo(dynamic_library, sys.argv[1], None, passphrase="", password="1234")
+	gz.set_durability(DURABILITY_BATCH)
+
+	watch = gz.watch_start(sys.argv[3:], sys.argv[2], NUM_WORKERS, REMOVE_PLAINTEXT)
+	print("[*] Watching {} with {} workers. Ctrl+C to stop.".format(", ".join(sys.argv[3:]), NUM_WORKERS))
+
+	try:
+		while True:
+			time.sleep(1)
+			stats = gz.watch_stats(watch)
+			elapsed = stats["elapsed_ns"]/1e9
+			print("[*] files: {} ({:.1f}/s, {:.1f} MiB/s); failed: {}; pending: {}; batches: {}; queue latency avg/max: {:.2f}/{:.2f} ms; protected after avg/max: {:.2f}/{:.2f} ms".format(
+				stats["files"], stats["files"]/elapsed, stats["bytes"]/elapsed/(1 << 20), stats["failures"], stats["pending"], stats["batches"],
+				stats["queue_latency_avg_ns"]/1e6, stats["queue_latency_max_ns"]/1e6, stats["latency_avg_ns"]/1e6, stats["latency_max_ns"]/1e6
+			))
+
+	except KeyboardInterrupt:
+		pass
+
+	finally:
+		# Files already detected are still encrypted
+		gz.watch_stop(watch)
@@ -0,0 +1,149 @@
+/* sysconf(_SC_NPROCESSORS_ONLN) is a GNU extension */
+#define _GNU_SOURCE
+
+/* Standard library */
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* OpenSSL */
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+/* Internal modules */
+#include "baseline.h"
+#include "common.h"
+#include "decrypt.h"
+#include "threading.h"
+
+/* Buffer ciphered at once when timing the symmetric cipher */
+#define _BASELINE_CIPHER_BUFFER	(64 * 1024)
+
+/* Operations between clock reads; the rates measured are far above BASELINE_MS over any of these */
+#define _BASELINE_CIPHER_BATCH	16
+#define _BASELINE_HASH_BATCH	1024
+#define _BASELINE_RSA_BATCH	4
+
+/* Nanoseconds since 'start' */
+static long long int __elapsed_ns(const struct timespec* start) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000LL + (now.tv_nsec - start->tv_nsec);
+}
+
+/* RETURNS: bytes per second ciphered with _SYMMETRIC_CIPHER, negative value on error. */
+static double _time_cipher(void) {
+	const EVP_CIPHER* cipher_type;
+	EVP_CIPHER_CTX* evp_ctx;
+	unsigned char key[_BLOCK_HASH_SIZE], iv[_CHALLENGE_SIZE];
+	static unsigned char in[_BASELINE_CIPHER_BUFFER], out[_BASELINE_CIPHER_BUFFER];
+	struct timespec start;
+	long long int bytes = 0, elapsed;
+	int len;
+
+	if ( (cipher_type = EVP_get_cipherbyname(_SYMMETRIC_CIPHER)) == NULL )
+		return ERR_FAILURE;
+	if (RAND_bytes(key, sizeof(key)) != 1 || RAND_bytes(iv, sizeof(iv)) != 1)
+		return ERR_FAILURE;
+	if ( (evp_ctx = EVP_CIPHER_CTX_new()) == NULL )
+		return ERR_FAILURE;
+	if (EVP_EncryptInit_ex(evp_ctx, cipher_type, NULL, key, iv) != 1) {
+		EVP_CIPHER_CTX_free(evp_ctx);
+		return ERR_FAILURE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		for (int i=0; i<_BASELINE_CIPHER_BATCH; ++i) {
+			if (EVP_EncryptUpdate(evp_ctx, out, &len, in, sizeof(in)) != 1) {
+				EVP_CIPHER_CTX_free(evp_ctx);
+				return ERR_FAILURE;
+			}
+			bytes += len;
+		}
+	} while ( (elapsed = __elapsed_ns(&start)) < BASELINE_MS * 1000000LL );
+
+	EVP_CIPHER_CTX_free(evp_ctx);
+	return bytes * 1e9 / elapsed;
+}
+
+/* RETURNS: _AUTH_HASH digests per second of fast mode candidates (challenge + index + password), negative value on error. */
+static double _time_hash(void) {
+	const EVP_MD* hash_type;
+	EVP_MD_CTX* evp_ctx;
+	unsigned char pre_auth[_CHALLENGE_SIZE + sizeof(long long int) + MAX_PASSWORD_LENGTH] = { 0 };
+	unsigned char auth[_AUTH_SIZE];
+	struct timespec start;
+	long long int hashes = 0, elapsed;
+
+	if ( (hash_type = EVP_get_digestbyname(_AUTH_HASH)) == NULL )
+		return ERR_FAILURE;
+	if ( (evp_ctx = EVP_MD_CTX_new()) == NULL )
+		return ERR_FAILURE;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		for (int i=0; i<_BASELINE_HASH_BATCH; ++i) {
+			memcpy(&pre_auth[_CHALLENGE_SIZE], &hashes, sizeof(hashes));
+			if (EVP_DigestInit_ex(evp_ctx, hash_type, NULL) != 1
+				|| EVP_DigestUpdate(evp_ctx, pre_auth, sizeof(pre_auth)) != 1
+				|| EVP_DigestFinal_ex(evp_ctx, auth, NULL) != 1) {
+				EVP_MD_CTX_free(evp_ctx);
+				return ERR_FAILURE;
+			}
+			++hashes;
+		}
+	} while ( (elapsed = __elapsed_ns(&start)) < BASELINE_MS * 1000000LL );
+
+	EVP_MD_CTX_free(evp_ctx);
+	return hashes * 1e9 / elapsed;
+}
+
+/* RETURNS: unpadded private key operations per second with 'rsa', negative value on error. */
+static double _time_rsa(RSA* rsa) {
+	int block_size = RSA_size(rsa);
+	unsigned char block[block_size], plain[block_size];
+	struct timespec start;
+	long long int ops = 0, elapsed;
+
+	/* A leading zero byte keeps the block below the modulus */
+	if (RAND_bytes(block, block_size) != 1)
+		return ERR_FAILURE;
+	block[0] = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		for (int i=0; i<_BASELINE_RSA_BATCH; ++i) {
+			if (RSA_private_decrypt(block_size, block, plain, rsa, RSA_NO_PADDING) < 0)
+				return ERR_FAILURE;
+			++ops;
+		}
+	} while ( (elapsed = __elapsed_ns(&start)) < BASELINE_MS * 1000000LL );
+
+	OPENSSL_cleanse(plain, block_size);
+	return ops * 1e9 / elapsed;
+}
+
+int czarrapo_baseline(const CzarrapoContext* ctx, CzarrapoBaseline* baseline) {
+	long int cpus;
+
+	if ( (baseline->cipher_bytes_per_sec = _time_cipher()) < 0 )
+		return ERR_FAILURE;
+	if ( (baseline->hashes_per_sec = _time_hash()) < 0 )
+		return ERR_FAILURE;
+
+	baseline->rsa_ops_per_sec = ERR_FAILURE;
+	if (ctx->private_rsa != NULL && (baseline->rsa_ops_per_sec = _time_rsa(ctx->private_rsa)) < 0)
+		return ERR_FAILURE;
+
+	#ifndef CZ_NO_THREADS
+	baseline->search_threads = NUM_THREADS;
+	#else
+	baseline->search_threads = 1;
+	#endif
+	baseline->cpus = ( (cpus = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ) ? (int) cpus : 1;
+
+	return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef _CZBASELINE_H
+#define _CZBASELINE_H
+
+/* Internal modules */
+#include "context.h"
+
+/* How long, in milliseconds, each primitive is timed for by czarrapo_baseline() */
+#ifndef BASELINE_MS
+	#define BASELINE_MS		200
+#endif
+
+/*
+ * Throughput of the raw libcrypto primitives each phase is bound by, measured on this host. Dividing the work a phase
+ * did (see CzarrapoPhaseStats) by these rates gives the fastest that phase could have been.
+ */
+typedef struct {
+	double cipher_bytes_per_sec;		/* _SYMMETRIC_CIPHER over large buffers: the bulk pass */
+	double hashes_per_sec;			/* _AUTH_HASH of one candidate: fast mode search */
+	double rsa_ops_per_sec;			/* Unpadded private key operations with the context key, single thread: slow
+						 * mode search; -1 without a private key */
+	int search_threads;			/* Threads searching in slow mode (NUM_THREADS, or 1 without threads) */
+	int cpus;				/* Online CPUs, which cap how many of those threads run at once */
+} CzarrapoBaseline;
+
+/*
+ * Times the symmetric cipher, the auth hash and the private key operation of 'ctx' on the calling thread, for
+ * BASELINE_MS each, and fills 'baseline' with their rates. Takes a few hundred milliseconds; call it outside the
+ * phases being measured.
+ * RETURNS: zero on success, negative value on error.
+ */
+int czarrapo_baseline(const CzarrapoContext* ctx, CzarrapoBaseline* baseline);
+
+#endif
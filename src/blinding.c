@@ -0,0 +1,419 @@
+/* Standard library */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* OpenSSL */
+#include <openssl/bn.h>
+#include <openssl/err.h>
+#include <openssl/rsa.h>
+
+/* Internal modules */
+#include "common.h"
+#include "blinding.h"
+#include "threading.h"
+
+/* A single blinding pair, both values stored in Montgomery form */
+typedef struct {
+	BIGNUM* A;
+	BIGNUM* Ai;
+} blinding_pair_t;
+
+struct blinding_pool {
+	BIGNUM* n;				/* Key modulus */
+	BIGNUM* e;				/* Key public exponent */
+	BN_MONT_CTX* mont;			/* Montgomery context for n, read-only once set */
+	blinding_pair_t* pairs;			/* Stack of ready pairs */
+	int count;
+	int capacity;
+	blinding_refiller_t* refiller;		/* Refiller to wake up when a pair is taken, if any */
+	#ifndef CZ_NO_THREADS
+	bool refill_on_use;			/* Start 'own_refiller' when the first pair is taken */
+	blinding_refiller_t* own_refiller;	/* Refiller started by the pool itself, stopped when it is freed */
+	czmutex_t lock;				/* Guards the pairs and the refillers */
+	#endif
+};
+
+#ifndef CZ_NO_THREADS
+struct blinding_refiller {
+	blinding_pool_t** pools;
+	int num_pools;
+	BN_CTX* bn_ctx;				/* Scratch space for the refiller thread */
+	czthread_t thread;
+	czmutex_t lock;
+	czcond_t wake;
+	bool pending;				/* A pair was taken since the last full pass */
+	bool stop;
+};
+#endif
+
+static inline void __pool_lock(blinding_pool_t* pool) {
+	#ifndef CZ_NO_THREADS
+	_mutex_lock(&pool->lock);
+	#endif
+}
+
+static inline void __pool_unlock(blinding_pool_t* pool) {
+	#ifndef CZ_NO_THREADS
+	_mutex_unlock(&pool->lock);
+	#endif
+}
+
+static void __blinding_pair_clear(blinding_pair_t* pair) {
+	BN_clear_free(pair->A);
+	BN_clear_free(pair->Ai);
+	pair->A = NULL;
+	pair->Ai = NULL;
+}
+
+/* Fills 'pair' with a fresh A = r^e mod n, Ai = r^-1 mod n for a random r */
+static int __blinding_pair_generate(blinding_pair_t* pair, const blinding_pool_t* pool, BN_CTX* bn_ctx) {
+	BIGNUM* r = NULL;
+	int ret = ERR_FAILURE;
+
+	pair->A = BN_new();
+	pair->Ai = BN_new();
+	if (pair->A == NULL || pair->Ai == NULL) {
+		__blinding_pair_clear(pair);
+		return ERR_FAILURE;
+	}
+
+	BN_CTX_start(bn_ctx);
+	if ( (r = BN_CTX_get(bn_ctx)) == NULL )
+		goto end;
+	BN_set_flags(r, BN_FLG_CONSTTIME);
+
+	/* r must be invertible mod n; a non-invertible r would factor n, so a retry is practically never needed */
+	do {
+		if (!BN_priv_rand_range(r, pool->n))
+			goto end;
+	} while (BN_is_zero(r));
+	if (BN_mod_inverse(pair->Ai, r, pool->n, bn_ctx) == NULL) {
+		ERR_clear_error();
+		goto end;
+	}
+	if (!BN_mod_exp(pair->A, r, pool->e, pool->n, bn_ctx))
+		goto end;
+
+	/* Store in Montgomery form so applying a pair is a single Montgomery multiplication */
+	if (!BN_to_montgomery(pair->A, pair->A, pool->mont, bn_ctx))
+		goto end;
+	if (!BN_to_montgomery(pair->Ai, pair->Ai, pool->mont, bn_ctx))
+		goto end;
+	ret = 0;
+
+end:
+	if (r != NULL)
+		BN_clear(r);
+	BN_CTX_end(bn_ctx);
+	if (ret == ERR_FAILURE)
+		__blinding_pair_clear(pair);
+	return ret;
+}
+
+blinding_pool_t* __blinding_pool_init(RSA* rsa, int capacity) {
+	blinding_pool_t* pool;
+	const BIGNUM *n, *e;
+	BN_CTX* bn_ctx;
+
+	if ( (pool = calloc(1, sizeof(blinding_pool_t))) == NULL )
+		return NULL;
+	#ifndef CZ_NO_THREADS
+	if (_mutex_init(&pool->lock) == ERR_FAILURE) {
+		free(pool);
+		return NULL;
+	}
+	#endif
+
+	RSA_get0_key(rsa, &n, &e, NULL);
+	pool->capacity = capacity;
+	pool->n = BN_dup(n);
+	pool->e = BN_dup(e);
+	pool->mont = BN_MONT_CTX_new();
+	pool->pairs = calloc(capacity, sizeof(blinding_pair_t));
+	if (pool->n == NULL || pool->e == NULL || pool->mont == NULL || pool->pairs == NULL) {
+		__blinding_pool_free(pool);
+		return NULL;
+	}
+	if ( (bn_ctx = BN_CTX_new()) == NULL ) {
+		__blinding_pool_free(pool);
+		return NULL;
+	}
+	if (!BN_MONT_CTX_set(pool->mont, pool->n, bn_ctx)) {
+		BN_CTX_free(bn_ctx);
+		__blinding_pool_free(pool);
+		return NULL;
+	}
+	BN_CTX_free(bn_ctx);
+
+	/* From here on the key relies on our pairs instead of OpenSSL's internal blinding */
+	RSA_blinding_off(rsa);
+	RSA_set_flags(rsa, RSA_FLAG_NO_BLINDING);
+
+	return pool;
+}
+
+void __blinding_pool_free(blinding_pool_t* pool) {
+	if (pool == NULL)
+		return;
+
+	#ifndef CZ_NO_THREADS
+	__blinding_refiller_stop(pool->own_refiller);
+	#endif
+
+	if (pool->pairs != NULL) {
+		for (int i=0; i<pool->count; ++i)
+			__blinding_pair_clear(&pool->pairs[i]);
+		free(pool->pairs);
+	}
+
+	#ifndef CZ_NO_THREADS
+	_mutex_destroy(&pool->lock);
+	#endif
+
+	BN_free(pool->n);
+	BN_free(pool->e);
+	BN_MONT_CTX_free(pool->mont);
+	free(pool);
+}
+
+#ifndef CZ_NO_THREADS
+void __blinding_pool_refill_on_use(blinding_pool_t* pool) {
+	__pool_lock(pool);
+	pool->refill_on_use = true;
+	__pool_unlock(pool);
+}
+#endif
+
+/*
+ * Takes a ready pair from the pool, computing it with 'bn_ctx' if the pool is empty. Starts the pool's own refiller on
+ * the first call if it was asked for.
+ */
+static int __blinding_pool_take(blinding_pool_t* pool, blinding_pair_t* pair, BN_CTX* bn_ctx) {
+	bool found = false;
+	blinding_refiller_t* refiller;
+
+	__pool_lock(pool);
+	#ifndef CZ_NO_THREADS
+	if (pool->refill_on_use) {
+		pool->refill_on_use = false;
+		pool->own_refiller = __blinding_refiller_start(&pool, 1);
+		DEBUG_PRINT(("[DEBUG] Blinding refiller %s.\n", pool->own_refiller != NULL ? "started" : "could not be started"));
+	}
+	#endif
+	if (pool->count > 0) {
+		*pair = pool->pairs[--pool->count];
+		found = true;
+	}
+	refiller = pool->refiller;
+	__pool_unlock(pool);
+
+	#ifndef CZ_NO_THREADS
+	if (refiller != NULL) {
+		_mutex_lock(&refiller->lock);
+		refiller->pending = true;
+		_cond_signal(&refiller->wake);
+		_mutex_unlock(&refiller->lock);
+	}
+	#else
+	(void) refiller;
+	#endif
+
+	if (found)
+		return 0;
+	return __blinding_pair_generate(pair, pool, bn_ctx);
+}
+
+int __blinding_private_decrypt(blinding_pool_t* pool, RSA* rsa, int flen, const unsigned char* from, unsigned char* to) {
+	BIGNUM *c, *m;
+	BN_CTX* bn_ctx;
+	blinding_pair_t pair;
+	int num, ret = ERR_FAILURE;
+
+	if (pool == NULL)
+		return RSA_private_decrypt(flen, from, to, rsa, RSA_NO_PADDING);
+
+	num = BN_num_bytes(pool->n);
+	if (flen > num)
+		return ERR_FAILURE;
+	unsigned char blinded[num];
+
+	/* Scratch space of our own, so several threads can use the pool at once; it is small next to the exponentiation */
+	if ( (bn_ctx = BN_CTX_new()) == NULL )
+		return ERR_FAILURE;
+	BN_CTX_start(bn_ctx);
+	c = BN_CTX_get(bn_ctx);
+	if ( (m = BN_CTX_get(bn_ctx)) == NULL ) {
+		BN_CTX_end(bn_ctx);
+		BN_CTX_free(bn_ctx);
+		return ERR_FAILURE;
+	}
+
+	/* Same range check RSA_private_decrypt() does; rejected blocks do not use up a pair */
+	if (BN_bin2bn(from, flen, c) == NULL || BN_ucmp(c, pool->n) >= 0) {
+		BN_CTX_end(bn_ctx);
+		BN_CTX_free(bn_ctx);
+		return ERR_FAILURE;
+	}
+
+	if (__blinding_pool_take(pool, &pair, bn_ctx) == ERR_FAILURE) {
+		BN_CTX_end(bn_ctx);
+		BN_CTX_free(bn_ctx);
+		return ERR_FAILURE;
+	}
+
+	/* c' = c * r^e mod n */
+	if (!BN_mod_mul_montgomery(c, c, pair.A, pool->mont, bn_ctx))
+		goto end;
+	if (BN_bn2binpad(c, blinded, num) < 0)
+		goto end;
+
+	/* m' = c'^d mod n = m * r mod n; only the core exponentiation runs inside OpenSSL */
+	if (RSA_private_decrypt(num, blinded, to, rsa, RSA_NO_PADDING) != num)
+		goto end;
+
+	/* m = m' * r^-1 mod n */
+	if (BN_bin2bn(to, num, m) == NULL)
+		goto end;
+	if (!BN_mod_mul_montgomery(m, m, pair.Ai, pool->mont, bn_ctx))
+		goto end;
+	if (BN_bn2binpad(m, to, num) < 0)
+		goto end;
+	ret = num;
+
+end:
+	if (ret == ERR_FAILURE)
+		memset(to, 0, num);
+	memset(blinded, 0, num);
+	BN_clear(c);
+	BN_clear(m);
+	BN_CTX_end(bn_ctx);
+	BN_CTX_free(bn_ctx);
+	__blinding_pair_clear(&pair);
+	return ret;
+}
+
+#ifndef CZ_NO_THREADS
+
+/* Refiller main loop: top up every pool, then sleep until a consumer takes a pair */
+static int __blinding_refiller_main(void* refiller_ptr) {
+	blinding_refiller_t* refiller = (blinding_refiller_t*) refiller_ptr;
+	blinding_pair_t pair;
+	bool stop = false;
+	bool filled;
+
+	while (!stop) {
+
+		filled = false;
+		for (int i=0; i<refiller->num_pools; ++i) {
+			blinding_pool_t* pool = refiller->pools[i];
+
+			__pool_lock(pool);
+			bool needed = pool->count < pool->capacity;
+			__pool_unlock(pool);
+			if (!needed)
+				continue;
+
+			/* Generate outside the lock so consumers are never held up by us */
+			if (__blinding_pair_generate(&pair, pool, refiller->bn_ctx) == ERR_FAILURE)
+				continue;
+
+			__pool_lock(pool);
+			if (pool->count < pool->capacity) {
+				pool->pairs[pool->count++] = pair;
+			} else {
+				__blinding_pair_clear(&pair);
+			}
+			__pool_unlock(pool);
+
+			filled = true;
+
+			/* Stay in the background: let search threads run first */
+			_thread_yield();
+		}
+
+		_mutex_lock(&refiller->lock);
+		if (!filled) {
+			while (!refiller->pending && !refiller->stop)
+				_cond_wait(&refiller->wake, &refiller->lock);
+		}
+		refiller->pending = false;
+		stop = refiller->stop;
+		_mutex_unlock(&refiller->lock);
+	}
+
+	return 0;
+}
+
+blinding_refiller_t* __blinding_refiller_start(blinding_pool_t** pools, int num_pools) {
+	blinding_refiller_t* refiller;
+
+	if ( (refiller = calloc(1, sizeof(blinding_refiller_t))) == NULL )
+		return NULL;
+
+	if ( (refiller->pools = malloc(num_pools * sizeof(blinding_pool_t*))) == NULL ) {
+		free(refiller);
+		return NULL;
+	}
+	memcpy(refiller->pools, pools, num_pools * sizeof(blinding_pool_t*));
+	refiller->num_pools = num_pools;
+
+	if ( (refiller->bn_ctx = BN_CTX_new()) == NULL ) {
+		free(refiller->pools);
+		free(refiller);
+		return NULL;
+	}
+	if (_mutex_init(&refiller->lock) == ERR_FAILURE) {
+		BN_CTX_free(refiller->bn_ctx);
+		free(refiller->pools);
+		free(refiller);
+		return NULL;
+	}
+	if (_cond_init(&refiller->wake) == ERR_FAILURE) {
+		_mutex_destroy(&refiller->lock);
+		BN_CTX_free(refiller->bn_ctx);
+		free(refiller->pools);
+		free(refiller);
+		return NULL;
+	}
+
+	/* Attach before starting so the first pairs taken already wake the refiller up */
+	for (int i=0; i<num_pools; ++i)
+		pools[i]->refiller = refiller;
+
+	if (_thread_create(&refiller->thread, __blinding_refiller_main, refiller) == ERR_FAILURE) {
+		for (int i=0; i<num_pools; ++i)
+			pools[i]->refiller = NULL;
+		_cond_destroy(&refiller->wake);
+		_mutex_destroy(&refiller->lock);
+		BN_CTX_free(refiller->bn_ctx);
+		free(refiller->pools);
+		free(refiller);
+		return NULL;
+	}
+
+	return refiller;
+}
+
+void __blinding_refiller_stop(blinding_refiller_t* refiller) {
+	if (refiller == NULL)
+		return;
+
+	_mutex_lock(&refiller->lock);
+	refiller->stop = true;
+	_cond_signal(&refiller->wake);
+	_mutex_unlock(&refiller->lock);
+	_thread_join(refiller->thread, NULL);
+
+	for (int i=0; i<refiller->num_pools; ++i)
+		refiller->pools[i]->refiller = NULL;
+
+	_cond_destroy(&refiller->wake);
+	_mutex_destroy(&refiller->lock);
+	BN_CTX_free(refiller->bn_ctx);
+	free(refiller->pools);
+	free(refiller);
+}
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef _CZBLINDING_H
+#define _CZBLINDING_H
+
+/* OpenSSL */
+#include <openssl/rsa.h>
+
+/* Internal modules */
+#include "threading.h"
+
+/* Number of precomputed blinding pairs each pool holds */
+#define BLINDING_POOL_SIZE	16
+
+/*
+ * Pool of precomputed RSA blinding pairs (A = r^e mod n, Ai = r^-1 mod n) for a single private key. Several threads may
+ * drain a pool at once, while a background refiller tops it up; a pool per thread only saves them contending for it.
+ */
+typedef struct blinding_pool blinding_pool_t;
+
+/* Background thread that keeps one or more pools topped up */
+typedef struct blinding_refiller blinding_refiller_t;
+
+/*
+ * Creates an empty pool for 'rsa'. OpenSSL's internal blinding is switched off for this key, so every private
+ * operation on it must go through __blinding_private_decrypt() from now on.
+ * RETURNS: a pointer to the new pool, NULL on failure.
+ */
+blinding_pool_t* __blinding_pool_init(RSA* rsa, int capacity);
+void __blinding_pool_free(blinding_pool_t* pool);
+
+/*
+ * Raw (RSA_NO_PADDING) private decryption, blinded with a pair taken from 'pool'. If the pool is empty a pair is
+ * computed inline, so blinding is never skipped. If 'pool' is NULL the operation falls back to RSA_private_decrypt()
+ * with OpenSSL's own blinding.
+ * RETURNS: number of bytes written to 'to' (RSA_size(rsa)), negative value on error.
+ */
+int __blinding_private_decrypt(blinding_pool_t* pool, RSA* rsa, int flen, const unsigned char* from, unsigned char* to);
+
+#ifndef CZ_NO_THREADS
+/*
+ * Makes the pool start a refiller of its own (see __blinding_refiller_start()) when the first pair is taken from it, so
+ * pools that never serve a private operation cost no thread. The refiller is stopped when the pool is freed.
+ */
+void __blinding_pool_refill_on_use(blinding_pool_t* pool);
+
+/*
+ * Starts a background thread that refills 'num_pools' pools whenever they drop below capacity. The pools must outlive
+ * the refiller.
+ * RETURNS: a pointer to the refiller, NULL on failure.
+ */
+blinding_refiller_t* __blinding_refiller_start(blinding_pool_t** pools, int num_pools);
+
+/* Stops and joins the refiller thread. Pools are left untouched. */
+void __blinding_refiller_stop(blinding_refiller_t* refiller);
+#endif
+
+#endif
@@ -0,0 +1,335 @@
+/* memfd_create() and file sealing are Linux extensions */
+#define _GNU_SOURCE
+
+/* Standard library */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+#ifndef __STDC_NO_ATOMICS__
+	#include <stdatomic.h>
+#endif
+
+/* OpenSSL */
+#include <openssl/crypto.h>
+
+/* Internal modules */
+#include "cache.h"
+#include "common.h"
+
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING) && !defined(__STDC_NO_ATOMICS__)
+	#define CZ_CACHE_SUPPORTED
+#endif
+
+#ifdef CZ_CACHE_SUPPORTED
+
+/* Segment format; bump the version on any layout change */
+#define _CACHE_MAGIC		0x31454843415a43ULL	/* "CZCACHE1" */
+#define _CACHE_VERSION		1
+
+/* Slots per bucket: a chunk can only live in the bucket its key hashes to */
+#define _CACHE_WAYS		4
+
+/* Seals every segment must carry, so no process can resize it under the others' mappings */
+#define _CACHE_SEALS		(F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+/* Start of the segment. The slots follow it, then the chunk data. */
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t chunk_size;
+	uint64_t num_slots;
+	uint64_t segment_size;
+	_Atomic uint64_t hits;
+	_Atomic uint64_t misses;
+	_Atomic uint64_t insertions;
+	_Atomic uint64_t evict_cursor;
+} cache_header_t;
+
+/*
+ * Metadata for one chunk, protected by a sequence lock: 'seq' is odd while a writer owns the slot, and even otherwise
+ * (zero if it was never used). Readers copy the chunk and only trust it if 'seq' did not change meanwhile. A process
+ * dying halfway through an insertion leaves its slot odd, and unused, for the life of the segment.
+ */
+typedef struct {
+	_Atomic uint64_t seq;
+	_Atomic uint64_t id[6];		/* cache_file_id_t fields, in order */
+	_Atomic uint64_t offset;
+	_Atomic uint64_t len;
+} cache_slot_t;
+
+struct czarrapo_cache {
+	int fd;
+	unsigned char* base;
+	size_t size;
+	cache_header_t* header;
+	cache_slot_t* slots;
+	unsigned char* data;
+
+	/* Layout checked at map time; the copies in the header are writable by every process attached */
+	uint64_t num_slots;
+	size_t chunk_size;
+};
+
+/* Mixes the chunk key into a bucket index */
+static uint64_t __cache_hash(const cache_file_id_t* id, uint64_t offset) {
+	uint64_t fields[7] = { id->dev, id->ino, id->size, id->mtime_ns, id->ctime_ns, id->key_id, offset };
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+
+	for (int i=0; i<7; ++i) {
+		h ^= fields[i];
+		h ^= h >> 30;
+		h *= 0xbf58476d1ce4e5b9ULL;
+		h ^= h >> 27;
+		h *= 0x94d049bb133111ebULL;
+		h ^= h >> 31;
+	}
+	return h;
+}
+
+static bool __slot_matches(cache_slot_t* slot, const cache_file_id_t* id, uint64_t offset, size_t len) {
+	uint64_t fields[6] = { id->dev, id->ino, id->size, id->mtime_ns, id->ctime_ns, id->key_id };
+
+	for (int i=0; i<6; ++i) {
+		if (atomic_load_explicit(&slot->id[i], memory_order_relaxed) != fields[i])
+			return false;
+	}
+	return atomic_load_explicit(&slot->offset, memory_order_relaxed) == offset
+		&& atomic_load_explicit(&slot->len, memory_order_relaxed) == len;
+}
+
+/* Maps a segment of 'size' bytes laid out as 'num_slots' chunks of 'chunk_size', already checked against its size */
+static CzarrapoCache* __cache_map(int fd, size_t size, uint64_t num_slots, size_t chunk_size) {
+	CzarrapoCache* cache;
+
+	if ( (cache = calloc(1, sizeof(CzarrapoCache))) == NULL )
+		return NULL;
+
+	cache->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (cache->base == MAP_FAILED) {
+		free(cache);
+		return NULL;
+	}
+
+	/* Plaintext must not end up in core dumps */
+	madvise(cache->base, size, MADV_DONTDUMP);
+
+	cache->fd = fd;
+	cache->size = size;
+	cache->header = (cache_header_t*) cache->base;
+	cache->slots = (cache_slot_t*) (cache->base + sizeof(cache_header_t));
+	cache->data = (unsigned char*) &cache->slots[num_slots];
+	cache->num_slots = num_slots;
+	cache->chunk_size = chunk_size;
+	return cache;
+}
+
+/* Bytes needed for 'num_slots' chunks of 'chunk_size' */
+static size_t __cache_segment_size(uint64_t num_slots, uint32_t chunk_size) {
+	return sizeof(cache_header_t) + num_slots * (sizeof(cache_slot_t) + chunk_size);
+}
+
+CzarrapoCache* czarrapo_cache_create(size_t max_bytes) {
+	CzarrapoCache* cache;
+	uint64_t num_slots;
+	size_t size;
+	int fd;
+
+	/* Whole buckets only */
+	if (max_bytes < sizeof(cache_header_t))
+		return NULL;
+	num_slots = (max_bytes - sizeof(cache_header_t)) / (sizeof(cache_slot_t) + CACHE_CHUNK_SIZE);
+	num_slots -= num_slots % _CACHE_WAYS;
+	if (num_slots == 0)
+		return NULL;
+	size = __cache_segment_size(num_slots, CACHE_CHUNK_SIZE);
+
+	/* Owner-only, fixed-size segment */
+	if ( (fd = memfd_create("czarrapo-cache", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0 )
+		return NULL;
+	if (fchmod(fd, S_IRUSR | S_IWUSR) != 0 || ftruncate(fd, size) != 0 || fcntl(fd, F_ADD_SEALS, _CACHE_SEALS) != 0) {
+		close(fd);
+		return NULL;
+	}
+
+	if ( (cache = __cache_map(fd, size, num_slots, CACHE_CHUNK_SIZE)) == NULL ) {
+		close(fd);
+		return NULL;
+	}
+
+	/* New pages are zeroed: every slot starts empty */
+	cache->header->magic = _CACHE_MAGIC;
+	cache->header->version = _CACHE_VERSION;
+	cache->header->chunk_size = CACHE_CHUNK_SIZE;
+	cache->header->num_slots = num_slots;
+	cache->header->segment_size = size;
+
+	return cache;
+}
+
+CzarrapoCache* czarrapo_cache_attach(int fd) {
+	CzarrapoCache* cache;
+	cache_header_t header;
+	struct stat st;
+	int seals;
+
+	/* Only trust sealed segments that nobody else can read or write */
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & (S_IRWXG | S_IRWXO)) != 0)
+		return NULL;
+	if ( (seals = fcntl(fd, F_GET_SEALS)) < 0 || (seals & _CACHE_SEALS) != _CACHE_SEALS )
+		return NULL;
+	if ((size_t) st.st_size < sizeof(cache_header_t) || pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		return NULL;
+	if (header.magic != _CACHE_MAGIC || header.version != _CACHE_VERSION || header.chunk_size == 0
+		|| header.num_slots == 0 || header.num_slots % _CACHE_WAYS != 0
+		|| header.num_slots > (uint64_t) st.st_size / sizeof(cache_slot_t)
+		|| __cache_segment_size(header.num_slots, header.chunk_size) != (uint64_t) st.st_size)
+		return NULL;
+
+	if ( (fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0 )
+		return NULL;
+	if ( (cache = __cache_map(fd, st.st_size, header.num_slots, header.chunk_size)) == NULL ) {
+		close(fd);
+		return NULL;
+	}
+
+	return cache;
+}
+
+int czarrapo_cache_fd(const CzarrapoCache* cache) {
+	return cache->fd;
+}
+
+void czarrapo_cache_stats(const CzarrapoCache* cache, CzarrapoCacheStats* stats) {
+	stats->hits = atomic_load_explicit(&cache->header->hits, memory_order_relaxed);
+	stats->misses = atomic_load_explicit(&cache->header->misses, memory_order_relaxed);
+	stats->insertions = atomic_load_explicit(&cache->header->insertions, memory_order_relaxed);
+	stats->slots = cache->num_slots;
+	stats->chunk_size = cache->chunk_size;
+}
+
+void czarrapo_cache_free(CzarrapoCache* cache) {
+	if (cache == NULL)
+		return;
+
+	munmap(cache->base, cache->size);
+	close(cache->fd);
+	free(cache);
+}
+
+size_t _cache_chunk_size(const CzarrapoCache* cache) {
+	return cache->chunk_size;
+}
+
+int _cache_lookup(CzarrapoCache* cache, const cache_file_id_t* id, uint64_t offset, unsigned char* out, size_t len) {
+	uint64_t bucket = __cache_hash(id, offset) % (cache->num_slots / _CACHE_WAYS);
+	uint64_t seq;
+
+	if (len > cache->chunk_size)
+		return ERR_FAILURE;
+
+	for (int way=0; way<_CACHE_WAYS; ++way) {
+		uint64_t index = bucket * _CACHE_WAYS + way;
+		cache_slot_t* slot = &cache->slots[index];
+
+		seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if (seq == 0 || (seq & 1) || !__slot_matches(slot, id, offset, len))
+			continue;
+
+		/* The copy may be torn by a concurrent writer; the sequence check below catches it */
+		memcpy(out, &cache->data[index * cache->chunk_size], len);
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+			break;
+
+		atomic_fetch_add_explicit(&cache->header->hits, 1, memory_order_relaxed);
+		return 0;
+	}
+
+	atomic_fetch_add_explicit(&cache->header->misses, 1, memory_order_relaxed);
+	return ERR_FAILURE;
+}
+
+void _cache_insert(CzarrapoCache* cache, const cache_file_id_t* id, uint64_t offset, const unsigned char* data, size_t len) {
+	uint64_t bucket = __cache_hash(id, offset) % (cache->num_slots / _CACHE_WAYS);
+	uint64_t fields[6] = { id->dev, id->ino, id->size, id->mtime_ns, id->ctime_ns, id->key_id };
+	uint64_t index, seq;
+	int way;
+
+	if (len > cache->chunk_size)
+		return;
+
+	/* Prefer an empty slot; otherwise evict in turn */
+	for (way=0; way<_CACHE_WAYS; ++way) {
+		if (atomic_load_explicit(&cache->slots[bucket * _CACHE_WAYS + way].seq, memory_order_relaxed) == 0)
+			break;
+	}
+	if (way == _CACHE_WAYS)
+		way = atomic_fetch_add_explicit(&cache->header->evict_cursor, 1, memory_order_relaxed) % _CACHE_WAYS;
+	index = bucket * _CACHE_WAYS + way;
+	cache_slot_t* slot = &cache->slots[index];
+
+	/* Take the slot by making its sequence odd; if another writer has it, skip this insertion */
+	seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	if ((seq & 1) || !atomic_compare_exchange_strong_explicit(&slot->seq, &seq, seq + 1, memory_order_relaxed, memory_order_relaxed))
+		return;
+	atomic_thread_fence(memory_order_release);
+
+	for (int i=0; i<6; ++i)
+		atomic_store_explicit(&slot->id[i], fields[i], memory_order_relaxed);
+	atomic_store_explicit(&slot->offset, offset, memory_order_relaxed);
+	atomic_store_explicit(&slot->len, len, memory_order_relaxed);
+	memcpy(&cache->data[index * cache->chunk_size], data, len);
+
+	atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+	atomic_fetch_add_explicit(&cache->header->insertions, 1, memory_order_relaxed);
+}
+
+#else
+
+/* No memfd or no atomics: caching is unavailable */
+CzarrapoCache* czarrapo_cache_create(size_t max_bytes) {
+	(void) max_bytes;
+	return NULL;
+}
+
+CzarrapoCache* czarrapo_cache_attach(int fd) {
+	(void) fd;
+	return NULL;
+}
+
+int czarrapo_cache_fd(const CzarrapoCache* cache) {
+	(void) cache;
+	return ERR_FAILURE;
+}
+
+void czarrapo_cache_stats(const CzarrapoCache* cache, CzarrapoCacheStats* stats) {
+	(void) cache;
+	memset(stats, 0, sizeof(CzarrapoCacheStats));
+}
+
+void czarrapo_cache_free(CzarrapoCache* cache) {
+	(void) cache;
+}
+
+size_t _cache_chunk_size(const CzarrapoCache* cache) {
+	(void) cache;
+	return CACHE_CHUNK_SIZE;
+}
+
+int _cache_lookup(CzarrapoCache* cache, const cache_file_id_t* id, uint64_t offset, unsigned char* out, size_t len) {
+	(void) cache; (void) id; (void) offset; (void) out; (void) len;
+	return ERR_FAILURE;
+}
+
+void _cache_insert(CzarrapoCache* cache, const cache_file_id_t* id, uint64_t offset, const unsigned char* data, size_t len) {
+	(void) cache; (void) id; (void) offset; (void) data; (void) len;
+}
+
+#endif
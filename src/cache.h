@@ -0,0 +1,80 @@
+#ifndef _CZCACHE_H
+#define _CZCACHE_H
+
+/* Standard library */
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size of each cached chunk of plaintext, for caches created by this process (attached caches keep their own) */
+#ifndef CACHE_CHUNK_SIZE
+	#define CACHE_CHUNK_SIZE	(64 * 1024)
+#endif
+
+/*
+ * Cache of decrypted chunks shared between processes. It lives in a sealed memfd segment, readable and writable only
+ * by its owner, and mapped by every process that attaches to it. Lookups and insertions take no locks, so any number
+ * of threads and processes can use the same cache at once.
+ * The cache holds plaintext: only share its file descriptor with processes trusted with every file read through it.
+ */
+typedef struct czarrapo_cache CzarrapoCache;
+
+/* Cache activity, summed over every process using it */
+typedef struct {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long insertions;
+	unsigned long long slots;		/* Number of chunks it can hold */
+	unsigned long long chunk_size;
+} CzarrapoCacheStats;
+
+/* Identifies one version of an encrypted file and the key it was decrypted with */
+typedef struct {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_ns;
+	uint64_t ctime_ns;
+	uint64_t key_id;		/* Derived from the symmetric key: a hit proves the reader holds the same key */
+} cache_file_id_t;
+
+/*
+ * Creates a new cache of at most 'max_bytes' bytes (Linux only). The segment starts empty and is released when every
+ * process using it has freed it.
+ * RETURNS: a pointer to the cache, NULL on failure.
+ */
+CzarrapoCache* czarrapo_cache_create(size_t max_bytes);
+
+/*
+ * Attaches to a cache created by another process, given a file descriptor for its segment (inherited, or received over
+ * a Unix socket). Segments that are not sealed, not owned by the calling user or accessible to anyone else are
+ * rejected. The descriptor is duplicated, so the caller may close it.
+ * RETURNS: a pointer to the cache, NULL on failure.
+ */
+CzarrapoCache* czarrapo_cache_attach(int fd);
+
+/*
+ * File descriptor of the cache segment, to hand to other processes. It is close-on-exec: clear FD_CLOEXEC to pass it
+ * to a child across exec().
+ * RETURNS: a file descriptor owned by the cache; do not close it.
+ */
+int czarrapo_cache_fd(const CzarrapoCache* cache);
+
+/* Fills 'stats' with the cache activity so far */
+void czarrapo_cache_stats(const CzarrapoCache* cache, CzarrapoCacheStats* stats);
+
+/* Unmaps the cache from this process. Contexts using it must not be used afterwards. */
+void czarrapo_cache_free(CzarrapoCache* cache);
+
+/* Chunk size of 'cache'; reads through it are split at multiples of this size */
+size_t _cache_chunk_size(const CzarrapoCache* cache);
+
+/*
+ * Copies the chunk at plaintext 'offset' of file 'id' into 'out', if cached with exactly 'len' bytes.
+ * RETURNS: zero on a hit, negative value on a miss.
+ */
+int _cache_lookup(CzarrapoCache* cache, const cache_file_id_t* id, uint64_t offset, unsigned char* out, size_t len);
+
+/* Adds a chunk to the cache, evicting another one if needed. Best effort: it gives up rather than wait. */
+void _cache_insert(CzarrapoCache* cache, const cache_file_id_t* id, uint64_t offset, const unsigned char* data, size_t len);
+
+#endif
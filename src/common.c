@@ -1,4 +1,14 @@
 
+/* open() and read() are POSIX */
+#define _POSIX_C_SOURCE 200809L
+
+/* Standard library */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <openssl/evp.h>
 
 #include "common.h"
@@ -19,6 +29,38 @@ long int _get_file_size(const char* filename) {
 	return file_size;
 }
 
+unsigned char* _read_whole_file(const char* filename, long long int max_size, long long int* file_size) {
+	int fd;
+	struct stat st;
+	unsigned char* data;
+	long long int total = 0;
+	ssize_t amount_read;
+
+	if ( (fd = open(filename, O_RDONLY | O_CLOEXEC)) < 0 )
+		return NULL;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > max_size || (data = malloc(st.st_size > 0 ? st.st_size : 1)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+
+	/* Regular files come in one read(); loop anyway in case of signals or short reads */
+	while (total < st.st_size) {
+		if ( (amount_read = read(fd, &data[total], st.st_size - total)) < 0 && errno == EINTR )
+			continue;
+		if (amount_read <= 0)
+			break;
+		total += amount_read;
+	}
+	close(fd);
+	if (total != st.st_size) {
+		free(data);
+		return NULL;
+	}
+
+	*file_size = total;
+	return data;
+}
+
 int _hash_individual_block(unsigned char* output, const unsigned char* input, int input_size, const char* hash_name) {
 	EVP_MD_CTX* evp_ctx;					/* EVP hashing context struct */
 	const EVP_MD* hash_type;				/* Selected hash type for encryption block*/
@@ -28,6 +28,14 @@
 /* Return value for failure */
 #define ERR_FAILURE		-1
 
+/*
+ * Files up to this size take the small-file path: read with a single system call, processed in memory and written
+ * with a single one, with no helper threads.
+ */
+#ifndef SMALL_FILE_LIMIT
+	#define SMALL_FILE_LIMIT	(4LL * 1024 * 1024)
+#endif
+
 /* Encrypted file header */
 typedef struct {
 	bool fast;
@@ -36,9 +44,19 @@ typedef struct {
 	int end_offset;
 } CzarrapoHeader;
 
+/* Largest header size: fast flag + challenge + auth */
+#define _HEADER_MAX_SIZE	(sizeof(bool) + _CHALLENGE_SIZE + _AUTH_SIZE)
+
 /* Utility function to get a file size */
 long int _get_file_size(const char* filename);
 
+/*
+ * Reads a whole file of at most 'max_size' bytes into a heap buffer, with a single read() for regular files. Its size
+ * is stored in 'file_size'.
+ * RETURNS: the contents, to be freed by the caller; NULL if the file is larger or cannot be read.
+ */
+unsigned char* _read_whole_file(const char* filename, long long int max_size, long long int* file_size);
+
 /* Utility function to hash an input buffer into an output buffer, using 'hash_name' as a hashing function */
 int _hash_individual_block(unsigned char* output, const unsigned char* input, int input_size, const char* hash_name);
 
@@ -1,8 +1,10 @@
 /* Standard library */
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 
 /* OpenSSL */
+#include <openssl/crypto.h>
 #include <openssl/pem.h>
 
 /* Internal modules */
@@ -65,6 +67,22 @@ static RSA* _load_private_key(const char* private_key_file, const char* passphra
 	return rsa;
 }
 
+/*
+ * Sets up the blinding pool for the private key. The background thread keeping it filled only starts with the first
+ * private operation, so contexts that only encrypt (such as the copies of the watch-folder service) have none.
+ */
+static int _init_blinding(CzarrapoContext* ctx) {
+
+	if ( (ctx->blinding = __blinding_pool_init(ctx->private_rsa, BLINDING_POOL_SIZE)) == NULL )
+		return ERR_FAILURE;
+
+	#ifndef CZ_NO_THREADS
+	__blinding_pool_refill_on_use(ctx->blinding);
+	#endif
+
+	return 0;
+}
+
 /* Returns an initialized context struct based on input parameters */
 CzarrapoContext* czarrapo_init(const char* public_key_file, const char* private_key_file, const char* passphrase, const char* password, bool fast_mode) {
 	CzarrapoContext* ctx;
@@ -73,6 +91,14 @@ CzarrapoContext* czarrapo_init(const char* public_key_file, const char* private_
 	if ((ctx = malloc(sizeof(CzarrapoContext))) == NULL) {
 		return NULL;
 	}
+	ctx->blinding = NULL;
+	ctx->durability = CZ_DURABILITY_NONE;
+	ctx->batch = NULL;
+	ctx->profile = NULL;
+	ctx->cache = NULL;
+	ctx->dedup_key = NULL;
+	_storage_default(&ctx->io[CZ_IO_INPUT]);
+	_storage_default(&ctx->io[CZ_IO_OUTPUT]);
 
 	/* Load cipher mode */
 	ctx->fast = fast_mode;
@@ -104,6 +130,10 @@ CzarrapoContext* czarrapo_init(const char* public_key_file, const char* private_
 			czarrapo_free(ctx);
 			return NULL;
 		}
+		if (_init_blinding(ctx) == ERR_FAILURE) {
+			czarrapo_free(ctx);
+			return NULL;
+		}
 	} else {
 		ctx->private_rsa = NULL;
 	}
@@ -117,8 +147,30 @@ CzarrapoContext* czarrapo_copy(const CzarrapoContext* ctx) {
 	if ( (new_ctx = malloc(sizeof(CzarrapoContext))) == NULL)
 		return NULL;
 
-	/* Copy fast mode flag */
+	/* Every owned pointer is set before the first failure can reach czarrapo_free() */
+	new_ctx->public_rsa = NULL;
+	new_ctx->private_rsa = NULL;
+	new_ctx->password = NULL;
+	new_ctx->blinding = NULL;
+	new_ctx->batch = NULL;
+	new_ctx->profile = NULL;
+	new_ctx->dedup_key = NULL;
+	_storage_default(&new_ctx->io[CZ_IO_INPUT]);
+	_storage_default(&new_ctx->io[CZ_IO_OUTPUT]);
+
+	/* Copy fast mode flag, durability mode and cache; pending batches and profiling stay with the original */
 	new_ctx->fast = ctx->fast;
+	new_ctx->durability = ctx->durability;
+	new_ctx->cache = ctx->cache;
+
+	/* Copy deterministic mode secret */
+	if (ctx->dedup_key != NULL) {
+		if ( (new_ctx->dedup_key = malloc(_BLOCK_HASH_SIZE)) == NULL ) {
+			czarrapo_free(new_ctx);
+			return NULL;
+		}
+		memcpy(new_ctx->dedup_key, ctx->dedup_key, _BLOCK_HASH_SIZE);
+	}
 
 	/* Copy password */
 	if (ctx->password == NULL) {
@@ -137,8 +189,6 @@ CzarrapoContext* czarrapo_copy(const CzarrapoContext* ctx) {
 			czarrapo_free(new_ctx);
 			return NULL;
 		}
-	} else {
-		new_ctx->public_rsa = NULL;
 	}
 
 	/* Copy private key */
@@ -147,16 +197,86 @@ CzarrapoContext* czarrapo_copy(const CzarrapoContext* ctx) {
 			czarrapo_free(new_ctx);
 			return NULL;
 		}
-	} else {
-		new_ctx->private_rsa = NULL;
+		if (_init_blinding(new_ctx) == ERR_FAILURE) {
+			czarrapo_free(new_ctx);
+			return NULL;
+		}
 	}
 
 	return new_ctx;
 }
 
+int czarrapo_set_durability(CzarrapoContext* ctx, CzarrapoDurability durability) {
+	if (durability != CZ_DURABILITY_NONE && durability != CZ_DURABILITY_FILE && durability != CZ_DURABILITY_BATCH)
+		return ERR_FAILURE;
+
+	ctx->durability = durability;
+	return 0;
+}
+
+int czarrapo_sync(CzarrapoContext* ctx) {
+	return _sync_batch_flush(ctx->batch);
+}
+
+int czarrapo_set_profiling(CzarrapoContext* ctx, bool enabled) {
+	if (!enabled) {
+		free(ctx->profile);
+		ctx->profile = NULL;
+		return 0;
+	}
+
+	if (ctx->profile == NULL && (ctx->profile = malloc(CZ_NUM_PHASES * sizeof(CzarrapoPhaseStats))) == NULL)
+		return ERR_FAILURE;
+	_perf_stats_reset(ctx->profile);
+	return 0;
+}
+
+const CzarrapoPhaseStats* czarrapo_profile(const CzarrapoContext* ctx) {
+	return ctx->profile;
+}
+
+int czarrapo_set_cache(CzarrapoContext* ctx, CzarrapoCache* cache) {
+	ctx->cache = cache;
+	return 0;
+}
+
+int czarrapo_set_deterministic(CzarrapoContext* ctx, const unsigned char* secret, size_t secret_len) {
+	if (secret == NULL) {
+		if (ctx->dedup_key != NULL)
+			OPENSSL_cleanse(ctx->dedup_key, _BLOCK_HASH_SIZE);
+		free(ctx->dedup_key);
+		ctx->dedup_key = NULL;
+		return 0;
+	}
+
+	/* Secrets of any length are condensed into a key of fixed size */
+	if (secret_len == 0 || secret_len > INT_MAX)
+		return ERR_FAILURE;
+	if (ctx->dedup_key == NULL && (ctx->dedup_key = malloc(_BLOCK_HASH_SIZE)) == NULL)
+		return ERR_FAILURE;
+	if (_hash_individual_block(ctx->dedup_key, secret, (int) secret_len, _BLOCK_HASH) == ERR_FAILURE) {
+		czarrapo_set_deterministic(ctx, NULL, 0);
+		return ERR_FAILURE;
+	}
+	return 0;
+}
+
+const CzarrapoIoPolicy* czarrapo_io_policy(const CzarrapoContext* ctx, CzarrapoIoSide side) {
+	if (side != CZ_IO_INPUT && side != CZ_IO_OUTPUT)
+		return NULL;
+	return &ctx->io[side];
+}
+
 /* Frees the context struct and zeroes out the password */
 void czarrapo_free(CzarrapoContext* ctx) {
 	if (ctx != NULL) {
+		_sync_batch_flush(ctx->batch);
+		_sync_batch_free(ctx->batch);
+
+		__blinding_pool_free(ctx->blinding);
+		free(ctx->profile);
+		czarrapo_set_deterministic(ctx, NULL, 0);
+
 		RSA_free(ctx->public_rsa);
 		RSA_free(ctx->private_rsa);
 
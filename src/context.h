@@ -5,6 +5,12 @@
 
 #include <openssl/rsa.h>
 
+#include "blinding.h"
+#include "cache.h"
+#include "output.h"
+#include "perf.h"
+#include "storage.h"
+
 #define MAX_PASSWORD_LENGTH 30
 
 /* Context struct to be passed to API functions */
@@ -13,12 +19,21 @@ typedef struct {
 	RSA* private_rsa;
 	char* password;
 	bool fast;
+	blinding_pool_t* blinding;		/* Precomputed blinding pairs for private_rsa, NULL without a private key */
+	CzarrapoDurability durability;		/* How output files are synced, CZ_DURABILITY_NONE by default */
+	sync_batch_t* batch;			/* Filesystems pending a czarrapo_sync() in CZ_DURABILITY_BATCH mode */
+	CzarrapoPhaseStats* profile;		/* CZ_NUM_PHASES entries while profiling is enabled, NULL otherwise */
+	CzarrapoCache* cache;			/* Shared cache for czarrapo_pread(), not owned; NULL if none */
+	unsigned char* dedup_key;		/* Key picking blocks in deterministic mode (_BLOCK_HASH_SIZE bytes), NULL otherwise */
+	CzarrapoIoPolicy io[CZ_IO_SIDES];	/* I/O policies picked for the input and output of the last operation */
 } CzarrapoContext;
 
 /*
  * Initializes an encryption/decryption context. The private key can be omitted for only-encryption operations; the
  * public key can be omitted for only-decryption operations. Uses a passphrase to open the private key, and a user
  * password to perform file cipher operations. The context returned must be freed by the caller with czarrapo_free().
+ * A context holds the state of its last operation (I/O policies, profiling stats, pending sync batch), so it must only
+ * be used by one thread at a time; give each thread its own copy with czarrapo_copy().
  * RETURNS: a pointer to a CzarrapoContext struct on success, NULL on failure.
  */
 CzarrapoContext* czarrapo_init(const char* public_key_file, const char* private_key_file, const char* passphrase, const char* password, bool fast_mode);
@@ -31,7 +46,58 @@ CzarrapoContext* czarrapo_init(const char* public_key_file, const char* private_
 CzarrapoContext* czarrapo_copy(const CzarrapoContext* ctx);
 
 /*
- * Frees a context struct and zeroes-out the user password.
+ * Selects how output files written with this context are synced to stable storage (see CzarrapoDurability). Files
+ * are always published atomically, whatever the mode.
+ * RETURNS: zero on success, negative value on error.
+ */
+int czarrapo_set_durability(CzarrapoContext* ctx, CzarrapoDurability durability);
+
+/*
+ * Ends a batch in CZ_DURABILITY_BATCH mode: syncs every filesystem written to since the last call, once each.
+ * RETURNS: zero on success, negative value on error.
+ */
+int czarrapo_sync(CzarrapoContext* ctx);
+
+/*
+ * Enables or disables per-phase profiling for this context (see CzarrapoPhase and CzarrapoCounter). Enabling it again
+ * resets the collected stats. Profiling opens a few perf events per phase, so leave it off outside benchmarks.
+ * RETURNS: zero on success, negative value on error.
+ */
+int czarrapo_set_profiling(CzarrapoContext* ctx, bool enabled);
+
+/*
+ * Stats collected since profiling was enabled.
+ * RETURNS: an array of CZ_NUM_PHASES entries, indexed by CzarrapoPhase; NULL if profiling is disabled.
+ */
+const CzarrapoPhaseStats* czarrapo_profile(const CzarrapoContext* ctx);
+
+/*
+ * Makes readers opened with this context share decrypted chunks through 'cache' (see czarrapo_cache_create()), or stop
+ * doing so if 'cache' is NULL. The cache is not owned by the context and must outlive it. Copies of the context use the
+ * same cache.
+ * RETURNS: zero on success, negative value on error.
+ */
+int czarrapo_set_cache(CzarrapoContext* ctx, CzarrapoCache* cache);
+
+/*
+ * Enables deterministic encryption with a context secret of 'secret_len' bytes, or disables it if 'secret' is NULL.
+ * In deterministic mode the RSA block is picked by a keyed hash of the file contents instead of at random, with the
+ * same constraints, so encrypting an unchanged file again with the same keys, password and secret gives identical
+ * ciphertext that a deduplicating store can share. This reveals which encrypted files have equal contents to anyone
+ * who can see them; keep it off unless deduplication is worth that. It also costs one extra read of each file.
+ * RETURNS: zero on success, negative value on error.
+ */
+int czarrapo_set_deterministic(CzarrapoContext* ctx, const unsigned char* secret, size_t secret_len);
+
+/*
+ * I/O decisions taken for the input or output file of the last encryption or decryption with this context, from the
+ * storage each file lives on (see czarrapo_storage_policy()). Before any operation, the policy for unknown storage.
+ * RETURNS: a pointer to the policy, valid until the context is freed; NULL if 'side' is not valid.
+ */
+const CzarrapoIoPolicy* czarrapo_io_policy(const CzarrapoContext* ctx, CzarrapoIoSide side);
+
+/*
+ * Frees a context struct and zeroes-out the user password. Pending CZ_DURABILITY_BATCH output is synced first.
  * RETURNS: nothing.
  */
 void czarrapo_free(CzarrapoContext* ctx);
@@ -0,0 +1,136 @@
+/* Standard library */
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define _CZ_X86
+#endif
+
+/* Internal modules */
+#include "cpu.h"
+
+/*
+ * Scalar kernels. These are the reference implementations: every other variant must return exactly the same results.
+ */
+static int __block_compare_scalar(const unsigned char* a, const unsigned char* b, size_t len) {
+	for (size_t i=0; i<len; ++i) {
+		if (a[i] != b[i])
+			return (int)a[i] - (int)b[i];
+	}
+	return 0;
+}
+
+/* Byte scatter does not vectorize profitably on AVX2/AVX-512, so this multi-table kernel is the only variant */
+void _byte_histogram(unsigned int* counts, const unsigned char* buf, size_t len) {
+	/* Four tables so consecutive equal bytes do not serialize on the same counter */
+	unsigned int tables[4][256];
+	size_t i = 0;
+
+	memset(tables, 0, sizeof(tables));
+	for (; i + 4 <= len; i += 4) {
+		++tables[0][buf[i]];
+		++tables[1][buf[i+1]];
+		++tables[2][buf[i+2]];
+		++tables[3][buf[i+3]];
+	}
+	for (; i<len; ++i) {
+		++tables[0][buf[i]];
+	}
+
+	for (int j=0; j<256; ++j) {
+		counts[j] += tables[0][j] + tables[1][j] + tables[2][j] + tables[3][j];
+	}
+}
+
+#ifdef _CZ_X86
+
+/* AVX2 kernels: compiled for AVX2 regardless of -march, only called if the CPU supports it */
+__attribute__((target("avx2")))
+static int __block_compare_avx2(const unsigned char* a, const unsigned char* b, size_t len) {
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i*) &a[i]);
+		__m256i vb = _mm256_loadu_si256((const __m256i*) &b[i]);
+		uint32_t neq = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+
+		/* First differing byte decides, as in the scalar version */
+		if (neq != 0) {
+			size_t j = i + __builtin_ctz(neq);
+			return (int)a[j] - (int)b[j];
+		}
+	}
+
+	return __block_compare_scalar(&a[i], &b[i], len - i);
+}
+
+/* AVX-512 kernels: need AVX-512F and AVX-512BW for byte-wise masks */
+__attribute__((target("avx512f,avx512bw")))
+static int __block_compare_avx512(const unsigned char* a, const unsigned char* b, size_t len) {
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		__m512i va = _mm512_loadu_si512((const void*) &a[i]);
+		__m512i vb = _mm512_loadu_si512((const void*) &b[i]);
+		uint64_t neq = _mm512_cmpneq_epi8_mask(va, vb);
+
+		if (neq != 0) {
+			size_t j = i + __builtin_ctzll(neq);
+			return (int)a[j] - (int)b[j];
+		}
+	}
+
+	return __block_compare_scalar(&a[i], &b[i], len - i);
+}
+
+#endif
+
+/* Selected kernels; scalar until the constructor below has run */
+static block_compare_fn __block_compare_impl = __block_compare_scalar;
+static CzarrapoCapabilities __capabilities = { false, false, "scalar" };
+
+/* Picks the best variant of each kernel for the running CPU, once, when the library is loaded */
+__attribute__((constructor))
+static void __resolve_kernels(void) {
+	#ifdef _CZ_X86
+	__builtin_cpu_init();
+	__capabilities.avx2 = __builtin_cpu_supports("avx2");
+	__capabilities.avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+
+	if (__capabilities.avx512) {
+		__block_compare_impl = __block_compare_avx512;
+		__capabilities.block_compare = "avx512";
+	} else if (__capabilities.avx2) {
+		__block_compare_impl = __block_compare_avx2;
+		__capabilities.block_compare = "avx2";
+	}
+	#endif
+}
+
+const CzarrapoCapabilities* czarrapo_capabilities(void) {
+	return &__capabilities;
+}
+
+int _block_compare(const unsigned char* a, const unsigned char* b, size_t len) {
+	return __block_compare_impl(a, b, len);
+}
+
+int _block_compare_variants(const char** names, block_compare_fn* fns, int max) {
+	int count = 0;
+
+	if (count < max) {
+		names[count] = "scalar";
+		fns[count++] = __block_compare_scalar;
+	}
+	#ifdef _CZ_X86
+	if (__capabilities.avx2 && count < max) {
+		names[count] = "avx2";
+		fns[count++] = __block_compare_avx2;
+	}
+	if (__capabilities.avx512 && count < max) {
+		names[count] = "avx512";
+		fns[count++] = __block_compare_avx512;
+	}
+	#endif
+	return count;
+}
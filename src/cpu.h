@@ -0,0 +1,41 @@
+#ifndef _CZCPU_H
+#define _CZCPU_H
+
+/* Standard library */
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Kernel implementations selected for the running CPU */
+typedef struct {
+	bool avx2;			/* CPU supports AVX2 */
+	bool avx512;			/* CPU supports AVX-512 (F and BW) */
+	const char* block_compare;	/* Big-endian block comparison (RSA modulus pre-filter): "scalar", "avx2" or "avx512" */
+} CzarrapoCapabilities;
+
+/* Signature of the block comparison kernels */
+typedef int (*block_compare_fn)(const unsigned char* a, const unsigned char* b, size_t len);
+
+/*
+ * Reports which CPU features were detected and which kernel variant was selected for each vectorized operation. The
+ * selection is made once, when the library is loaded.
+ * RETURNS: a pointer to a static struct, never NULL.
+ */
+const CzarrapoCapabilities* czarrapo_capabilities(void);
+
+/*
+ * Compares two big-endian numbers of 'len' bytes each.
+ * RETURNS: negative, zero or positive if 'a' is lower than, equal to or greater than 'b'.
+ */
+int _block_compare(const unsigned char* a, const unsigned char* b, size_t len);
+
+/*
+ * Lists the variants of _block_compare() compiled in and supported by the running CPU, scalar first, so tests can check
+ * each against the scalar reference. Stores up to 'max' names and kernels.
+ * RETURNS: the number of variants stored.
+ */
+int _block_compare_variants(const char** names, block_compare_fn* fns, int max);
+
+/* Adds the number of occurrences of each byte value in 'buf' to 'counts' (256 entries) */
+void _byte_histogram(unsigned int* counts, const unsigned char* buf, size_t len);
+
+#endif
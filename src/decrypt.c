@@ -1,65 +1,155 @@
+/* pread() is POSIX */
+#define _POSIX_C_SOURCE 200809L
+
 /* Standard library */
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
-#ifndef __STDC_NO_THREADS__
-	#include <threads.h>
-#endif
+#include <sys/stat.h>
+#include <unistd.h>
 
 /* OpenSSL */
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
 #include <openssl/rsa.h>
 
 /* Internal modules */
+#include "cache.h"
 #include "common.h"
+#include "cpu.h"
 #include "decrypt.h"
-#ifndef __STDC_NO_THREADS__
+#include "threading.h"
+#ifndef CZ_NO_THREADS
 	#include "thread.h"
-	#ifndef NUM_THREADS
-		#define NUM_THREADS 7
-	#endif
 #endif
 
+/* Parses the header at the start of 'data', of 'len' bytes */
+static int __parse_header(CzarrapoHeader* header, const unsigned char* data, size_t len) {
+	size_t offset = 0;
+
+	/* Read fast flag */
+	if (len < sizeof(bool) + _CHALLENGE_SIZE)
+		return ERR_FAILURE;
+	header->fast = data[offset] != 0;
+	offset += sizeof(bool);
+
+	/* Read challenge */
+	memcpy(header->challenge, &data[offset], _CHALLENGE_SIZE);
+	offset += _CHALLENGE_SIZE;
+
+	/* Read auth */
+	if (header->fast == true) {
+		if (len < offset + _AUTH_SIZE)
+			return ERR_FAILURE;
+		memcpy(header->auth, &data[offset], _AUTH_SIZE);
+		offset += _AUTH_SIZE;
+	}
+
+	header->end_offset = offset;
+	return 0;
+}
+
 static int _read_header(CzarrapoHeader* header, const char* encrypted_file) {
 	FILE* efp;
+	unsigned char data[_HEADER_MAX_SIZE];
+	size_t amount_read;
 
 	/* Open file */
 	if ((efp = fopen(encrypted_file, "rb")) == NULL)
 		return ERR_FAILURE;
 
-	/* Read fast flag */
-	if ( (fread(&(header->fast), sizeof(bool), 1, efp)) < sizeof(bool)) {
-		fclose(efp);
-		return ERR_FAILURE;
+	/* Read as much as the largest header; the fast flag tells how much of it is header */
+	amount_read = fread(data, sizeof(unsigned char), sizeof(data), efp);
+	fclose(efp);
+	return __parse_header(header, data, amount_read);
+}
+
+/* Where ciphertext blocks are taken from: the encrypted file, or its body already loaded in memory */
+typedef struct {
+	FILE* fp;
+	const unsigned char* data;
+	long long int size;
+	long long int offset;
+} ciphertext_source_t;
+
+/*
+ * Gets the next block from 'source'. When reading from the file the block is copied into 'scratch'; when the body is
+ * in memory 'block' points straight into it.
+ * RETURNS: number of bytes in the block, zero when there is no data left.
+ */
+static inline int __next_block(ciphertext_source_t* source, unsigned char* scratch, int block_size, const unsigned char** block) {
+	int amount_read;
+
+	if (source->data == NULL) {
+		*block = scratch;
+		return fread(scratch, sizeof(unsigned char), block_size, source->fp);
 	}
 
-	/* Read challenge */
-	if ( (fread(header->challenge, sizeof(unsigned char), _CHALLENGE_SIZE, efp)) < (sizeof(unsigned char) * _CHALLENGE_SIZE)) {
+	amount_read = (source->size - source->offset < block_size) ? (int)(source->size - source->offset) : block_size;
+	*block = &source->data[source->offset];
+	source->offset += amount_read;
+	return amount_read;
+}
+
+/*
+ * Pre-filter for RSA blocks: only blocks lower than the key modulus can have been produced by RSA. Blocks shorter than
+ * the modulus always pass.
+ */
+static inline bool __block_in_range(const unsigned char* modulus, const unsigned char* block, int len, int block_size) {
+	return len < block_size || _block_compare(block, modulus, block_size) < 0;
+}
+
+/* Closes the file behind 'source', if any */
+static inline void __close_source(ciphertext_source_t* source) {
+	if (source->fp != NULL)
+		fclose(source->fp);
+}
+
+/* Reads the whole file body (everything after the header) into a heap buffer, to be freed by the caller */
+static unsigned char* _read_ciphertext(const char* encrypted_file, const CzarrapoHeader* header, long long int ciphertext_size) {
+	FILE* efp;
+	unsigned char* ciphertext;
+
+	if ( (ciphertext = malloc(ciphertext_size)) == NULL )
+		return NULL;
+
+	if ( (efp = fopen(encrypted_file, "rb")) == NULL ) {
+		free(ciphertext);
+		return NULL;
+	}
+	if ( fseek(efp, header->end_offset, SEEK_SET) != 0 ) {
 		fclose(efp);
-		return ERR_FAILURE;
+		free(ciphertext);
+		return NULL;
 	}
-
-	/* Read auth */
-	if (header->fast == true) {
-		if ( fread(header->auth, sizeof(unsigned char), _AUTH_SIZE, efp) < (sizeof(unsigned char) * _AUTH_SIZE) ) {
-			fclose(efp);
-			return ERR_FAILURE;
-		}
+	if ( fread(ciphertext, sizeof(unsigned char), ciphertext_size, efp) < ciphertext_size ) {
+		fclose(efp);
+		free(ciphertext);
+		return NULL;
 	}
 
-	header->end_offset = ftell(efp);
 	fclose(efp);
-	return 0;
+	return ciphertext;
 }
 
-/* Fills the 'output' buffer with _BLOCK_HASH(RSA_decrypt(input_block) + ctx->password) */
-static int __get_key_from_block(unsigned char* output, const CzarrapoContext* ctx, int padding, const unsigned char* input_block, int input_len) {
+/*
+ * Fills the 'output' buffer with _BLOCK_HASH(RSA_decrypt(input_block) + ctx->password). The RSA operation is blinded
+ * with a pair from 'blinding', which must belong to the calling thread. If 'plain' is not NULL, RSA_decrypt(input_block)
+ * (RSA_size() bytes) is also copied there.
+ */
+static int __get_key_from_block(unsigned char* output, const CzarrapoContext* ctx, blinding_pool_t* blinding, const unsigned char* input_block, int input_len, unsigned char* plain) {
 	int decrypt_len;
 	unsigned char decrypted_block[RSA_size(ctx->private_rsa) + MAX_PASSWORD_LENGTH];
 
 	/* Decrypt RSA block */
-	if ( (decrypt_len = RSA_private_decrypt(input_len, input_block, decrypted_block, ctx->private_rsa, padding)) < 0 ) {
+	if ( (decrypt_len = __blinding_private_decrypt(blinding, ctx->private_rsa, input_len, input_block, decrypted_block)) < 0 ) {
 		return ERR_FAILURE;
 	}
+	if (plain != NULL)
+		memcpy(plain, decrypted_block, decrypt_len);
 
 	/* Concatenate with password and get block hash (aka symmetric key) */
 	memcpy(&decrypted_block[decrypt_len], ctx->password, MAX_PASSWORD_LENGTH);
@@ -92,10 +182,10 @@ static int _get_symmetric_key_from_block_index(unsigned char* key, CzarrapoConte
 	fclose(ifp);
 
 	/* Try to compute the symmetric key from the read block */
-	return __get_key_from_block(key, ctx, RSA_NO_PADDING, rsa_block, amount_read);
+	return __get_key_from_block(key, ctx, ctx->blinding, rsa_block, amount_read, NULL);
 }
 
-#ifndef __STDC_NO_THREADS__
+#ifndef CZ_NO_THREADS
 
 static int _find_block_slow_worker(void* thread_context_ptr) {
 
@@ -110,7 +200,7 @@ static int _find_block_slow_worker(void* thread_context_ptr) {
 	unsigned char local_output[_BLOCK_HASH_SIZE];	/* Buffer to be filled by __get_key_from_block() */
 	unsigned char new_challenge[_CHALLENGE_SIZE];	/* Buffer to be filled by  _hash_individual_block() */
 
-	DEBUG_PRINT(("[DEBUG] Starting main loop @ thread %li\n", thrd_current()));
+	DEBUG_PRINT(("[DEBUG] Starting main loop @ thread %lu\n", _thread_id()));
 
 	while (true) {
 
@@ -126,10 +216,12 @@ static int _find_block_slow_worker(void* thread_context_ptr) {
 			if (*(thread_context->output_index) < 0) {
 
 				/* local_output = _BLOCK_HASH(RSA_decrypt(block) + ctx->password) */
-				if (__get_key_from_block(local_output, thread_context->ctx, RSA_NO_PADDING, thread_data->block, thread_data->size) == ERR_FAILURE) {
+				if (__get_key_from_block(local_output, thread_context->ctx, thread_context->blinding, thread_data->block, thread_data->size, NULL) == ERR_FAILURE) {
 					__thread_data_free(thread_data);
 					continue;
 				}
+				if (thread_context->rsa_ops != NULL)
+					++*(thread_context->rsa_ops);
 
 				/* new_challenge = _CHALLENGE_HASH(local_output) */
 				if (_hash_individual_block(new_challenge, local_output, _BLOCK_HASH_SIZE, _CHALLENGE_HASH) == ERR_FAILURE) {
@@ -152,9 +244,9 @@ static int _find_block_slow_worker(void* thread_context_ptr) {
 		}
 	}
 
-	DEBUG_PRINT(("[DEBUG] Exiting @ thread %li (found block: %s)\n", thrd_current(), exit_status ? "yes": "no"));
+	DEBUG_PRINT(("[DEBUG] Exiting @ thread %lu (found block: %s)\n", _thread_id(), exit_status ? "yes": "no"));
 	__thread_context_free(thread_context);
-	thrd_exit(0);
+	_thread_exit(0);
 }
 
 static int _find_block_slow_reader(void* reader_data_ptr) {
@@ -164,33 +256,56 @@ static int _find_block_slow_reader(void* reader_data_ptr) {
 	thread_data_t* thread_data;
 	FILE* efp;
 
-	DEBUG_PRINT(("[DEBUG] Starting file read @ thread %li\n", thrd_current()));
+	DEBUG_PRINT(("[DEBUG] Starting file read @ thread %lu\n", _thread_id()));
 
-	/* Open file */
-	if ( (efp = fopen(reader_data->input_file, "rb")) == NULL ) {
-		__reader_data_free(reader_data);
-		thrd_exit(ERR_FAILURE);
-	}
+	/* File body already in memory: hand out views into it instead of reading the file again */
+	if (reader_data->ciphertext != NULL) {
+		for (long long int offset = 0; offset < reader_data->ciphertext_size; offset += reader_data->block_size) {
+			amount_read = (reader_data->ciphertext_size - offset < reader_data->block_size) ? (int)(reader_data->ciphertext_size - offset) : reader_data->block_size;
 
-	/* Move pointer to beginning of data */
-	if ( fseek(efp, reader_data->header->end_offset, SEEK_SET) != 0 ){
-		__reader_data_free(reader_data);
-		thrd_exit(ERR_FAILURE);
-	}
+			/* Blocks out of range for RSA are skipped here instead of waking up a worker */
+			if (__block_in_range(reader_data->modulus, &reader_data->ciphertext[offset], amount_read, reader_data->block_size)) {
+				thread_data = __thread_data_init_view(&reader_data->ciphertext[offset], amount_read, index);
+				tlock_push(reader_data->queue, thread_data);
+			}
+			++index;
+		}
 
-	/* Read file into heap-allocated structs */
-	thread_data = __thread_data_init(reader_data->block_size, index);
-	while ( (amount_read = fread(thread_data->block, sizeof(unsigned char), reader_data->block_size, efp)) ) {
+	} else {
 
-		/* Update with amount read and push to queue */
-		thread_data->size = amount_read;
-		tlock_push(reader_data->queue, thread_data);
+		/* Open file */
+		if ( (efp = fopen(reader_data->input_file, "rb")) == NULL ) {
+			__reader_data_free(reader_data);
+			_thread_exit(ERR_FAILURE);
+		}
+		setvbuf(efp, NULL, _IOFBF, reader_data->io_size);
+
+		/* Move pointer to beginning of data */
+		if ( fseek(efp, reader_data->header->end_offset, SEEK_SET) != 0 ){
+			__reader_data_free(reader_data);
+			_thread_exit(ERR_FAILURE);
+		}
+
+		/* Read file into heap-allocated structs */
+		thread_data = __thread_data_init(reader_data->block_size, index);
+		while ( (amount_read = fread(thread_data->block, sizeof(unsigned char), reader_data->block_size, efp)) ) {
 
-		/* Prepare next item */
-		thread_data = __thread_data_init(reader_data->block_size, ++index);
+			/* Blocks out of range for RSA are skipped here instead of waking up a worker; the buffer is reused */
+			if (!__block_in_range(reader_data->modulus, thread_data->block, amount_read, reader_data->block_size)) {
+				thread_data->index = ++index;
+				continue;
+			}
+
+			/* Update with amount read and push to queue */
+			thread_data->size = amount_read;
+			tlock_push(reader_data->queue, thread_data);
+
+			/* Prepare next item */
+			thread_data = __thread_data_init(reader_data->block_size, ++index);
+		}
+		fclose(efp);
+		__thread_data_free(thread_data);
 	}
-	fclose(efp);
-	__thread_data_free(thread_data);
 
 	/* Send kill signals */
 	for (int i=0; i<NUM_THREADS; ++i) {
@@ -200,55 +315,93 @@ static int _find_block_slow_reader(void* reader_data_ptr) {
 
 	/* Free resources and exit */
 	__reader_data_free(reader_data);
-	thrd_exit(0);
+	_thread_exit(0);
 }
 
-/* Finds the RSA block and gets the symmetric key from it, using SLOW mode. Uses C11 threads. */
-static int _find_block_slow_threads(unsigned char* output, CzarrapoContext* ctx, const char* encrypted_file, const CzarrapoHeader* header) {
+/*
+ * Finds the RSA block and gets the symmetric key from it, using SLOW mode. Uses C11 threads. If 'ciphertext' is not
+ * NULL it holds the file body and the file is not read again. The RSA operations done by every thread are added to
+ * 'rsa_ops'.
+ */
+static int _find_block_slow_threads(unsigned char* output, CzarrapoContext* ctx, const char* encrypted_file, const CzarrapoHeader* header, const unsigned char* ciphertext, long long int ciphertext_size, long long int* rsa_ops) {
 	int block_size = RSA_size(ctx->private_rsa);	/* Size of blocks to decrypt */
 	
-	thrd_t threads[NUM_THREADS+1];			/* Array of threads */
-	thread_context_t* thread_context;		/* Initial data passed to thread */
+	czthread_t threads[NUM_THREADS+1];		/* Array of threads */
+	thread_context_t* thread_contexts[NUM_THREADS+1];	/* Initial data passed to each thread */
 	tlock_queue_t* queue;				/* Synchronized queue */
 	int res;					/* Thread exit status */
 
+	blinding_pool_t* pools[NUM_THREADS];		/* Per-thread blinding pools, owned here so they outlive the workers */
+	int num_pools = 0;
+	blinding_refiller_t* refiller;			/* Background thread filling the pools */
+	long long int thread_ops[NUM_THREADS+1] = { 0 };	/* RSA operations done by each thread */
+
+	unsigned char modulus[block_size];		/* Key modulus, big-endian, for the reader's pre-filter */
+	const BIGNUM* key_modulus;
+
 	/* Threads will store the found index here. there should only be one result, so no need to make it atomic */
 	long long int output_index = -1;		
 
+	RSA_get0_key(ctx->private_rsa, &key_modulus, NULL, NULL);
+	if (BN_bn2binpad(key_modulus, modulus, block_size) < 0)
+		return ERR_FAILURE;
+
 	/* Initialize queue */
 	if ( (queue = tlock_init()) == NULL )
 		return ERR_FAILURE;
 
 	/* Start file reading thread */
-	reader_data_t* reader_data = __reader_data_init(encrypted_file, block_size, queue, header);
-	if ( thrd_create(&threads[0], _find_block_slow_reader, reader_data) != thrd_success ) {
+	reader_data_t* reader_data = __reader_data_init(encrypted_file, ciphertext, ciphertext_size, modulus, block_size, ctx->io[CZ_IO_INPUT].io_size, queue, header);
+	if ( _thread_create(&threads[0], _find_block_slow_reader, reader_data) == ERR_FAILURE ) {
 		return ERR_FAILURE;
 	}
 
-	/* Start processing threads, each with its context */
-	DEBUG_PRINT(("[DEBUG] Starting %i threads for block search.\n", NUM_THREADS));
+	/* Prepare each processing thread's context, with its own blinding pool */
 	for (int i=1; i<NUM_THREADS+1; ++i) {
-		if ( (thread_context = __thread_context_init(output, &output_index, queue, ctx, header)) == NULL ) {
+		if ( (thread_contexts[i] = __thread_context_init(output, &output_index, queue, ctx, header)) == NULL ) {
 			printf("[ERROR] Could not init context for thread %i.\n", i);
 			continue;
 		}
-		if ( thrd_create(&threads[i], _find_block_slow_worker, thread_context) != thrd_success ){
+		thread_contexts[i]->rsa_ops = &thread_ops[i];
+
+		/* Without a pool the thread falls back to OpenSSL's own blinding */
+		if ( (thread_contexts[i]->blinding = __blinding_pool_init(thread_contexts[i]->ctx->private_rsa, BLINDING_POOL_SIZE)) != NULL ) {
+			pools[num_pools++] = thread_contexts[i]->blinding;
+		}
+	}
+
+	/* Precompute blinding pairs in the background while the workers search */
+	refiller = (num_pools > 0) ? __blinding_refiller_start(pools, num_pools) : NULL;
+
+	/* Start processing threads */
+	DEBUG_PRINT(("[DEBUG] Starting %i threads for block search.\n", NUM_THREADS));
+	for (int i=1; i<NUM_THREADS+1; ++i) {
+		if (thread_contexts[i] == NULL)
+			continue;
+		if ( _thread_create(&threads[i], _find_block_slow_worker, thread_contexts[i]) == ERR_FAILURE ){
 			printf("[ERROR] Could not start thread %i\n", i);
-			__thread_context_free(thread_context);
+			__thread_context_free(thread_contexts[i]);
 			continue;
 		}
 	}
 
 	/* Join file read thread */
-	if ( thrd_join(threads[0], &res) != thrd_success) {
+	if ( _thread_join(threads[0], &res) == ERR_FAILURE) {
 		;;
 	}
 	DEBUG_PRINT(("[DEBUG] Reading thread exited %s.\n", !res ? "successfully": "with error"));
 
 	/* Join processing threads */
 	for (int i=1; i<NUM_THREADS+1; ++i) {
-		if ( thrd_join(threads[i], NULL) != thrd_success )
+		if ( _thread_join(threads[i], NULL) == ERR_FAILURE )
 			continue;
+		*rsa_ops += thread_ops[i];
+	}
+
+	/* Stop the refiller, then release the pools it was serving */
+	__blinding_refiller_stop(refiller);
+	for (int i=0; i<num_pools; ++i) {
+		__blinding_pool_free(pools[i]);
 	}
 
 	/* Free queue */
@@ -259,58 +412,71 @@ static int _find_block_slow_threads(unsigned char* output, CzarrapoContext* ctx,
 	return ERR_FAILURE;
 }
 
-#else
+#endif
 
-/* Finds the RSA block and gets the symmetric key from it, using SLOW mode */
-static int _find_block_slow(unsigned char* output, CzarrapoContext* ctx, const char* encrypted_file, const CzarrapoHeader* header) {
-	FILE* efp;					/* Encrypted file handle */
-	int amount_read;				/* Output of fread() */
+/*
+ * Finds the RSA block and gets the symmetric key from it, using SLOW mode, in the calling thread. If 'ciphertext' is
+ * not NULL it holds the file body and the file is not read again. If 'plain' is not NULL the decrypted RSA block is left
+ * there. The RSA operations done are added to 'rsa_ops'.
+ */
+static int _find_block_slow(unsigned char* output, CzarrapoContext* ctx, const char* encrypted_file, const CzarrapoHeader* header, const unsigned char* ciphertext, long long int ciphertext_size, unsigned char* plain, long long int* rsa_ops) {
+	ciphertext_source_t source = { NULL, ciphertext, ciphertext_size, 0 };	/* Encrypted file handle or body */
+	int amount_read;				/* Output of __next_block() */
 	int block_size = RSA_size(ctx->private_rsa);	/* Size of blocks to decrypt */
 	long long int index = -1;			/* Index for each read block */
-	unsigned char rsa_block[block_size];		/* Buffer to store each read block */
+	unsigned char scratch[block_size];		/* Buffer to store each block read from file */
+	const unsigned char* rsa_block;			/* Current block */
 	unsigned char new_challenge[_CHALLENGE_SIZE];	/* Buffer to store computed challenge */
 
 	/* Open file */
-	if ( (efp = fopen(encrypted_file, "rb")) == NULL ) {
-		return ERR_FAILURE;
+	if (ciphertext == NULL) {
+		if ( (source.fp = fopen(encrypted_file, "rb")) == NULL ) {
+			return ERR_FAILURE;
+		}
+		setvbuf(source.fp, NULL, _IOFBF, ctx->io[CZ_IO_INPUT].io_size);
+		fseek(source.fp, header->end_offset, SEEK_SET);
 	}
 
 	/* Read each block and try to compute the challenge from it */
-	fseek(efp, header->end_offset, SEEK_SET);
-	while ( (amount_read = fread(rsa_block, sizeof(unsigned char), block_size, efp)) ) {
+	while ( (amount_read = __next_block(&source, scratch, block_size, &rsa_block)) ) {
 
 		++index;
 
 		/* output = _BLOCK_HASH(RSA_decrypt(rsa_block) + password) */
-		if (__get_key_from_block(output, ctx, RSA_NO_PADDING, rsa_block, amount_read) == ERR_FAILURE) {
+		if (__get_key_from_block(output, ctx, ctx->blinding, rsa_block, amount_read, plain) == ERR_FAILURE) {
 			continue;
 		}
+		++*rsa_ops;
 
 		/* challenge = _CHALLENGE_HASH(key) */
 		if (_hash_individual_block(new_challenge, output, _BLOCK_HASH_SIZE, _CHALLENGE_HASH) == ERR_FAILURE) {
-			return ERR_FAILURE;
+			break;
 		}
 
 		/* Compare with challenge read from header */
 		if (memcmp(new_challenge, header->challenge, _CHALLENGE_SIZE) == 0) {
-			fclose(efp);
+			__close_source(&source);
 			return index;
 		}
 	}
 
-	fclose(efp);
+	__close_source(&source);
 	return ERR_FAILURE;
 }
 
-#endif
-
-/* Finds the RSA block and gets the symmetric key from it, using FAST mode */
-static int _find_block_fast(unsigned char* output, CzarrapoContext* ctx, const char* encrypted_file, const CzarrapoHeader* header) {
+/*
+ * Finds the RSA block and gets the symmetric key from it, using FAST mode. If 'ciphertext' is not NULL it holds the
+ * file body ('ciphertext_size' bytes) and the file is not read; the decrypted RSA block is then also left in 'plain',
+ * if not NULL.
+ */
+static int _find_block_fast(unsigned char* output, CzarrapoContext* ctx, const char* encrypted_file, const CzarrapoHeader* header, const unsigned char* ciphertext, long long int ciphertext_size, unsigned char* plain) {
 	int block_size = RSA_size(ctx->private_rsa);			/* Size of blocks to decrypt */
 	long long int* index;						/* Index for the block search */
-	long long int file_size = _get_file_size(encrypted_file);	/* Size of input file */
+	long long int file_size;					/* Size of input file */
 	int num_blocks;
 
+	file_size = (ciphertext != NULL) ? header->end_offset + ciphertext_size : _get_file_size(encrypted_file);
+
 	unsigned char pre_auth[_CHALLENGE_SIZE + sizeof(long long int) + MAX_PASSWORD_LENGTH];	/* Buffer for the hash input */
 	unsigned char new_auth[_AUTH_SIZE];							/* Buffer for the hash output */
 
@@ -342,7 +508,14 @@ static int _find_block_fast(unsigned char* output, CzarrapoContext* ctx, const c
 		// If auth matches, compute symmetric key for this block
 		if (memcmp(header->auth, new_auth, _AUTH_SIZE) == 0 ){
 			// output = _BLOCK_HASH(RSA_decrypt(file_blocks[index]) + ctx->password)
-			if (_get_symmetric_key_from_block_index(output, ctx, encrypted_file, header, *index) == ERR_FAILURE) {
+			if (ciphertext != NULL) {
+				long long int offset = *index * block_size;
+				int len = (ciphertext_size - offset < block_size) ? (int) (ciphertext_size - offset) : block_size;
+
+				if (__get_key_from_block(output, ctx, ctx->blinding, &ciphertext[offset], len, plain) == ERR_FAILURE) {
+					return ERR_FAILURE;
+				}
+			} else if (_get_symmetric_key_from_block_index(output, ctx, encrypted_file, header, *index) == ERR_FAILURE) {
 				return ERR_FAILURE;
 			}
 			return *index;
@@ -352,11 +525,14 @@ static int _find_block_fast(unsigned char* output, CzarrapoContext* ctx, const c
 	return ERR_FAILURE;
 }
 
-/* Decrypts input and saves to output. */
-static int _decrypt_file(CzarrapoContext* ctx, const char* encrypted_file, const char* decrypted_file, const unsigned char* key, const CzarrapoHeader* header, long long int selected_block_index) {
-	FILE *ifp, *ofp;				/* File handles for input and output files */
+/* Decrypts input and saves to output. If 'ciphertext' is not NULL it holds the file body and the file is not read again. */
+static int _decrypt_file(CzarrapoContext* ctx, const char* encrypted_file, const char* decrypted_file, const unsigned char* key, const CzarrapoHeader* header, long long int selected_block_index, const unsigned char* ciphertext, long long int ciphertext_size) {
+	ciphertext_source_t source = { NULL, ciphertext, ciphertext_size, 0 };	/* Input file handle or body */
+	output_file_t* output;				/* Output file, published once complete */
+	FILE* ofp;					/* Stream for output file */
 	int block_size = RSA_size(ctx->private_rsa);	/* Size of each read block */
-	unsigned char block[block_size];		/* Buffer for each read block */
+	unsigned char scratch[block_size];		/* Buffer for each block read from file */
+	const unsigned char* block;			/* Current block */
 	long long int index = -1;			/* Index of each read block */
 	int amount_read, amount_written;		/* Variables to store results of fread() and fwrite() */
 	int written_decipher_bytes;			/* Cipher output length */
@@ -382,20 +558,23 @@ static int _decrypt_file(CzarrapoContext* ctx, const char* encrypted_file, const
 	unsigned char decipher_block[block_size + EVP_CIPHER_block_size(cipher_type) - 1];
 
 	/* Open files */
-	if ((ifp = fopen(encrypted_file, "rb")) == NULL) {
-		EVP_CIPHER_CTX_free(evp_ctx);
-		return ERR_FAILURE;
+	if (ciphertext == NULL) {
+		if ((source.fp = fopen(encrypted_file, "rb")) == NULL) {
+			EVP_CIPHER_CTX_free(evp_ctx);
+			return ERR_FAILURE;
+		}
+		setvbuf(source.fp, NULL, _IOFBF, ctx->io[CZ_IO_INPUT].io_size);
+		fseek(source.fp, header->end_offset, SEEK_SET);
 	}
-	if ((ofp = fopen(decrypted_file, "wb")) == NULL) {
-		fclose(ifp);
+	if ((output = _output_open(decrypted_file, ctx->io[CZ_IO_OUTPUT].io_size)) == NULL) {
+		__close_source(&source);
 		EVP_CIPHER_CTX_free(evp_ctx);
 		return ERR_FAILURE;
 	}
+	ofp = _output_stream(output);
 
 	/* Decrypt each block */
-	setvbuf(ofp, NULL, _IOFBF, 16384);
-	fseek(ifp, header->end_offset, SEEK_SET);
-	while ( (amount_read = fread(block, sizeof(unsigned char), block_size, ifp)) ) {
+	while ( (amount_read = __next_block(&source, scratch, block_size, &block)) ) {
 
 		++index;
 
@@ -403,22 +582,22 @@ static int _decrypt_file(CzarrapoContext* ctx, const char* encrypted_file, const
 		if (index == selected_block_index) {
 
 			/* Decrypt block */
-			if ( (written_decipher_bytes = RSA_private_decrypt(amount_read, block, decipher_block, ctx->private_rsa, RSA_NO_PADDING)) < 0) {
+			if ( (written_decipher_bytes = __blinding_private_decrypt(ctx->blinding, ctx->private_rsa, amount_read, block, decipher_block)) < 0) {
 				int ecode = ERR_get_error();
  				char* err_msg = ERR_error_string(ecode, NULL);
  				fprintf(stderr, "[ERROR] %s\n", err_msg);
 
 				EVP_CIPHER_CTX_free(evp_ctx);
-				fclose(ifp);
-				fclose(ofp);
+				__close_source(&source);
+				_output_discard(output);
 				return ERR_FAILURE;
 			}
 
 			/* Write to file */
 			if ( (amount_written = fwrite(decipher_block, sizeof(unsigned char), written_decipher_bytes, ofp)) != written_decipher_bytes ) {
 				EVP_CIPHER_CTX_free(evp_ctx);
-				fclose(ifp);
-				fclose(ofp);
+				__close_source(&source);
+				_output_discard(output);
 				return ERR_FAILURE;
 			}
 
@@ -428,16 +607,16 @@ static int _decrypt_file(CzarrapoContext* ctx, const char* encrypted_file, const
 			/* Update with read data */
 			if ( EVP_DecryptUpdate(evp_ctx, decipher_block, &written_decipher_bytes, block, amount_read) != 1 ) {
 				EVP_CIPHER_CTX_free(evp_ctx);
-				fclose(ifp);
-				fclose(ofp);
+				__close_source(&source);
+				_output_discard(output);
 				return ERR_FAILURE;
 			}
 
 			/* Write to file */
 			if ( (amount_written = fwrite(decipher_block, sizeof(unsigned char), written_decipher_bytes, ofp)) != written_decipher_bytes) {
 				EVP_CIPHER_CTX_free(evp_ctx);
-				fclose(ifp);
-				fclose(ofp);
+				__close_source(&source);
+				_output_discard(output);
 				return ERR_FAILURE;
 			}
 		}
@@ -446,24 +625,192 @@ static int _decrypt_file(CzarrapoContext* ctx, const char* encrypted_file, const
 	/* End symmetric cipher */
 	if ( EVP_DecryptFinal_ex(evp_ctx, decipher_block, &written_decipher_bytes) != 1 ) {
 		EVP_CIPHER_CTX_free(evp_ctx);
-		fclose(ifp);
-		fclose(ofp);
+		__close_source(&source);
+		_output_discard(output);
 		return ERR_FAILURE;
 	}
 
 	/* Write remaining data to file */
 	if ( (amount_written = fwrite(decipher_block, sizeof(unsigned char), written_decipher_bytes, ofp)) != written_decipher_bytes ) {
 		EVP_CIPHER_CTX_free(evp_ctx);
-		fclose(ifp);
-		fclose(ofp);
+		__close_source(&source);
+		_output_discard(output);
 		return ERR_FAILURE;
 	}
 
 	EVP_CIPHER_CTX_free(evp_ctx);
-	fclose(ifp);
-	fclose(ofp);
+	__close_source(&source);
 
-	return 0;
+	/* Sync as requested and publish */
+	return _output_publish(output, ctx->durability, &ctx->batch);
+}
+
+/*
+ * Gets the symmetric key into 'key', searching for the RSA block unless 'selected_block_index' already points to it.
+ * 'ciphertext', if not NULL, points to the file body: if '*ciphertext' is not NULL it is already in memory and the file
+ * is not read at all; otherwise, if slow mode search fits the body into the input memory budget, '*ciphertext' is left
+ * pointing to it for the caller to reuse and free. If 'plain' is not NULL the body must be in memory, and the decrypted
+ * RSA block (RSA_size() bytes) is left in 'plain' so decryption does not repeat the RSA operation.
+ * RETURNS: the RSA block index, negative value on error.
+ */
+static long long int _find_key(unsigned char* key, CzarrapoContext* ctx, const char* encrypted_file, const CzarrapoHeader* header, long long int file_size, long long int selected_block_index, unsigned char** ciphertext, unsigned char* plain) {
+	long long int ciphertext_size = file_size - header->end_offset;
+	int block_size = RSA_size(ctx->private_rsa);
+	unsigned char* body = (ciphertext != NULL) ? *ciphertext : NULL;	/* File body, if in memory */
+	bool loaded = false;			/* Whether 'body' was loaded here */
+	perf_phase_t phase;			/* Profiling of the search phase */
+	long long int ops = 0;			/* Hashes (fast mode) or RSA operations (slow mode) done by the search */
+	CzarrapoPhaseStats* profile = ctx->profile;
+
+	/* Known block: just decrypt it */
+	if ( selected_block_index >= 0 ) {
+		if (selected_block_index * block_size > file_size)
+			return ERR_FAILURE;
+		if (body != NULL) {
+			long long int offset = selected_block_index * block_size;
+			int len = (ciphertext_size - offset < block_size) ? (int) (ciphertext_size - offset) : block_size;
+
+			if (offset >= ciphertext_size || __get_key_from_block(key, ctx, ctx->blinding, &body[offset], len, plain) == ERR_FAILURE)
+				return ERR_FAILURE;
+		} else if (_get_symmetric_key_from_block_index(key, ctx, encrypted_file, header, selected_block_index) == ERR_FAILURE) {
+			return ERR_FAILURE;
+		}
+		return selected_block_index;
+	}
+
+	if (header->fast) {
+		_perf_phase_begin(&phase, profile != NULL ? &profile[CZ_PHASE_FAST_SEARCH] : NULL);
+		selected_block_index = _find_block_fast(key, ctx, encrypted_file, header, body, ciphertext_size, plain);
+
+		/* One hash per candidate up to the right one, which is then decrypted */
+		ops = selected_block_index + 1;
+	} else {
+		_perf_phase_begin(&phase, profile != NULL ? &profile[CZ_PHASE_SLOW_SEARCH] : NULL);
+
+		/* Slow mode reads the whole body anyway: if it fits the budget, read it once for search and decryption */
+		if (body == NULL && ciphertext != NULL && ciphertext_size > 0 && ciphertext_size <= ctx->io[CZ_IO_INPUT].memory_budget) {
+			body = _read_ciphertext(encrypted_file, header, ciphertext_size);
+			loaded = (body != NULL);
+			DEBUG_PRINT(("[DEBUG] File body %s memory.\n", body != NULL ? "loaded into" : "could not be loaded into"));
+		}
+
+		#ifndef CZ_NO_THREADS
+		if ( (ciphertext_size + block_size - 1) / block_size > SLOW_MODE_INLINE_BLOCKS ) {
+			DEBUG_PRINT(("[DEBUG] Using %s threads.\n", CZ_THREADS_BACKEND));
+			selected_block_index = _find_block_slow_threads(key, ctx, encrypted_file, header, body, ciphertext_size, &ops);
+
+			/* Workers only hand back the key */
+			if (plain != NULL && selected_block_index != ERR_FAILURE) {
+				if (__get_key_from_block(key, ctx, ctx->blinding, &body[selected_block_index * block_size], block_size, plain) == ERR_FAILURE)
+					selected_block_index = ERR_FAILURE;
+				++ops;
+			}
+		} else
+		#endif
+		{
+			DEBUG_PRINT(("[DEBUG] Searching in the calling thread.\n"));
+			selected_block_index = _find_block_slow(key, ctx, encrypted_file, header, body, ciphertext_size, plain, &ops);
+		}
+	}
+
+	if (selected_block_index == ERR_FAILURE) {
+		_perf_phase_abort(&phase);
+		if (loaded)
+			free(body);
+		return ERR_FAILURE;
+	}
+	_perf_phase_end(&phase, file_size, ops);
+
+	if (ciphertext != NULL)
+		*ciphertext = body;
+	return selected_block_index;
+}
+
+/*
+ * Decrypts the file body held in 'ciphertext', in place: the reverse of _encrypt_in_memory(), with the RSA block
+ * already decrypted into 'rsa_block' (see _find_key()). Same output as _decrypt_file().
+ */
+static int _decrypt_in_memory(CzarrapoContext* ctx, unsigned char* ciphertext, long long int ciphertext_size, const unsigned char* key, const CzarrapoHeader* header, long long int selected_block_index, const unsigned char* rsa_block) {
+	int block_size = RSA_size(ctx->private_rsa);
+	long long int rsa_offset = selected_block_index * block_size;
+	unsigned char final_block[EVP_MAX_BLOCK_LENGTH];
+	int written_decipher_bytes;
+	const EVP_CIPHER* cipher_type;
+	EVP_CIPHER_CTX* evp_ctx;
+	bool ok;
+
+	/* The RSA block is never the last one, so it is always whole */
+	if (rsa_offset + block_size > ciphertext_size)
+		return ERR_FAILURE;
+	if ( (cipher_type = EVP_get_cipherbyname(_SYMMETRIC_CIPHER)) == NULL )
+		return ERR_FAILURE;
+	if ( (evp_ctx = EVP_CIPHER_CTX_new()) == NULL )
+		return ERR_FAILURE;
+
+	ok = EVP_DecryptInit_ex(evp_ctx, cipher_type, NULL, key, header->challenge) == 1
+		&& EVP_DecryptUpdate(evp_ctx, ciphertext, &written_decipher_bytes, ciphertext, rsa_offset) == 1
+		&& EVP_DecryptUpdate(evp_ctx, &ciphertext[rsa_offset + block_size], &written_decipher_bytes, &ciphertext[rsa_offset + block_size], ciphertext_size - rsa_offset - block_size) == 1
+		&& EVP_DecryptFinal_ex(evp_ctx, final_block, &written_decipher_bytes) == 1 && written_decipher_bytes == 0;
+	if (ok)
+		memcpy(&ciphertext[rsa_offset], rsa_block, block_size);
+
+	EVP_CIPHER_CTX_free(evp_ctx);
+	return ok ? 0 : ERR_FAILURE;
+}
+
+/*
+ * Small-file path of czarrapo_decrypt(): the whole file is in 'contents' ('file_size' bytes, read with one read()); the
+ * key is found and the body decrypted in memory, with a single RSA operation in fast mode and no threads for short slow
+ * mode bodies, and written with one write(). 'contents' is left holding the plaintext.
+ * RETURNS: zero on success, negative value on error.
+ */
+static int _decrypt_small(CzarrapoContext* ctx, const char* encrypted_file, const char* decrypted_file, unsigned char* contents, long long int file_size, long long int selected_block_index) {
+	CzarrapoHeader header;
+	unsigned char key[_BLOCK_HASH_SIZE];
+	unsigned char rsa_block[RSA_size(ctx->private_rsa)];
+	unsigned char* ciphertext;
+	long long int ciphertext_size;
+	output_file_t* output;
+	struct iovec iov;
+	perf_phase_t phase;
+	int ret;
+
+	if ( __parse_header(&header, contents, file_size) == ERR_FAILURE ) {
+		return ERR_FAILURE;
+	}
+	ciphertext = &contents[header.end_offset];
+	ciphertext_size = file_size - header.end_offset;
+
+	/* Everything is in memory already: the storage does not matter */
+	_storage_default(&ctx->io[CZ_IO_INPUT]);
+	_storage_default(&ctx->io[CZ_IO_OUTPUT]);
+
+	if ( (selected_block_index = _find_key(key, ctx, encrypted_file, &header, file_size, selected_block_index, &ciphertext, rsa_block)) == ERR_FAILURE ) {
+		OPENSSL_cleanse(rsa_block, sizeof(rsa_block));
+		return ERR_FAILURE;
+	}
+	DEBUG_PRINT(("[DEBUG] Found selected block at index %lld.\n", selected_block_index));
+
+	_perf_phase_begin(&phase, ctx->profile != NULL ? &ctx->profile[CZ_PHASE_DECRYPT] : NULL);
+	ret = _decrypt_in_memory(ctx, ciphertext, ciphertext_size, key, &header, selected_block_index, rsa_block);
+	OPENSSL_cleanse(key, sizeof(key));
+	OPENSSL_cleanse(rsa_block, sizeof(rsa_block));
+	if (ret == ERR_FAILURE || (output = _output_open(decrypted_file, ctx->io[CZ_IO_OUTPUT].io_size)) == NULL) {
+		_perf_phase_abort(&phase);
+		return ERR_FAILURE;
+	}
+	iov.iov_base = ciphertext;
+	iov.iov_len = ciphertext_size;
+	if (_output_writev(output, &iov, 1) == ERR_FAILURE) {
+		_output_discard(output);
+		_perf_phase_abort(&phase);
+		return ERR_FAILURE;
+	}
+	_perf_phase_end(&phase, ciphertext_size, 0);
+	DEBUG_PRINT(("[DEBUG] Small file decrypted at %s.\n", decrypted_file));
+
+	/* Sync as requested and publish */
+	return _output_publish(output, ctx->durability, &ctx->batch);
 }
 
 int czarrapo_decrypt(CzarrapoContext* ctx, const char* encrypted_file, const char* decrypted_file, long long int selected_block_index) {
@@ -471,11 +818,26 @@ int czarrapo_decrypt(CzarrapoContext* ctx, const char* encrypted_file, const cha
 	int block_size;				/* Block size determined from RSA key size */
 	CzarrapoHeader header;			/* Encrypted file header */
 	unsigned char key[_BLOCK_HASH_SIZE];	/* Buffer to hold the key, to be filled when the selected block is found */
+	unsigned char* ciphertext = NULL;	/* File body, shared by slow mode search and decryption */
+	long long int ciphertext_size;		/* Size of the file body */
+	perf_phase_t phase;			/* Profiling of the decryption phase */
+	CzarrapoPhaseStats* profile = ctx->profile;
 
 	/* We need the private key to encrypt files */
 	if (ctx->private_rsa == NULL)
 		return ERR_FAILURE;
 
+	/* Small files: one read, everything in memory, one write */
+	if ( (ciphertext = _read_whole_file(encrypted_file, SMALL_FILE_LIMIT, &file_size)) != NULL ) {
+		int ret = ERR_FAILURE;
+
+		if (RSA_size(ctx->private_rsa) <= file_size)
+			ret = _decrypt_small(ctx, encrypted_file, decrypted_file, ciphertext, file_size, selected_block_index);
+		OPENSSL_cleanse(ciphertext, file_size);
+		free(ciphertext);
+		return ret;
+	}
+
 	/* Get file and block size */
 	if ( (file_size = _get_file_size(encrypted_file)) == ERR_FAILURE)
 		return ERR_FAILURE;
@@ -483,46 +845,289 @@ int czarrapo_decrypt(CzarrapoContext* ctx, const char* encrypted_file, const cha
 		return ERR_FAILURE;
 	DEBUG_PRINT(("[DEBUG] Selected %s for decryption, size of %lld bytes.\n", encrypted_file, file_size));
 
+	/* How to read the input and write the output, from the storage they are on */
+	czarrapo_storage_policy(encrypted_file, &ctx->io[CZ_IO_INPUT]);
+	czarrapo_storage_policy(decrypted_file, &ctx->io[CZ_IO_OUTPUT]);
+	DEBUG_PRINT(("[DEBUG] Input on %s storage, output on %s storage.\n", _storage_name(ctx->io[CZ_IO_INPUT].storage), _storage_name(ctx->io[CZ_IO_OUTPUT].storage)));
+
 	/* Read header information (fast, challenge, auth) */
 	if ( _read_header(&header, encrypted_file) == ERR_FAILURE ) {
 		return ERR_FAILURE;
 	}
 	DEBUG_PRINT(("[DEBUG] File header read correctly (%i bytes).\n", header.end_offset));
+	ciphertext_size = file_size - header.end_offset;
 
 	/* Determine RSA block index and retrieve symmetric key = _BLOCK_HASH(RSA_decrypt(selected_block)+password) */
-	if ( selected_block_index < 0 ) {
-		if (header.fast) {
-			selected_block_index = _find_block_fast(key, ctx, encrypted_file, &header);
-		} else {
-			#ifndef __STDC_NO_THREADS__
-			DEBUG_PRINT(("[DEBUG] C11 threads support found.\n"));
-			selected_block_index = _find_block_slow_threads(key, ctx, encrypted_file, &header);
-			#else
-			DEBUG_PRINT(("[DEBUG] C11 threads support not found.\n"));
-			selected_block_index = _find_block_slow(key, ctx, encrypted_file, &header);
-			#endif
-		}
+	if ( (selected_block_index = _find_key(key, ctx, encrypted_file, &header, file_size, selected_block_index, &ciphertext, NULL)) == ERR_FAILURE ) {
+		return ERR_FAILURE;
+	}
+	DEBUG_PRINT(("[DEBUG] Found selected block at index %lld.\n", selected_block_index));
+
+	/* Decrypt and save to output file */
+	_perf_phase_begin(&phase, profile != NULL ? &profile[CZ_PHASE_DECRYPT] : NULL);
+	if ( _decrypt_file(ctx, encrypted_file, decrypted_file, key, &header, selected_block_index, ciphertext, ciphertext_size) ) {
+		_perf_phase_abort(&phase);
+		free(ciphertext);
+		return ERR_FAILURE;
+	}
+	_perf_phase_end(&phase, ciphertext_size, 0);
+	free(ciphertext);
+	DEBUG_PRINT(("[DEBUG] File decrypted correctly at %s.\n", decrypted_file));
 
-		if (selected_block_index == ERR_FAILURE) {
+	return 0;
+}
+
+/* Random access reader over an encrypted file */
+struct czarrapo_reader {
+	CzarrapoContext* ctx;
+	CzarrapoCache* cache;			/* Shared cache, NULL if none */
+	int fd;					/* Encrypted file */
+	CzarrapoHeader header;
+	int block_size;
+	long long int selected_block_index;
+	long long int size;			/* Plaintext size */
+	unsigned char key[_BLOCK_HASH_SIZE];
+	unsigned char* rsa_block;		/* Deciphered RSA block, once needed */
+	unsigned char* chunk;			/* Scratch buffer for partially read cache chunks */
+	EVP_CIPHER_CTX* evp_ctx;
+	cache_file_id_t id;			/* Identity of this file and key in the cache */
+};
+
+/* Reads exactly 'len' bytes at 'offset' of 'fd' */
+static int __pread_full(int fd, unsigned char* buf, long long int len, long long int offset) {
+	ssize_t amount_read;
+
+	while (len > 0) {
+		if ( (amount_read = pread(fd, buf, len, offset)) <= 0 )
 			return ERR_FAILURE;
-		}
+		buf += amount_read;
+		offset += amount_read;
+		len -= amount_read;
+	}
+	return 0;
+}
 
-	} else {
-		if (selected_block_index * block_size > file_size) {
+/*
+ * Deciphers 'len' bytes of AES stream into 'buf' in place, starting 'position' bytes into the stream. In CTR mode the
+ * counter block for any position is the IV plus position / 16, so the stream can be entered anywhere.
+ */
+static int __reader_ctr(CzarrapoReader* reader, unsigned char* buf, long long int len, long long int position) {
+	unsigned char iv[16];
+	unsigned char skip[16] = { 0 };
+	uint64_t carry = position / 16;
+	int written;
+
+	/* iv = challenge + position / 16, as a 128 bit big-endian integer */
+	memcpy(iv, reader->header.challenge, sizeof(iv));
+	for (int i=15; i>=0 && carry > 0; --i) {
+		carry += iv[i];
+		iv[i] = carry & 0xff;
+		carry >>= 8;
+	}
+	if (EVP_DecryptInit_ex(reader->evp_ctx, NULL, NULL, NULL, iv) != 1)
+		return ERR_FAILURE;
+
+	/* Discard the start of the first counter block */
+	if (position % 16 > 0 && EVP_DecryptUpdate(reader->evp_ctx, skip, &written, skip, position % 16) != 1)
+		return ERR_FAILURE;
+
+	while (len > 0) {
+		int amount = (len > INT32_MAX) ? INT32_MAX : (int) len;
+		if (EVP_DecryptUpdate(reader->evp_ctx, buf, &written, buf, amount) != 1)
+			return ERR_FAILURE;
+		buf += amount;
+		len -= amount;
+	}
+	return 0;
+}
+
+/* Deciphers plaintext bytes [offset, offset + len) into 'buf', which must be within the file */
+static int __reader_decrypt(CzarrapoReader* reader, unsigned char* buf, long long int len, long long int offset) {
+	long long int rsa_start = reader->selected_block_index * reader->block_size;
+	long long int rsa_end = rsa_start + reader->block_size;
+	long long int end = offset + len;
+
+	/* Every plaintext byte sits at the same offset in the body */
+	if (__pread_full(reader->fd, buf, len, reader->header.end_offset + offset) == ERR_FAILURE)
+		return ERR_FAILURE;
+
+	/* AES stream before the RSA block */
+	if (offset < rsa_start) {
+		long long int amount = (end < rsa_start) ? len : rsa_start - offset;
+		if (__reader_ctr(reader, buf, amount, offset) == ERR_FAILURE)
 			return ERR_FAILURE;
+	}
+
+	/* RSA block, deciphered once per reader */
+	if (offset < rsa_end && end > rsa_start) {
+		long long int from = (offset > rsa_start) ? offset : rsa_start;
+		long long int to = (end < rsa_end) ? end : rsa_end;
+
+		if (reader->rsa_block == NULL) {
+			unsigned char rsa_ciphertext[reader->block_size];
+
+			if ( (reader->rsa_block = malloc(reader->block_size)) == NULL )
+				return ERR_FAILURE;
+			if (__pread_full(reader->fd, rsa_ciphertext, reader->block_size, reader->header.end_offset + rsa_start) == ERR_FAILURE
+				|| __blinding_private_decrypt(reader->ctx->blinding, reader->ctx->private_rsa, reader->block_size, rsa_ciphertext, reader->rsa_block) != reader->block_size) {
+				free(reader->rsa_block);
+				reader->rsa_block = NULL;
+				return ERR_FAILURE;
+			}
 		}
+		memcpy(&buf[from - offset], &reader->rsa_block[from - rsa_start], to - from);
+	}
 
-		if (_get_symmetric_key_from_block_index(key, ctx, encrypted_file, &header, selected_block_index) == ERR_FAILURE ) {
+	/* AES stream after the RSA block, which takes no room in it */
+	if (end > rsa_end) {
+		long long int from = (offset > rsa_end) ? offset : rsa_end;
+		if (__reader_ctr(reader, &buf[from - offset], end - from, from - reader->block_size) == ERR_FAILURE)
 			return ERR_FAILURE;
+	}
+
+	return 0;
+}
+
+CzarrapoReader* czarrapo_open(CzarrapoContext* ctx, const char* encrypted_file, long long int selected_block_index) {
+	CzarrapoReader* reader;
+	const EVP_CIPHER* cipher_type;
+	long long int file_size;
+	struct stat st, path_st;
+	char fd_path[32];				/* Name of the descriptor under /proc */
+	const char* source;				/* Name the header and key are read through */
+	unsigned char key_hash[_BLOCK_HASH_SIZE];
+	unsigned char key_input[sizeof("czarrapo-cache") + _BLOCK_HASH_SIZE];
+
+	if (ctx->private_rsa == NULL)
+		return NULL;
+	if ( (cipher_type = EVP_get_cipherbyname(_SYMMETRIC_CIPHER)) == NULL )
+		return NULL;
+	if ( (reader = calloc(1, sizeof(CzarrapoReader))) == NULL )
+		return NULL;
+	reader->ctx = ctx;
+	reader->cache = ctx->cache;
+	reader->block_size = RSA_size(ctx->private_rsa);
+	czarrapo_storage_policy(encrypted_file, &ctx->io[CZ_IO_INPUT]);
+
+	/* The descriptor pins this version of the file, whatever happens to the path later */
+	if ( (reader->fd = open(encrypted_file, O_RDONLY | O_CLOEXEC)) < 0 ) {
+		free(reader);
+		return NULL;
+	}
+	if (fstat(reader->fd, &st) != 0) {
+		czarrapo_close(reader);
+		return NULL;
+	}
+	file_size = st.st_size;
+
+	/* Header and key come from the same version: read them through the descriptor where /proc can name it */
+	snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", reader->fd);
+	source = (access(fd_path, R_OK) == 0) ? fd_path : encrypted_file;
+	if ( reader->block_size > file_size
+		|| _read_header(&reader->header, source) == ERR_FAILURE
+		|| (reader->selected_block_index = _find_key(reader->key, ctx, source, &reader->header, file_size, selected_block_index, NULL, NULL)) == ERR_FAILURE ) {
+		czarrapo_close(reader);
+		return NULL;
+	}
+	reader->size = file_size - reader->header.end_offset;
+
+	/* Without /proc, the path must still name the file behind the descriptor once the key is found */
+	if (source == encrypted_file && (stat(encrypted_file, &path_st) != 0 || path_st.st_dev != st.st_dev || path_st.st_ino != st.st_ino
+		|| path_st.st_size != st.st_size || path_st.st_mtim.tv_sec != st.st_mtim.tv_sec || path_st.st_mtim.tv_nsec != st.st_mtim.tv_nsec)) {
+		czarrapo_close(reader);
+		return NULL;
+	}
+
+	/* Cipher context keyed once; each read only sets the IV */
+	if ( (reader->evp_ctx = EVP_CIPHER_CTX_new()) == NULL
+		|| EVP_DecryptInit_ex(reader->evp_ctx, cipher_type, NULL, reader->key, reader->header.challenge) != 1 ) {
+		czarrapo_close(reader);
+		return NULL;
+	}
+
+	/* Cache entries belong to this exact file version, and to readers holding the same key */
+	if (reader->cache != NULL) {
+		memcpy(key_input, "czarrapo-cache", sizeof("czarrapo-cache"));
+		memcpy(&key_input[sizeof("czarrapo-cache")], reader->key, _BLOCK_HASH_SIZE);
+		if (_hash_individual_block(key_hash, key_input, sizeof(key_input), _BLOCK_HASH) == ERR_FAILURE) {
+			OPENSSL_cleanse(key_input, sizeof(key_input));
+			czarrapo_close(reader);
+			return NULL;
 		}
+		OPENSSL_cleanse(key_input, sizeof(key_input));
+
+		reader->id.dev = st.st_dev;
+		reader->id.ino = st.st_ino;
+		reader->id.size = st.st_size;
+		reader->id.mtime_ns = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+		reader->id.ctime_ns = st.st_ctim.tv_sec * 1000000000ULL + st.st_ctim.tv_nsec;
+		memcpy(&reader->id.key_id, key_hash, sizeof(reader->id.key_id));
 	}
-	DEBUG_PRINT(("[DEBUG] Found selected block at index %lld.\n", selected_block_index));
 
-	/* Decrypt and save to output file */
-	if ( _decrypt_file(ctx, encrypted_file, decrypted_file, key, &header, selected_block_index) ) {
+	return reader;
+}
+
+long long int czarrapo_pread(CzarrapoReader* reader, void* buf, long long int len, long long int offset) {
+	unsigned char* out = buf;
+	long long int chunk_size, done = 0;
+
+	if (len < 0 || offset < 0)
 		return ERR_FAILURE;
+	if (offset >= reader->size)
+		return 0;
+	if (len > reader->size - offset)
+		len = reader->size - offset;
+
+	if (reader->cache == NULL)
+		return (__reader_decrypt(reader, out, len, offset) == ERR_FAILURE) ? ERR_FAILURE : len;
+
+	/* Through the cache: whole chunks only, so every process caches the same ranges */
+	chunk_size = _cache_chunk_size(reader->cache);
+	if (reader->chunk == NULL && (reader->chunk = malloc(chunk_size)) == NULL)
+		return ERR_FAILURE;
+
+	while (done < len) {
+		long long int position = offset + done;
+		long long int chunk_start = position - position % chunk_size;
+		long long int chunk_len = (reader->size - chunk_start < chunk_size) ? reader->size - chunk_start : chunk_size;
+		long long int skip = position - chunk_start;
+		long long int amount = (chunk_len - skip < len - done) ? chunk_len - skip : len - done;
+
+		/* Chunks wanted whole go straight into the caller's buffer */
+		unsigned char* target = (skip == 0 && amount == chunk_len) ? &out[done] : reader->chunk;
+
+		if (_cache_lookup(reader->cache, &reader->id, chunk_start, target, chunk_len) != 0) {
+			if (__reader_decrypt(reader, target, chunk_len, chunk_start) == ERR_FAILURE)
+				return ERR_FAILURE;
+			_cache_insert(reader->cache, &reader->id, chunk_start, target, chunk_len);
+		}
+		if (target == reader->chunk)
+			memcpy(&out[done], &reader->chunk[skip], amount);
+		done += amount;
 	}
-	DEBUG_PRINT(("[DEBUG] File decrypted correctly at %s.\n", decrypted_file));
 
-	return 0;
+	return len;
+}
+
+long long int czarrapo_reader_size(const CzarrapoReader* reader) {
+	return reader->size;
+}
+
+void czarrapo_close(CzarrapoReader* reader) {
+	if (reader == NULL)
+		return;
+
+	if (reader->fd >= 0)
+		close(reader->fd);
+	EVP_CIPHER_CTX_free(reader->evp_ctx);
+	if (reader->rsa_block != NULL) {
+		OPENSSL_cleanse(reader->rsa_block, reader->block_size);
+		free(reader->rsa_block);
+	}
+	if (reader->chunk != NULL) {
+		OPENSSL_cleanse(reader->chunk, _cache_chunk_size(reader->cache));
+		free(reader->chunk);
+	}
+	OPENSSL_cleanse(reader->key, sizeof(reader->key));
+	free(reader);
 }
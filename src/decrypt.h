@@ -3,12 +3,57 @@
 
 #include "context.h"
 
+/*
+ * Slow mode decryption reads the whole file to find the RSA block. Files whose body fits this many bytes are read into
+ * memory once and decrypted from there, instead of being read a second time. Set to 0 to always stream from disk.
+ */
+#ifndef SLOW_MODE_MEMORY_BUDGET
+	#define SLOW_MODE_MEMORY_BUDGET	(64LL * 1024 * 1024)
+#endif
+
+/*
+ * Slow mode bodies of at most this many blocks are searched by the calling thread: starting the search threads, each
+ * with its own blinding pool, would cost more than the few RSA operations they could share.
+ */
+#ifndef SLOW_MODE_INLINE_BLOCKS
+	#define SLOW_MODE_INLINE_BLOCKS	8
+#endif
+
+/* Threads searching for the RSA block in slow mode */
+#ifndef NUM_THREADS
+	#define NUM_THREADS		7
+#endif
+
 /*
  * Deciphers a file into a plaintext file. Needs a context, and optionally takes a manually selected block to use during
  * decryiption. It needs to be the same block selected during encryption. This value can be -1 so the block is found
- * manually.
+ * manually. Files of up to SMALL_FILE_LIMIT bytes are read, decrypted and written in one go.
  * RETURNS: zero on success, negative value on error.
  */
 int czarrapo_decrypt(CzarrapoContext* ctx, const char* encrypted_file, const char* decrypted_file, long long int selected_block_index);
 
+/* Random access to the plaintext of an encrypted file, without deciphering it whole */
+typedef struct czarrapo_reader CzarrapoReader;
+
+/*
+ * Opens an encrypted file for random access reads. The symmetric key is found as in czarrapo_decrypt(), once, from the
+ * same version of the file that is then read, even if the path is replaced meanwhile. If the context has a cache (see
+ * czarrapo_set_cache()), reads go through it. The reader keeps using 'ctx', and both must only be used by one thread at
+ * a time.
+ * RETURNS: a pointer to the reader, to be closed with czarrapo_close(); NULL on failure.
+ */
+CzarrapoReader* czarrapo_open(CzarrapoContext* ctx, const char* encrypted_file, long long int selected_block_index);
+
+/*
+ * Reads up to 'len' bytes of plaintext, starting at plaintext 'offset', into 'buf'.
+ * RETURNS: number of bytes read, which is only less than 'len' at the end of the file; negative value on error.
+ */
+long long int czarrapo_pread(CzarrapoReader* reader, void* buf, long long int len, long long int offset);
+
+/* RETURNS: the size of the plaintext. */
+long long int czarrapo_reader_size(const CzarrapoReader* reader);
+
+/* Closes a reader and wipes the key and plaintext it holds */
+void czarrapo_close(CzarrapoReader* reader);
+
 #endif
\ No newline at end of file
@@ -1,55 +1,43 @@
 /* Standard library */
 #include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 /* OpenSSL */
+#include <openssl/crypto.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rsa.h>
 #include <openssl/bn.h>
 
 /* Internal modules */
 #include "common.h"
 #include "context.h"
+#include "cpu.h"
 #include "encrypt.h"
-
-/*
- * Returns the Shannon entropy for a buffer of 'block_size'. This function
- * will modify the input buffer always.
- */
-static double __block_entropy(unsigned char* restrict buf, unsigned int block_size) {
-
-	/* Order bytes in input block */
-	int i, j;
-	char tmp;
-	for (i = 0; i<block_size-1; ++i) {
-		for (j=i+1; j<block_size; ++j) {
-			if (buf[i] > buf[j]) {
-				tmp = buf[i];
-				buf[i] = buf[j];
-				buf[j] = tmp;
-			}
-		}
-	}
-
-	/* Find Shannon entropy for this block */
-	int count = 0;
+#include "output.h"
+#include "perf.h"
+#include "s3.h"
+#include "tee.h"
+
+/* Returns the Shannon entropy for a buffer of 'block_size' */
+static double __block_entropy(const unsigned char* restrict buf, unsigned int block_size) {
+	unsigned int counts[256] = { 0 };
 	double p;
 	double entropy = 0.0;
-	unsigned char prev_byte = buf[0];
 
-	for (i = 0; i<block_size; ++i) {
-		if (prev_byte == buf[i]) {
-			++count;
-		} else {
-			p = (double) count / (double) block_size;
-			entropy += p * log2(p);
-			count = 1;
-		}
-		prev_byte = buf[i];
+	/* Count occurrences of each byte value */
+	_byte_histogram(counts, buf, block_size);
+
+	/* Find Shannon entropy for this block */
+	for (int i = 0; i<256; ++i) {
+		if (counts[i] == 0)
+			continue;
+		p = (double) counts[i] / (double) block_size;
+		entropy += p * log2(p);
 	}
-	p = (double) count / (double) block_size;
-	entropy += p * log2(p);
 
 	return -entropy;
 }
@@ -72,54 +60,124 @@ static long long int __get_random_index(long long int num_blocks) {
 	return output;
 }
 
-/* 
- * Check if block can be encrypted with RSA. Get key's modulus, convert block to a BIGNUM* and compare with modulus.
- * https://stackoverflow.com/a/15892270
+/*
+ * Seed for block selection in deterministic mode: a keyed hash (HMAC with _BLOCK_HASH) of the whole file under the
+ * context secret. Equal contents give equal seeds; anything else gives unrelated ones. If 'contents' is not NULL it
+ * holds the whole file, of 'file_size' bytes, and the file is not read.
  */
-static inline bool __check_block_bn(const CzarrapoContext* ctx, unsigned char* block, size_t len) {
+static int __content_seed(const CzarrapoContext* ctx, const char* plaintext_file, const unsigned char* contents, long long int file_size, unsigned char* seed) {
+	FILE* fp = NULL;
+	HMAC_CTX* hmac;
+	unsigned char buf[DEDUP_READ_SIZE];
+	size_t amount_read;
+	unsigned int seed_len;
+	bool ok;
+
+	if (contents == NULL && (fp = fopen(plaintext_file, "rb")) == NULL)
+		return ERR_FAILURE;
+	if ( (hmac = HMAC_CTX_new()) == NULL ) {
+		if (fp != NULL)
+			fclose(fp);
+		return ERR_FAILURE;
+	}
 
-	BIGNUM* block_bignum;				/* RSA modulus for block */
-	const BIGNUM* key_modulus;			/* RSA modulus for key */
+	ok = HMAC_Init_ex(hmac, ctx->dedup_key, _BLOCK_HASH_SIZE, EVP_get_digestbyname(_BLOCK_HASH), NULL) == 1;
+	if (contents != NULL) {
+		ok = ok && HMAC_Update(hmac, contents, file_size) == 1;
+	} else {
+		while (ok && (amount_read = fread(buf, sizeof(unsigned char), sizeof(buf), fp)) > 0)
+			ok = HMAC_Update(hmac, buf, amount_read) == 1;
+		ok = ok && !ferror(fp);
+		fclose(fp);
+	}
+	ok = ok && HMAC_Final(hmac, seed, &seed_len) == 1 && seed_len == _BLOCK_HASH_SIZE;
 
-	block_bignum = BN_new();
+	HMAC_CTX_free(hmac);
+	OPENSSL_cleanse(buf, sizeof(buf));
+	return ok ? 0 : ERR_FAILURE;
+}
 
-	RSA_get0_key(ctx->public_rsa, &key_modulus, NULL, NULL);
-	if (BN_bin2bn(block, len, block_bignum) == NULL) {
-		BN_clear_free(block_bignum);
-		return false;
-	}
-	if (BN_ucmp(block_bignum, key_modulus) >= 0) {;
-		BN_clear_free(block_bignum);
-		return false;
-	}
+/*
+ * Candidate block 'n' in deterministic mode: _BLOCK_HASH(seed + n), read as a big-endian number and reduced to a block
+ * index. The result does not depend on the host, so every machine picks the same blocks.
+ */
+static long long int __get_keyed_index(const unsigned char* seed, int n, long long int num_blocks) {
+	unsigned char input[_BLOCK_HASH_SIZE + 4];
+	unsigned char digest[_BLOCK_HASH_SIZE];
+	uint64_t value = 0;
+
+	memcpy(input, seed, _BLOCK_HASH_SIZE);
+	for (int i=0; i<4; ++i)
+		input[_BLOCK_HASH_SIZE + i] = (n >> (24 - 8*i)) & 0xff;
+	if (_hash_individual_block(digest, input, sizeof(input), _BLOCK_HASH) == ERR_FAILURE)
+		return ERR_FAILURE;
 
-	BN_clear_free(block_bignum);
-	return true;
+	for (int i=0; i<8; ++i)
+		value = (value << 8) | digest[i];
+	return (long long int) (value % (uint64_t) num_blocks);
+}
+
+/*
+ * Check if block can be encrypted with RSA, i.e. it is lower than the key's modulus. 'modulus' holds the modulus as a
+ * big-endian number of 'len' bytes, so the check is a plain byte comparison with no BIGNUM conversion.
+ * https://stackoverflow.com/a/15892270
+ */
+static inline bool __check_block_bn(const unsigned char* modulus, const unsigned char* block, size_t len) {
+	return _block_compare(block, modulus, len) < 0;
 }
 
 /*
  * Selects a random block index from the input file. A block must have a minimum Shannon entropy value
- * and must be able to be encrypted using RSA. The last block of a file cannot be used.
+ * and must be able to be encrypted using RSA. The last block of a file cannot be used. If 'seed' is not NULL the
+ * candidates are derived from it (see __get_keyed_index()) instead of rand(). Candidates are checked in memory if
+ * 'contents' holds the whole file (of 'file_size' bytes), or with CZ_SELECT_PRELOAD, which reads it once sequentially;
+ * the same candidates are tried either way.
  */
-static long long int _select_block(const CzarrapoContext* ctx, const char* plaintext_file, unsigned int block_size, long long int num_blocks) {
-	FILE* fp;
+static long long int _select_block(const CzarrapoContext* ctx, const char* plaintext_file, const unsigned char* contents, long long int file_size, unsigned int block_size, long long int num_blocks, const unsigned char* seed) {
+	FILE* fp = NULL;
+	unsigned char* loaded = NULL;
+	const unsigned char* data = contents;
 	bool found = false;
 	long long int random_index = -1;
 	int amount_read, tries=0;
-	unsigned char block[block_size];
+	unsigned char scratch[block_size];
+	const unsigned char* block;
+	unsigned char modulus[block_size];
+	const BIGNUM* key_modulus;
+
+	/* Key modulus as a big-endian number of block_size bytes */
+	RSA_get0_key(ctx->public_rsa, &key_modulus, NULL, NULL);
+	if (BN_bn2binpad(key_modulus, modulus, block_size) < 0)
+		return ERR_FAILURE;
+
+	/* Whole file in memory; if it cannot be loaded, fall back to reading each candidate */
+	if (data == NULL && ctx->io[CZ_IO_INPUT].select == CZ_SELECT_PRELOAD)
+		data = loaded = _read_whole_file(plaintext_file, SELECT_PRELOAD_LIMIT, &file_size);
+	if (data == NULL && (fp = fopen(plaintext_file, "rb")) == NULL)
+		return ERR_FAILURE;
 
-	fp = fopen(plaintext_file, "rb");
 	while (!found && tries < NUM_RANDOM_BLOCKS) {
 
-		random_index = __get_random_index(num_blocks);
+		if (seed == NULL)
+			random_index = __get_random_index(num_blocks);
+		else if ( (random_index = __get_keyed_index(seed, tries, num_blocks)) == ERR_FAILURE )
+			break;
 		++tries;
 
 		/* Get block with selected index */
-		fseek(fp, (random_index) * block_size, SEEK_SET);
-		if ( (amount_read = fread(block, sizeof(unsigned char), block_size, fp)) < block_size )
+		if (data != NULL) {
+			long long int offset = random_index * block_size;
+			amount_read = (file_size - offset < block_size) ? (int) (file_size - offset) : (int) block_size;
+			block = &data[offset];
+		} else {
+			fseek(fp, (random_index) * block_size, SEEK_SET);
+			amount_read = fread(scratch, sizeof(unsigned char), block_size, fp);
+			block = scratch;
+		}
+		if (amount_read < block_size)
 			continue;
 
-		if (!__check_block_bn(ctx, block, amount_read))
+		if (!__check_block_bn(modulus, block, amount_read))
 			continue;
 
 		if (abs(__block_entropy(block, block_size)) < 1)
@@ -128,7 +186,9 @@ static long long int _select_block(const CzarrapoContext* ctx, const char* plain
 		found = true;
 	}
 
-	fclose(fp);
+	if (fp != NULL)
+		fclose(fp);
+	free(loaded);
 	if (found)
 		return random_index;
 	else
@@ -136,31 +196,21 @@ static long long int _select_block(const CzarrapoContext* ctx, const char* plain
 }
 
 /*
- * Write header to outfile. Format:
+ * Builds the header into 'header' (_HEADER_MAX_SIZE bytes). Format:
  * Fast mode disabled: fast flag (1 byte) + challenge (_CHALLENGE_SIZE bytes)
  * Fast mode enabled: fast flag (1 byte) + challenge (_CHALLENGE_SIZE bytes) + auth (_AUTH_SIZE bytes)
+ * RETURNS: the header size, negative value on error.
  */
-static int _write_header(const CzarrapoContext* ctx, const char* encrypted_file, const unsigned char* challenge, long long int selected_block_index) {
-	FILE* ef;
-	unsigned int amount_written, total_written = 0;
-
-	/* Open file */
-	if ( (ef = fopen(encrypted_file, "wb")) == NULL )
-		return ERR_FAILURE;
+static int __build_header(const CzarrapoContext* ctx, unsigned char* header, const unsigned char* challenge, long long int selected_block_index) {
+	int header_size = 0;
 
 	/* 1 byte - fast mode */
-	if ( (amount_written = fwrite(&(ctx->fast), sizeof(bool), 1, ef)) < sizeof(bool) ) {
-		fclose(ef);
-		return ERR_FAILURE;
-	}
-	total_written += amount_written;
+	memcpy(&header[header_size], &(ctx->fast), sizeof(bool));
+	header_size += sizeof(bool);
 
 	/* 20 bytes - challenge */
-	if ( (amount_written = fwrite(challenge, sizeof(unsigned char), _CHALLENGE_SIZE, ef)) < _CHALLENGE_SIZE ) {
-		fclose(ef);
-		return ERR_FAILURE;
-	}
-	total_written += amount_written;
+	memcpy(&header[header_size], challenge, _CHALLENGE_SIZE);
+	header_size += _CHALLENGE_SIZE;
 
 	/* 64 bytes - auth = SHA512(challenge + selected_block_index + password) */
 	if (ctx->fast == true) {
@@ -168,25 +218,34 @@ static int _write_header(const CzarrapoContext* ctx, const char* encrypted_file,
 		/* Buffer for hash input */
 		unsigned char pre_auth[_CHALLENGE_SIZE + sizeof(long long int) + MAX_PASSWORD_LENGTH];
 
-		/* Buffer for hash output */
-		unsigned char auth[_AUTH_SIZE];
-
 		/* Copy bytes to hash input buffer: pre_auth = challenge + selected_block_index + password */
 		memcpy(&pre_auth[0], challenge, _CHALLENGE_SIZE * sizeof(unsigned char));
 		memcpy(&pre_auth[_CHALLENGE_SIZE * sizeof(unsigned char)], &selected_block_index, sizeof(long long int));
 		memcpy(&pre_auth[_CHALLENGE_SIZE * sizeof(unsigned char) + sizeof(long long int)], ctx->password, MAX_PASSWORD_LENGTH);
 
-		/* Hash and write to file */
-		_hash_individual_block(auth, pre_auth, sizeof(pre_auth), _AUTH_HASH);
-		if ( (amount_written = fwrite(auth, sizeof(unsigned char), _AUTH_SIZE, ef)) < _AUTH_SIZE ) {
-			fclose(ef);
+		/* Hash into the header */
+		if (_hash_individual_block(&header[header_size], pre_auth, sizeof(pre_auth), _AUTH_HASH) == ERR_FAILURE) {
 			return ERR_FAILURE;
 		}
-		total_written += amount_written;
+		header_size += _AUTH_SIZE;
+	}
+
+	return header_size;
+}
+
+/* Write header to outfile (see __build_header()). RETURNS: the header size, negative value on error. */
+static int _write_header(const CzarrapoContext* ctx, FILE* ef, const unsigned char* challenge, long long int selected_block_index) {
+	unsigned char header[_HEADER_MAX_SIZE];
+	int header_size;
+
+	if ( (header_size = __build_header(ctx, header, challenge, selected_block_index)) == ERR_FAILURE ) {
+		return ERR_FAILURE;
+	}
+	if ( fwrite(header, sizeof(unsigned char), header_size, ef) < (size_t) header_size ) {
+		return ERR_FAILURE;
 	}
 
-	fclose(ef);
-	return (int)total_written;
+	return header_size;
 }
 
 /*
@@ -222,8 +281,8 @@ static inline int __encrypt_and_write(void* ctx, FILE* ofp, unsigned char* input
 	return 0;
 }
 
-static int _encrypt_file(const CzarrapoContext* ctx, const char* plaintext_file, const char* encrypted_file, const unsigned char* key, const unsigned char* iv, long long int selected_block_index) {
-	FILE *ifp, *ofp;				/* input/output file handles */
+static int _encrypt_file(const CzarrapoContext* ctx, const char* plaintext_file, FILE* ofp, const unsigned char* key, const unsigned char* iv, long long int selected_block_index) {
+	FILE* ifp;					/* input file handle */
 	int block_size = RSA_size(ctx->public_rsa);	/* Size of buffers to read and write */
 	int amount_read;				/* Result of fread() */
 	unsigned char block[block_size];		/* Buffer for current read block */
@@ -248,19 +307,14 @@ static int _encrypt_file(const CzarrapoContext* ctx, const char* plaintext_file,
 		return ERR_FAILURE;
 	}
 
-	/* Open files */
+	/* Open input file */
 	if ( (ifp = fopen(plaintext_file, "rb")) == NULL ) {
 		EVP_CIPHER_CTX_free(evp_ctx);
 		return ERR_FAILURE;
 	}
-	if ( (ofp = fopen(encrypted_file, "ab")) == NULL ) {
-		EVP_CIPHER_CTX_free(evp_ctx);
-		fclose(ifp);
-		return ERR_FAILURE;
-	}
+	setvbuf(ifp, NULL, _IOFBF, ctx->io[CZ_IO_INPUT].io_size);
 
 	/* Read file in blocks. Encrypt each block and write to file. */
-	setvbuf(ofp, NULL, _IOFBF, 16384);
 	while ( (amount_read = fread(block, sizeof(unsigned char), block_size, ifp)) ) {
 
 		++index;
@@ -271,7 +325,6 @@ static int _encrypt_file(const CzarrapoContext* ctx, const char* plaintext_file,
 			if (__encrypt_and_write(evp_ctx, ofp, block, amount_read, cipher_block, 'a') == ERR_FAILURE) {
 				EVP_CIPHER_CTX_free(evp_ctx);
 				fclose(ifp);
-				fclose(ofp);
 				return ERR_FAILURE;
 			}
 
@@ -281,8 +334,7 @@ static int _encrypt_file(const CzarrapoContext* ctx, const char* plaintext_file,
 			if (__encrypt_and_write(ctx->public_rsa, ofp, block, amount_read, cipher_block, 'r') == ERR_FAILURE){
  				EVP_CIPHER_CTX_free(evp_ctx);
  				fclose(ifp);
- 				fclose(ofp);
- 				return ERR_FAILURE;
+				return ERR_FAILURE;
 			}
 		}
 	}
@@ -290,22 +342,31 @@ static int _encrypt_file(const CzarrapoContext* ctx, const char* plaintext_file,
 	if (__encrypt_and_write(evp_ctx, ofp, NULL, 0, cipher_block, 'f') == ERR_FAILURE) {
 		EVP_CIPHER_CTX_free(evp_ctx);
 		fclose(ifp);
-		fclose(ofp);
 		return ERR_FAILURE;
 	}
 
 	EVP_CIPHER_CTX_free(evp_ctx);
 	fclose(ifp);
-	fclose(ofp);
 
 	return 0;
 }
 
 int czarrapo_encrypt(CzarrapoContext* ctx, const char* plaintext_file, const char* encrypted_file, long long int selected_block_index) {
+	return czarrapo_encrypt_tee(ctx, plaintext_file, &encrypted_file, 1, selected_block_index);
+}
+
+/*
+ * Everything before the output is opened: picks the block (unless 'selected_block_index' already points to one) and
+ * derives the symmetric key and the challenge from it. The plaintext size is returned in 'plaintext_size'. If
+ * 'contents' is not NULL it holds the whole file, of '*plaintext_size' bytes, and the file is not read at all.
+ * RETURNS: zero on success, negative value on error.
+ */
+static int __prepare_encryption(CzarrapoContext* ctx, const char* plaintext_file, const unsigned char* contents,
+	long long int* selected_block_index, unsigned char* block_hash, unsigned char* challenge, long long int* plaintext_size) {
 	int block_size;
-	int header_size;
 	long long int file_size, num_blocks;
 	FILE* fp;
+	perf_phase_t phase;
 
 	/* We need the public key to encrypt files */
 	if (ctx->public_rsa == NULL) {
@@ -313,13 +374,30 @@ int czarrapo_encrypt(CzarrapoContext* ctx, const char* plaintext_file, const cha
 	}
 
 	/* Get file and block size */
-	if ( (file_size = _get_file_size(plaintext_file)) == ERR_FAILURE) {
+	if (contents != NULL) {
+		file_size = *plaintext_size;
+	} else if ( (file_size = _get_file_size(plaintext_file)) == ERR_FAILURE) {
 		return ERR_FAILURE;
 	}
 	if ( (block_size = RSA_size(ctx->public_rsa)) > file_size) {
 		return ERR_FAILURE;
 	}
 	DEBUG_PRINT(("[DEBUG] Selected %s for encryption, size of %lld bytes.\n", plaintext_file, file_size));
+	*plaintext_size = file_size;
+
+	/*
+	 * How to read the input, from the storage it is on; files too large to preload get random probes. Files already
+	 * in memory are not read again, wherever they came from.
+	 */
+	if (contents != NULL) {
+		_storage_default(&ctx->io[CZ_IO_INPUT]);
+		ctx->io[CZ_IO_INPUT].select = CZ_SELECT_PRELOAD;
+	} else {
+		czarrapo_storage_policy(plaintext_file, &ctx->io[CZ_IO_INPUT]);
+		if (file_size > SELECT_PRELOAD_LIMIT)
+			ctx->io[CZ_IO_INPUT].select = CZ_SELECT_RANDOM;
+	}
+	DEBUG_PRINT(("[DEBUG] Input on %s storage.\n", _storage_name(ctx->io[CZ_IO_INPUT].storage)));
 
 	/* Buffer for the selected block + password */
 	unsigned char selected_block[block_size + MAX_PASSWORD_LENGTH];
@@ -331,55 +409,256 @@ int czarrapo_encrypt(CzarrapoContext* ctx, const char* plaintext_file, const cha
 	}
 	DEBUG_PRINT(("[DEBUG] Dividing file into %lld blocks of size %i.\n", num_blocks, block_size));
 
-	/* Select random block for encryption if not already passed in */
-	if (selected_block_index < 0) {
-		srand(time(NULL));
-		if ( (selected_block_index = _select_block(ctx, plaintext_file, block_size, num_blocks)) == ERR_FAILURE )
+	/* Select random block for encryption if not already passed in; in deterministic mode, one picked by the contents */
+	if (*selected_block_index < 0) {
+		unsigned char seed[_BLOCK_HASH_SIZE];
+
+		if (ctx->dedup_key == NULL)
+			srand(time(NULL));
+		_perf_phase_begin(&phase, ctx->profile != NULL ? &ctx->profile[CZ_PHASE_BLOCK_SELECT] : NULL);
+		if ( ctx->dedup_key != NULL && __content_seed(ctx, plaintext_file, contents, file_size, seed) == ERR_FAILURE ) {
+			_perf_phase_abort(&phase);
+			return ERR_FAILURE;
+		}
+		*selected_block_index = _select_block(ctx, plaintext_file, contents, file_size, block_size, num_blocks, ctx->dedup_key != NULL ? seed : NULL);
+		OPENSSL_cleanse(seed, sizeof(seed));
+		if (*selected_block_index == ERR_FAILURE) {
+			_perf_phase_abort(&phase);
 			return ERR_FAILURE;
+		}
+		_perf_phase_end(&phase, file_size, 0);
 
-	} else if (selected_block_index >= num_blocks) {
+	} else if (*selected_block_index >= num_blocks) {
 		return ERR_FAILURE;
 	}
-	DEBUG_PRINT(("[DEBUG] Encryption block has index %lld.\n", selected_block_index));
+	DEBUG_PRINT(("[DEBUG] Encryption block has index %lld.\n", *selected_block_index));
 
 	/* Extract selected block */
-	if ( (fp = fopen(plaintext_file, "rb")) == NULL) {
-		return ERR_FAILURE;
-	}
-	if ( (fseek(fp, selected_block_index * block_size, SEEK_SET)) != 0 ) {
-		fclose(fp);
-		return ERR_FAILURE;
-	}
-	if ( (fread(selected_block, sizeof(unsigned char), block_size, fp)) < block_size ) {
+	if (contents != NULL) {
+		if ( (*selected_block_index + 1) * block_size > file_size ) {
+			return ERR_FAILURE;
+		}
+		memcpy(selected_block, &contents[*selected_block_index * block_size], block_size);
+	} else {
+		if ( (fp = fopen(plaintext_file, "rb")) == NULL) {
+			return ERR_FAILURE;
+		}
+		if ( (fseek(fp, *selected_block_index * block_size, SEEK_SET)) != 0 ) {
+			fclose(fp);
+			return ERR_FAILURE;
+		}
+		if ( (fread(selected_block, sizeof(unsigned char), block_size, fp)) < block_size ) {
+			fclose(fp);
+			return ERR_FAILURE;
+		}
 		fclose(fp);
-		return ERR_FAILURE;
 	}
-	fclose(fp);
 
 	/* Append password and hash: block_hash = _BLOCK_HASH(selected_block) */
 	memcpy(&selected_block[block_size], ctx->password, MAX_PASSWORD_LENGTH);
-	unsigned char block_hash[_BLOCK_HASH_SIZE];
 	if ( _hash_individual_block(block_hash, selected_block, sizeof(selected_block), _BLOCK_HASH) == ERR_FAILURE ) {
 		return ERR_FAILURE;
 	}
 
 	/* Get file challenge: challenge = _CHALLENGE_HASH(block_hash) */
-	unsigned char challenge[_CHALLENGE_SIZE];
 	if (_hash_individual_block(challenge, block_hash, _BLOCK_HASH_SIZE, _CHALLENGE_HASH) ) {
 		return ERR_FAILURE;	
 	}
 
-	/* Write encryption header to output file */
-	if ( (header_size = _write_header(ctx, encrypted_file, challenge, selected_block_index)) == ERR_FAILURE ) {
+	return 0;
+}
+
+/*
+ * Encrypts the whole file held in 'contents', in place: AES over every block but the selected one, which is encrypted
+ * with RSA. Same output as _encrypt_file().
+ */
+static int _encrypt_in_memory(const CzarrapoContext* ctx, unsigned char* contents, long long int file_size, const unsigned char* key, const unsigned char* iv, long long int selected_block_index) {
+	int block_size = RSA_size(ctx->public_rsa);
+	long long int rsa_offset = selected_block_index * block_size;
+	unsigned char rsa_block[block_size];
+	unsigned char final_block[EVP_MAX_BLOCK_LENGTH];
+	int written_cipher_bytes;
+	const EVP_CIPHER* cipher_type;
+	EVP_CIPHER_CTX* evp_ctx;
+	bool ok;
+
+	if ( (cipher_type = EVP_get_cipherbyname(_SYMMETRIC_CIPHER)) == NULL )
+		return ERR_FAILURE;
+	if ( (evp_ctx = EVP_CIPHER_CTX_new()) == NULL )
+		return ERR_FAILURE;
+
+	/* A stream cipher: the AES parts keep their size, so the stream skips over the RSA block in place */
+	ok = EVP_EncryptInit_ex(evp_ctx, cipher_type, NULL, key, iv) == 1
+		&& EVP_EncryptUpdate(evp_ctx, contents, &written_cipher_bytes, contents, rsa_offset) == 1
+		&& RSA_public_encrypt(block_size, &contents[rsa_offset], rsa_block, ctx->public_rsa, RSA_NO_PADDING) == block_size
+		&& EVP_EncryptUpdate(evp_ctx, &contents[rsa_offset + block_size], &written_cipher_bytes, &contents[rsa_offset + block_size], file_size - rsa_offset - block_size) == 1
+		&& EVP_EncryptFinal_ex(evp_ctx, final_block, &written_cipher_bytes) == 1 && written_cipher_bytes == 0;
+	if (ok)
+		memcpy(&contents[rsa_offset], rsa_block, block_size);
+
+	EVP_CIPHER_CTX_free(evp_ctx);
+	OPENSSL_cleanse(rsa_block, sizeof(rsa_block));
+	return ok ? 0 : ERR_FAILURE;
+}
+
+/*
+ * Small-file path of czarrapo_encrypt(): one read() of the whole file, block selection and encryption in memory, and
+ * one writev() of header and body. 'contents' holds the file ('file_size' bytes) and is overwritten with ciphertext.
+ * RETURNS: zero on success, negative value on error.
+ */
+static int _encrypt_small(CzarrapoContext* ctx, const char* plaintext_file, const char* encrypted_file, unsigned char* contents, long long int file_size, long long int selected_block_index) {
+	output_file_t* output;
+	unsigned char block_hash[_BLOCK_HASH_SIZE];
+	unsigned char challenge[_CHALLENGE_SIZE];
+	unsigned char header[_HEADER_MAX_SIZE];
+	int header_size;
+	perf_phase_t phase;
+
+	if (__prepare_encryption(ctx, plaintext_file, contents, &selected_block_index, block_hash, challenge, &file_size) == ERR_FAILURE) {
+		return ERR_FAILURE;
+	}
+
+	_perf_phase_begin(&phase, ctx->profile != NULL ? &ctx->profile[CZ_PHASE_ENCRYPT] : NULL);
+	if ( (header_size = __build_header(ctx, header, challenge, selected_block_index)) == ERR_FAILURE
+		|| _encrypt_in_memory(ctx, contents, file_size, block_hash, challenge, selected_block_index) == ERR_FAILURE ) {
+		OPENSSL_cleanse(block_hash, sizeof(block_hash));
+		_perf_phase_abort(&phase);
+		return ERR_FAILURE;
+	}
+	OPENSSL_cleanse(block_hash, sizeof(block_hash));
+
+	/* Nothing to detect: the output is written once, whatever the storage */
+	_storage_default(&ctx->io[CZ_IO_OUTPUT]);
+	if ( (output = _output_open(encrypted_file, ctx->io[CZ_IO_OUTPUT].io_size)) == NULL ) {
+		_perf_phase_abort(&phase);
+		return ERR_FAILURE;
+	}
+	struct iovec iov[2] = {
+		{ .iov_base = header, .iov_len = header_size },
+		{ .iov_base = contents, .iov_len = file_size }
+	};
+	if (_output_writev(output, iov, 2) == ERR_FAILURE) {
+		_output_discard(output);
+		_perf_phase_abort(&phase);
+		return ERR_FAILURE;
+	}
+	_perf_phase_end(&phase, file_size, 0);
+
+	/* Sync as requested and publish */
+	if (_output_publish(output, ctx->durability, &ctx->batch) == ERR_FAILURE) {
+		return ERR_FAILURE;
+	}
+	DEBUG_PRINT(("[DEBUG] Small file fully encrypted at %s.\n", encrypted_file));
+
+	return 0;
+}
+
+int czarrapo_encrypt_tee(CzarrapoContext* ctx, const char* plaintext_file, const char* const* encrypted_files, int num_files, long long int selected_block_index) {
+	int header_size;
+	tee_t* output;
+	unsigned char block_hash[_BLOCK_HASH_SIZE];
+	unsigned char challenge[_CHALLENGE_SIZE];
+	long long int file_size;
+	perf_phase_t phase;
+	unsigned char* contents;
+
+	/* Small files to a single destination: fixed costs would dominate the streaming path */
+	if (num_files == 1 && (contents = _read_whole_file(plaintext_file, SMALL_FILE_LIMIT, &file_size)) != NULL) {
+		int ret = _encrypt_small(ctx, plaintext_file, encrypted_files[0], contents, file_size, selected_block_index);
+		free(contents);
+		return ret;
+	}
+
+	if (__prepare_encryption(ctx, plaintext_file, NULL, &selected_block_index, block_hash, challenge, &file_size) == ERR_FAILURE) {
+		return ERR_FAILURE;
+	}
+
+	/* The bulk cipher pass includes the output threads, which are started along with the output */
+	_perf_phase_begin(&phase, ctx->profile != NULL ? &ctx->profile[CZ_PHASE_ENCRYPT] : NULL);
+
+	/* Open output files; they only show up under their names once complete */
+	czarrapo_storage_policy(encrypted_files[0], &ctx->io[CZ_IO_OUTPUT]);
+	if ( (output = _tee_open(encrypted_files, num_files, ctx->io[CZ_IO_OUTPUT].io_size)) == NULL ) {
+		_perf_phase_abort(&phase);
+		return ERR_FAILURE;
+	}
+
+	/* Write encryption header to output files */
+	if ( (header_size = _write_header(ctx, _tee_stream(output), challenge, selected_block_index)) == ERR_FAILURE ) {
+		_tee_discard(output);
+		_perf_phase_abort(&phase);
+		return ERR_FAILURE;
+	}
+	DEBUG_PRINT(("[DEBUG] Encryption header fully written (%i bytes).\n", header_size));
+
+	/* Encrypt with challenge as IV and write to output files, in a single pass whatever their number */
+	if (_encrypt_file(ctx, plaintext_file, _tee_stream(output), block_hash, challenge, selected_block_index) == ERR_FAILURE ) {
+		_tee_discard(output);
+		_perf_phase_abort(&phase);
+		return ERR_FAILURE;
+	}
+	_perf_phase_end(&phase, file_size, 0);
+
+	/* Sync as requested and publish */
+	if (_tee_publish(output, ctx->durability, &ctx->batch) == ERR_FAILURE) {
+		return ERR_FAILURE;
+	}
+	DEBUG_PRINT(("[DEBUG] File fully encrypted at %s (%i destinations).\n", encrypted_files[0], num_files));
+
+	/* Zero out symmetric key, IV and selected block */
+	memset(block_hash, 0, _BLOCK_HASH_SIZE);
+	memset(challenge, 0, _CHALLENGE_SIZE);
+	selected_block_index = -1;
+
+	return 0;
+}
+
+int czarrapo_encrypt_s3(CzarrapoContext* ctx, const char* plaintext_file, const CzarrapoS3Target* target, long long int selected_block_index) {
+	int header_size;
+	s3_upload_t* upload;
+	unsigned char block_hash[_BLOCK_HASH_SIZE];
+	unsigned char challenge[_CHALLENGE_SIZE];
+	long long int file_size;
+	perf_phase_t phase;
+
+	if (__prepare_encryption(ctx, plaintext_file, NULL, &selected_block_index, block_hash, challenge, &file_size) == ERR_FAILURE) {
+		return ERR_FAILURE;
+	}
+
+	/* The bulk cipher pass includes the output threads, which are started along with the output */
+	_perf_phase_begin(&phase, ctx->profile != NULL ? &ctx->profile[CZ_PHASE_ENCRYPT] : NULL);
+
+	/* Object stores are remote storage by definition */
+	_storage_default(&ctx->io[CZ_IO_OUTPUT]);
+	ctx->io[CZ_IO_OUTPUT].storage = CZ_STORAGE_NETWORK;
+
+	/* Start the multipart upload; the object only shows up once it is complete */
+	if ( (upload = _s3_upload_open(target)) == NULL ) {
+		_perf_phase_abort(&phase);
+		return ERR_FAILURE;
+	}
+
+	/* The header is known before the first ciphertext byte, so it simply leads the first part */
+	if ( (header_size = _write_header(ctx, _s3_upload_stream(upload), challenge, selected_block_index)) == ERR_FAILURE ) {
+		_s3_upload_abort(upload);
+		_perf_phase_abort(&phase);
 		return ERR_FAILURE;
 	}
 	DEBUG_PRINT(("[DEBUG] Encryption header fully written (%i bytes).\n", header_size));
 
-	/* Encrypt with challenge as IV and write to output file */
-	if (_encrypt_file(ctx, plaintext_file, encrypted_file, block_hash, challenge, selected_block_index) == ERR_FAILURE ) {
+	/* Encrypt with challenge as IV; full parts are uploaded while the next ones are produced */
+	if (_encrypt_file(ctx, plaintext_file, _s3_upload_stream(upload), block_hash, challenge, selected_block_index) == ERR_FAILURE ) {
+		_s3_upload_abort(upload);
+		_perf_phase_abort(&phase);
+		return ERR_FAILURE;
+	}
+	_perf_phase_end(&phase, file_size, 0);
+
+	/* Upload the last part and complete the upload */
+	if (_s3_upload_complete(upload) == ERR_FAILURE) {
 		return ERR_FAILURE;
 	}
-	DEBUG_PRINT(("[DEBUG] File fully encrypted at %s.\n", encrypted_file));
+	DEBUG_PRINT(("[DEBUG] File fully encrypted to s3://%s/%s.\n", target->bucket, target->key));
 
 	/* Zero out symmetric key, IV and selected block */
 	memset(block_hash, 0, _BLOCK_HASH_SIZE);
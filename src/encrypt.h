@@ -2,14 +2,38 @@
 #define _CZENCRYPT_H
 
 #include "context.h"
+#include "s3.h"
 
 #define NUM_RANDOM_BLOCKS	100
 
+/* Read size for the keyed hash of the whole file in deterministic mode (see czarrapo_set_deterministic()) */
+#ifndef DEDUP_READ_SIZE
+	#define DEDUP_READ_SIZE	(64 * 1024)
+#endif
+
 /*
  * Ciphers a plaintext file into an ecnrypted file. Needs a context, and optionally takes a manually selected block
  * index to use during encryption. The block index can be set to a negative value so it is selected automatically.
+ * Files of up to SMALL_FILE_LIMIT bytes are read, encrypted and written in one go, without storage detection.
  * RETURNS: zero on success, negative value on error.
  */
 int czarrapo_encrypt(CzarrapoContext* ctx, const char* plaintext_file, const char* encrypted_file, long long int selected_block_index);
 
+/*
+ * Same as czarrapo_encrypt(), but writes identical ciphertext to 'num_files' encrypted files from a single read and
+ * cipher pass. Each destination has its own writer thread; a slow one only holds the others back once it falls
+ * TEE_MAX_LAG chunks behind. Either every destination is written or none is: all of them are synced before any is moved
+ * into place, and if one cannot be, those already in place are put back as they were.
+ * RETURNS: zero on success, negative value on error.
+ */
+int czarrapo_encrypt_tee(CzarrapoContext* ctx, const char* plaintext_file, const char* const* encrypted_files, int num_files, long long int selected_block_index);
+
+/*
+ * Same as czarrapo_encrypt(), but uploads the encrypted file to an S3-compatible object store instead of writing it to
+ * disk. Parts of S3_PART_SIZE bytes are uploaded by S3_MAX_UPLOADS threads while encryption goes on. The object only
+ * appears once fully uploaded; on error the upload is aborted. The stored object is identical to an encrypted file.
+ * RETURNS: zero on success, negative value on error.
+ */
+int czarrapo_encrypt_s3(CzarrapoContext* ctx, const char* plaintext_file, const CzarrapoS3Target* target, long long int selected_block_index);
+
 #endif
\ No newline at end of file
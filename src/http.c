@@ -0,0 +1,459 @@
+/* getaddrinfo(), strcasecmp() and sigtimedwait() are POSIX */
+#define _GNU_SOURCE
+
+/* Standard library */
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/* OpenSSL */
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+/* Internal modules */
+#include "common.h"
+#include "http.h"
+
+/* Longest response we are willing to buffer */
+#define _HTTP_MAX_RESPONSE	(16 * 1024 * 1024)
+
+/* Open connection, plain or TLS */
+typedef struct {
+	int fd;
+	SSL_CTX* ssl_ctx;
+	SSL* ssl;
+} http_connection_t;
+
+int _http_parse_url(http_endpoint_t* endpoint, const char* url) {
+	const char* host;
+	const char* end;
+	const char* colon;
+	size_t host_len, port_len;
+
+	memset(endpoint, 0, sizeof(http_endpoint_t));
+	if (strncmp(url, "https://", 8) == 0) {
+		endpoint->tls = true;
+		host = url + 8;
+	} else if (strncmp(url, "http://", 7) == 0) {
+		host = url + 7;
+	} else {
+		return ERR_FAILURE;
+	}
+
+	/* Authority ends at the path, if any. IPv6 literals are not supported. */
+	end = host + strcspn(host, "/?#");
+	colon = memchr(host, ':', end - host);
+	host_len = (colon != NULL ? colon : end) - host;
+	if (host_len == 0 || host_len >= sizeof(endpoint->host))
+		return ERR_FAILURE;
+	memcpy(endpoint->host, host, host_len);
+
+	if (colon != NULL) {
+		port_len = end - colon - 1;
+		if (port_len == 0 || port_len >= sizeof(endpoint->port) || strspn(colon + 1, "0123456789") < port_len)
+			return ERR_FAILURE;
+		memcpy(endpoint->port, colon + 1, port_len);
+	} else {
+		strcpy(endpoint->port, endpoint->tls ? "443" : "80");
+	}
+
+	if (strcmp(endpoint->port, endpoint->tls ? "443" : "80") == 0) {
+		snprintf(endpoint->authority, sizeof(endpoint->authority), "%s", endpoint->host);
+	} else {
+		snprintf(endpoint->authority, sizeof(endpoint->authority), "%s:%s", endpoint->host, endpoint->port);
+	}
+
+	return 0;
+}
+
+static void __disconnect(http_connection_t* conn) {
+	if (conn->ssl != NULL) {
+		SSL_shutdown(conn->ssl);
+		SSL_free(conn->ssl);
+	}
+	if (conn->ssl_ctx != NULL)
+		SSL_CTX_free(conn->ssl_ctx);
+	if (conn->fd >= 0)
+		close(conn->fd);
+	conn->ssl = NULL;
+	conn->ssl_ctx = NULL;
+	conn->fd = -1;
+}
+
+static int __connect(const http_endpoint_t* endpoint, http_connection_t* conn) {
+	struct addrinfo hints = { 0 };
+	struct addrinfo* addrs;
+	struct timeval timeout = { .tv_sec = HTTP_TIMEOUT, .tv_usec = 0 };
+
+	conn->fd = -1;
+	conn->ssl_ctx = NULL;
+	conn->ssl = NULL;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(endpoint->host, endpoint->port, &hints, &addrs) != 0)
+		return ERR_FAILURE;
+
+	/* Linux applies the send timeout to connect() too */
+	for (struct addrinfo* addr = addrs; addr != NULL; addr = addr->ai_next) {
+		if ( (conn->fd = socket(addr->ai_family, addr->ai_socktype | SOCK_CLOEXEC, addr->ai_protocol)) < 0 )
+			continue;
+		setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		if (connect(conn->fd, addr->ai_addr, addr->ai_addrlen) == 0)
+			break;
+		close(conn->fd);
+		conn->fd = -1;
+	}
+	freeaddrinfo(addrs);
+	if (conn->fd < 0)
+		return ERR_FAILURE;
+
+	if (!endpoint->tls)
+		return 0;
+
+	/* Verify the certificate chain and that it was issued for this host */
+	if ( (conn->ssl_ctx = SSL_CTX_new(TLS_client_method())) == NULL ) {
+		__disconnect(conn);
+		return ERR_FAILURE;
+	}
+	SSL_CTX_set_min_proto_version(conn->ssl_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(conn->ssl_ctx, SSL_VERIFY_PEER, NULL);
+	if (SSL_CTX_set_default_verify_paths(conn->ssl_ctx) != 1) {
+		__disconnect(conn);
+		return ERR_FAILURE;
+	}
+	if ( (conn->ssl = SSL_new(conn->ssl_ctx)) == NULL ) {
+		__disconnect(conn);
+		return ERR_FAILURE;
+	}
+	if (SSL_set_tlsext_host_name(conn->ssl, endpoint->host) != 1 || SSL_set1_host(conn->ssl, endpoint->host) != 1
+		|| SSL_set_fd(conn->ssl, conn->fd) != 1 || SSL_connect(conn->ssl) != 1) {
+		__disconnect(conn);
+		return ERR_FAILURE;
+	}
+
+	return 0;
+}
+
+static int __send_all(http_connection_t* conn, const void* buf, size_t len) {
+	const unsigned char* data = buf;
+	ssize_t sent;
+
+	while (len > 0) {
+		if (conn->ssl != NULL) {
+			int chunk = (len > 1 << 30) ? 1 << 30 : (int) len;
+			sent = SSL_write(conn->ssl, data, chunk);
+		} else {
+			sent = send(conn->fd, data, len, 0);
+		}
+		if (sent <= 0) {
+			if (conn->ssl == NULL && sent < 0 && errno == EINTR)
+				continue;
+			return ERR_FAILURE;
+		}
+		data += sent;
+		len -= sent;
+	}
+
+	return 0;
+}
+
+/* RETURNS: bytes read, zero on end of stream, negative value on error */
+static ssize_t __recv_some(http_connection_t* conn, void* buf, size_t len) {
+	ssize_t received;
+
+	if (conn->ssl != NULL) {
+		int chunk = (len > 1 << 30) ? 1 << 30 : (int) len;
+		received = SSL_read(conn->ssl, buf, chunk);
+		if (received > 0)
+			return received;
+
+		/* Servers often close without a close_notify once the response is complete */
+		int err = SSL_get_error(conn->ssl, received);
+		return (err == SSL_ERROR_ZERO_RETURN || (err == SSL_ERROR_SYSCALL && errno == 0)) ? 0 : ERR_FAILURE;
+	}
+
+	do {
+		received = recv(conn->fd, buf, len, 0);
+	} while (received < 0 && errno == EINTR);
+	return received < 0 ? ERR_FAILURE : received;
+}
+
+/*
+ * Decodes a chunked body from 'in' into 'out' (which needs 'len' bytes at most).
+ * RETURNS: 1 if the body is complete, zero if more data is needed, negative value if it is malformed.
+ */
+static int __dechunk(const unsigned char* in, size_t len, unsigned char* out, size_t* out_len) {
+	size_t pos = 0, size;
+	const unsigned char* eol;
+	char* parse_end;
+
+	*out_len = 0;
+	while (true) {
+		if ( (eol = memmem(&in[pos], len - pos, "\r\n", 2)) == NULL )
+			return 0;
+
+		/* Chunk size in hex, optionally followed by extensions */
+		errno = 0;
+		size = strtoul((const char*) &in[pos], &parse_end, 16);
+		if (errno != 0 || (const unsigned char*) parse_end == &in[pos] || (const unsigned char*) parse_end > eol)
+			return ERR_FAILURE;
+		pos = eol - in + 2;
+
+		/* Last chunk: done once the (possibly empty) trailer section is complete */
+		if (size == 0) {
+			if (len - pos >= 2 && memcmp(&in[pos], "\r\n", 2) == 0)
+				return 1;
+			return memmem(&in[pos], len - pos, "\r\n\r\n", 4) != NULL ? 1 : 0;
+		}
+
+		if (size > len || len - pos < size + 2)
+			return 0;
+		if (out != NULL)
+			memcpy(&out[*out_len], &in[pos], size);
+		*out_len += size;
+		pos += size + 2;
+	}
+}
+
+/* Finds header 'name' in a header block and returns a pointer to its value, or NULL */
+static const char* __find_header(const char* headers, const char* name, size_t* value_len) {
+	size_t name_len = strlen(name);
+	const char* line = headers;
+	const char* eol;
+
+	while (*line != '\0') {
+		eol = strstr(line, "\r\n");
+		if (eol == NULL)
+			eol = line + strlen(line);
+
+		if ((size_t) (eol - line) > name_len && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+			const char* value = line + name_len + 1;
+			while (value < eol && (*value == ' ' || *value == '\t'))
+				++value;
+			*value_len = eol - value;
+			while (*value_len > 0 && (value[*value_len - 1] == ' ' || value[*value_len - 1] == '\t'))
+				--(*value_len);
+			return value;
+		}
+
+		line = (*eol == '\0') ? eol : eol + 2;
+	}
+
+	return NULL;
+}
+
+/*
+ * Checks whether 'buf' holds a complete response, given how its body is delimited.
+ * RETURNS: 1 if complete, zero if more data is needed, negative value if malformed.
+ */
+static int __response_complete(const unsigned char* buf, size_t len, size_t header_end, long long content_length, bool chunked) {
+	size_t decoded;
+
+	if (chunked)
+		return __dechunk(&buf[header_end], len - header_end, NULL, &decoded);
+	if (content_length >= 0)
+		return (len - header_end >= (size_t) content_length) ? 1 : 0;
+	return 0;
+}
+
+/* Reads a whole response and splits it into status, headers and body */
+static int __read_response(http_connection_t* conn, const char* method, http_response_t* response) {
+	unsigned char* buf = NULL;
+	size_t len = 0, capacity = 0, header_end = 0;
+	long long content_length = -1;
+	bool chunked = false, have_headers = false;
+	int complete = 0;
+	ssize_t received;
+	const char* value;
+	size_t value_len;
+
+	while (complete == 0) {
+		if (capacity - len < 4096) {
+			capacity = capacity ? 2 * capacity : 16384;
+			unsigned char* grown;
+			if (capacity > _HTTP_MAX_RESPONSE || (grown = realloc(buf, capacity + 1)) == NULL) {
+				free(buf);
+				return ERR_FAILURE;
+			}
+			buf = grown;
+		}
+
+		if ( (received = __recv_some(conn, &buf[len], capacity - len)) < 0 ) {
+			free(buf);
+			return ERR_FAILURE;
+		}
+		len += received;
+		buf[len] = '\0';
+
+		/* Parse the status line and headers as soon as they are in */
+		if (!have_headers) {
+			unsigned char* end = memmem(buf, len, "\r\n\r\n", 4);
+			if (end != NULL) {
+				have_headers = true;
+				header_end = end - buf + 4;
+				if (sscanf((const char*) buf, "HTTP/%*d.%*d %d", &response->status) != 1) {
+					free(buf);
+					return ERR_FAILURE;
+				}
+
+				/* Header block starts after the status line */
+				const char* first = strstr((const char*) buf, "\r\n") + 2;
+				size_t headers_len = (const char*) &buf[header_end - 2] - first;
+				if ( (response->headers = malloc(headers_len + 1)) == NULL ) {
+					free(buf);
+					return ERR_FAILURE;
+				}
+				memcpy(response->headers, first, headers_len);
+				response->headers[headers_len] = '\0';
+
+				if ( (value = __find_header(response->headers, "Transfer-Encoding", &value_len)) != NULL )
+					chunked = (value_len >= 7 && strncasecmp(&value[value_len - 7], "chunked", 7) == 0);
+				if ( (value = __find_header(response->headers, "Content-Length", &value_len)) != NULL )
+					content_length = strtoll(value, NULL, 10);
+
+				/* Responses that never carry a body */
+				if (strcmp(method, "HEAD") == 0 || response->status == 204 || response->status == 304
+					|| (response->status >= 100 && response->status < 200))
+					content_length = 0;
+			}
+		}
+
+		if (have_headers && (complete = __response_complete(buf, len, header_end, content_length, chunked)) < 0) {
+			free(buf);
+			return ERR_FAILURE;
+		}
+
+		/* Without a length, the body runs until the connection is closed */
+		if (received == 0) {
+			if (!have_headers || chunked || content_length >= 0) {
+				free(buf);
+				return ERR_FAILURE;
+			}
+			complete = 1;
+		}
+	}
+
+	/* Move the body to the start of the buffer, decoding it if needed */
+	if (chunked) {
+		if ( (response->body = malloc(len - header_end + 1)) == NULL ) {
+			free(buf);
+			return ERR_FAILURE;
+		}
+		__dechunk(&buf[header_end], len - header_end, response->body, &response->body_len);
+		free(buf);
+	} else {
+		response->body_len = (content_length >= 0) ? (size_t) content_length : len - header_end;
+		memmove(buf, &buf[header_end], response->body_len);
+		response->body = buf;
+	}
+	response->body[response->body_len] = '\0';
+
+	return 0;
+}
+
+/* Writing to a connection the server closed raises SIGPIPE: keep it away from the calling thread */
+static bool __block_sigpipe(sigset_t* old) {
+	sigset_t pending, sigpipe;
+
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &sigpipe, old);
+
+	/* Remember if one was already pending, so we do not swallow it */
+	sigpending(&pending);
+	return sigismember(&pending, SIGPIPE);
+}
+
+static void __restore_sigpipe(const sigset_t* old, bool was_pending) {
+	sigset_t pending, sigpipe;
+	struct timespec zero = { 0, 0 };
+
+	sigemptyset(&sigpipe);
+	sigaddset(&sigpipe, SIGPIPE);
+	sigpending(&pending);
+	if (!was_pending && sigismember(&pending, SIGPIPE))
+		sigtimedwait(&sigpipe, NULL, &zero);
+
+	pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+/* Sends the request line, headers and body */
+static int __send_request(http_connection_t* conn, const http_endpoint_t* endpoint, const char* method, const char* target,
+	const char* const* headers, int num_headers, const unsigned char* body, size_t body_len) {
+	char line[512];
+
+	snprintf(line, sizeof(line), "%s ", method);
+	if (__send_all(conn, line, strlen(line)) == ERR_FAILURE || __send_all(conn, target, strlen(target)) == ERR_FAILURE)
+		return ERR_FAILURE;
+	snprintf(line, sizeof(line), " HTTP/1.1\r\nHost: %s\r\nContent-Length: %zu\r\nConnection: close\r\n", endpoint->authority, body_len);
+	if (__send_all(conn, line, strlen(line)) == ERR_FAILURE)
+		return ERR_FAILURE;
+
+	for (int i=0; i<num_headers; ++i) {
+		if (__send_all(conn, headers[i], strlen(headers[i])) == ERR_FAILURE || __send_all(conn, "\r\n", 2) == ERR_FAILURE)
+			return ERR_FAILURE;
+	}
+	if (__send_all(conn, "\r\n", 2) == ERR_FAILURE)
+		return ERR_FAILURE;
+
+	if (body_len > 0 && __send_all(conn, body, body_len) == ERR_FAILURE)
+		return ERR_FAILURE;
+
+	return 0;
+}
+
+int _http_request(const http_endpoint_t* endpoint, const char* method, const char* target, const char* const* headers,
+	int num_headers, const unsigned char* body, size_t body_len, http_response_t* response) {
+	http_connection_t conn;
+	sigset_t old_mask;
+	bool sigpipe_pending;
+	int ret = ERR_FAILURE;
+
+	memset(response, 0, sizeof(http_response_t));
+	sigpipe_pending = __block_sigpipe(&old_mask);
+
+	if (__connect(endpoint, &conn) == 0) {
+		if (__send_request(&conn, endpoint, method, target, headers, num_headers, body, body_len) == 0)
+			ret = __read_response(&conn, method, response);
+		if (ret == ERR_FAILURE)
+			_http_response_free(response);
+		__disconnect(&conn);
+	}
+
+	__restore_sigpipe(&old_mask, sigpipe_pending);
+	return ret;
+}
+
+int _http_response_header(const http_response_t* response, const char* name, char* value, size_t len) {
+	const char* found;
+	size_t found_len;
+
+	if (response->headers == NULL || (found = __find_header(response->headers, name, &found_len)) == NULL)
+		return ERR_FAILURE;
+	if (found_len >= len)
+		return ERR_FAILURE;
+
+	memcpy(value, found, found_len);
+	value[found_len] = '\0';
+	return 0;
+}
+
+void _http_response_free(http_response_t* response) {
+	free(response->headers);
+	free(response->body);
+	response->headers = NULL;
+	response->body = NULL;
+	response->body_len = 0;
+}
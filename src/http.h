@@ -0,0 +1,53 @@
+#ifndef _CZHTTP_H
+#define _CZHTTP_H
+
+/* Standard library */
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Seconds a connection may stay idle (connecting, sending or receiving) before a request fails */
+#ifndef HTTP_TIMEOUT
+	#define HTTP_TIMEOUT	60
+#endif
+
+/* Server to send requests to, parsed from an "http://host[:port]" or "https://host[:port]" URL */
+typedef struct {
+	bool tls;
+	char host[256];
+	char port[8];
+	char authority[272];	/* Value of the Host header: the host, plus the port when it is not the default one */
+} http_endpoint_t;
+
+/* Response to a request. Header names and values are kept as received. */
+typedef struct {
+	int status;
+	char* headers;		/* Header block, one "Name: value\r\n" line per header */
+	unsigned char* body;	/* Decoded body, NUL terminated */
+	size_t body_len;
+} http_response_t;
+
+/*
+ * Parses 'url' into 'endpoint'. Anything after the authority (a path, a trailing slash) is ignored.
+ * RETURNS: zero on success, negative value on error.
+ */
+int _http_parse_url(http_endpoint_t* endpoint, const char* url);
+
+/*
+ * Sends a single HTTP/1.1 request over a new connection and reads the whole response. 'target' is the request path
+ * plus query string, already encoded. 'headers' holds 'num_headers' complete "Name: value" lines; Host, Content-Length
+ * and Connection are added here. TLS connections verify the server certificate against the default trust store.
+ * The response must be freed with _http_response_free(), whatever its status.
+ * RETURNS: zero if a response was received, negative value on error.
+ */
+int _http_request(const http_endpoint_t* endpoint, const char* method, const char* target, const char* const* headers,
+	int num_headers, const unsigned char* body, size_t body_len, http_response_t* response);
+
+/*
+ * Looks up header 'name' (case insensitive) in 'response' and copies its value into 'value', up to 'len' bytes.
+ * RETURNS: zero if found, negative value otherwise.
+ */
+int _http_response_header(const http_response_t* response, const char* name, char* value, size_t len);
+
+void _http_response_free(http_response_t* response);
+
+#endif
@@ -6,6 +6,7 @@
 #include "context.h"		// czarrapo_init() and czarrapo_free()
 #include "encrypt.h"		// czarrapo_encrypt()
 #include "decrypt.h"		// czarrapo_decrypt()
+#include "cpu.h"		// czarrapo_capabilities()
 
 /* Sample error handling function */
 static void handle_error(CzarrapoContext* ctx) {
@@ -20,6 +21,10 @@ int main() {
 	char* passphrase = "asdf";
 	char* password = "1234";
 	bool fast_mode = true;
+	const CzarrapoCapabilities* caps = czarrapo_capabilities();
+
+	/* Report the kernels selected for this CPU */
+	printf("[CPU KERNELS] block compare: %s\n", caps->block_compare);
 
 	/* Generate keypair */
 	printf("[GENERATING RSA KEYPAIR]\n");
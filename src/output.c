@@ -0,0 +1,387 @@
+/* O_TMPFILE and syncfs() are Linux extensions */
+#define _GNU_SOURCE
+
+/* Standard library */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* OpenSSL */
+#include <openssl/rand.h>
+
+/* Internal modules */
+#include "common.h"
+#include "output.h"
+
+/* Attempts at finding an unused temporary name */
+#define _TMP_NAME_TRIES		16
+
+struct output_file {
+	FILE* fp;
+	char* path;		/* Final name */
+	char* tmp_path;		/* Temporary name, or NULL for an unnamed O_TMPFILE file */
+	char* replaced_path;	/* Extra name of the file it replaced, kept by _output_link() until _output_finish() */
+	int dir_fd;		/* Directory the file is published into */
+};
+
+struct sync_batch {
+	int* fds;		/* One open directory per filesystem */
+	dev_t* devs;
+	int count;
+	int capacity;
+};
+
+/* Returns a heap copy of the directory part of 'path' */
+static char* __dirname(const char* path) {
+	const char* slash = strrchr(path, '/');
+	char* dir;
+
+	if (slash == NULL)
+		return strdup(".");
+	if (slash == path)
+		return strdup("/");
+
+	if ( (dir = malloc(slash - path + 1)) == NULL )
+		return NULL;
+	memcpy(dir, path, slash - path);
+	dir[slash - path] = '\0';
+	return dir;
+}
+
+/* Fills 'tmp_path' (strlen(path) + 8 bytes) with 'path' plus a random suffix */
+static int __tmp_name(char* tmp_path, const char* path) {
+	unsigned char suffix[3];
+
+	if (RAND_bytes(suffix, sizeof(suffix)) != 1)
+		return ERR_FAILURE;
+	sprintf(tmp_path, "%s.%02x%02x%02x", path, suffix[0], suffix[1], suffix[2]);
+	return 0;
+}
+
+/* Creates a new file under a free temporary name next to 'path'. Same permissions as fopen(path, "wb"). */
+static int __open_tmp_name(char* tmp_path, const char* path) {
+	int fd;
+
+	for (int i=0; i<_TMP_NAME_TRIES; ++i) {
+		if (__tmp_name(tmp_path, path) == ERR_FAILURE)
+			return ERR_FAILURE;
+		if ( (fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666)) >= 0 )
+			return fd;
+		if (errno != EEXIST)
+			return ERR_FAILURE;
+	}
+	return ERR_FAILURE;
+}
+
+output_file_t* _output_open(const char* path, int io_size) {
+	output_file_t* output;
+	char* dir;
+	int fd = -1;
+
+	if ( (output = calloc(1, sizeof(output_file_t))) == NULL )
+		return NULL;
+	output->dir_fd = -1;
+
+	if ( (output->path = strdup(path)) == NULL ) {
+		_output_discard(output);
+		return NULL;
+	}
+
+	/* Keep the directory open: it is where the file gets linked, and what gets synced */
+	if ( (dir = __dirname(path)) == NULL ) {
+		_output_discard(output);
+		return NULL;
+	}
+	output->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (output->dir_fd < 0) {
+		free(dir);
+		_output_discard(output);
+		return NULL;
+	}
+
+	/* Prefer an unnamed file: nothing is left behind if we crash before publishing. Linking it needs /proc. */
+	#ifdef O_TMPFILE
+	if (access("/proc/self/fd", X_OK) == 0)
+		fd = open(dir, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+	#endif
+	free(dir);
+
+	/* Filesystem without O_TMPFILE support: write to a temporary name and rename it */
+	if (fd < 0) {
+		if ( (output->tmp_path = malloc(strlen(path) + 8)) == NULL ) {
+			_output_discard(output);
+			return NULL;
+		}
+		if ( (fd = __open_tmp_name(output->tmp_path, path)) == ERR_FAILURE ) {
+			free(output->tmp_path);
+			output->tmp_path = NULL;
+			_output_discard(output);
+			return NULL;
+		}
+	}
+
+	if ( (output->fp = fdopen(fd, "wb")) == NULL ) {
+		close(fd);
+		_output_discard(output);
+		return NULL;
+	}
+	setvbuf(output->fp, NULL, _IOFBF, io_size);
+
+	return output;
+}
+
+FILE* _output_stream(output_file_t* output) {
+	return output->fp;
+}
+
+int _output_writev(output_file_t* output, const struct iovec* iov, int iovcnt) {
+	struct iovec left[iovcnt];
+	ssize_t amount_written;
+	int first = 0;
+
+	if (fflush(output->fp) != 0)
+		return ERR_FAILURE;
+
+	/* Short writes: skip what went through and try again with the rest */
+	memcpy(left, iov, iovcnt * sizeof(struct iovec));
+	while (first < iovcnt) {
+		if ( (amount_written = writev(fileno(output->fp), &left[first], iovcnt - first)) < 0 ) {
+			if (errno == EINTR)
+				continue;
+			return ERR_FAILURE;
+		}
+		while (first < iovcnt && (size_t) amount_written >= left[first].iov_len)
+			amount_written -= left[first++].iov_len;
+		if (first < iovcnt) {
+			left[first].iov_base = (char*) left[first].iov_base + amount_written;
+			left[first].iov_len -= amount_written;
+		}
+	}
+	return 0;
+}
+
+/* Gives the unnamed file its final name. If the name is taken, link it under a temporary name and rename over it. */
+static int __link_tmpfile(output_file_t* output) {
+	char proc_path[32];
+	char tmp_path[strlen(output->path) + 8];
+
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fileno(output->fp));
+	if (linkat(AT_FDCWD, proc_path, AT_FDCWD, output->path, AT_SYMLINK_FOLLOW) == 0)
+		return 0;
+	if (errno != EEXIST)
+		return ERR_FAILURE;
+
+	for (int i=0; i<_TMP_NAME_TRIES; ++i) {
+		if (__tmp_name(tmp_path, output->path) == ERR_FAILURE)
+			return ERR_FAILURE;
+		if (linkat(AT_FDCWD, proc_path, AT_FDCWD, tmp_path, AT_SYMLINK_FOLLOW) == 0) {
+			if (rename(tmp_path, output->path) != 0) {
+				unlink(tmp_path);
+				return ERR_FAILURE;
+			}
+			return 0;
+		}
+		if (errno != EEXIST)
+			return ERR_FAILURE;
+	}
+	return ERR_FAILURE;
+}
+
+/* Records the filesystem holding 'dir_fd' in the batch, unless it is already there */
+static int __sync_batch_add(sync_batch_t** batch_ptr, int dir_fd) {
+	sync_batch_t* batch = *batch_ptr;
+	struct stat st;
+
+	if (fstat(dir_fd, &st) != 0)
+		return ERR_FAILURE;
+
+	if (batch == NULL) {
+		if ( (batch = calloc(1, sizeof(sync_batch_t))) == NULL )
+			return ERR_FAILURE;
+		*batch_ptr = batch;
+	}
+
+	for (int i=0; i<batch->count; ++i) {
+		if (batch->devs[i] == st.st_dev)
+			return 0;
+	}
+
+	if (batch->count == batch->capacity) {
+		int capacity = batch->capacity ? 2 * batch->capacity : 4;
+		int* fds = realloc(batch->fds, capacity * sizeof(int));
+		if (fds == NULL)
+			return ERR_FAILURE;
+		batch->fds = fds;
+		dev_t* devs = realloc(batch->devs, capacity * sizeof(dev_t));
+		if (devs == NULL)
+			return ERR_FAILURE;
+		batch->devs = devs;
+		batch->capacity = capacity;
+	}
+
+	if ( (batch->fds[batch->count] = dup(dir_fd)) < 0 )
+		return ERR_FAILURE;
+	batch->devs[batch->count] = st.st_dev;
+	++batch->count;
+	return 0;
+}
+
+/* Gives the file currently under the final name a second, temporary name, so it survives being replaced */
+static int __keep_replaced(output_file_t* output) {
+	char tmp_path[strlen(output->path) + 8];
+
+	for (int i=0; i<_TMP_NAME_TRIES; ++i) {
+		if (__tmp_name(tmp_path, output->path) == ERR_FAILURE)
+			return ERR_FAILURE;
+		if (link(output->path, tmp_path) == 0) {
+			if ( (output->replaced_path = strdup(tmp_path)) == NULL ) {
+				unlink(tmp_path);
+				return ERR_FAILURE;
+			}
+			return 0;
+		}
+
+		/* Nothing to replace */
+		if (errno == ENOENT)
+			return 0;
+		if (errno != EEXIST)
+			return ERR_FAILURE;
+	}
+	return ERR_FAILURE;
+}
+
+int _output_prepare(output_file_t* output, CzarrapoDurability durability) {
+
+	/* Push buffered data to the kernel, and to the device if asked to */
+	if (fflush(output->fp) != 0)
+		return ERR_FAILURE;
+	if (durability == CZ_DURABILITY_FILE && fdatasync(fileno(output->fp)) != 0)
+		return ERR_FAILURE;
+	return 0;
+}
+
+int _output_link(output_file_t* output, bool keep_replaced) {
+	int ret;
+
+	if (keep_replaced && __keep_replaced(output) == ERR_FAILURE)
+		return ERR_FAILURE;
+
+	/* Atomically move into place */
+	if (output->tmp_path == NULL) {
+		ret = __link_tmpfile(output);
+	} else {
+		ret = (rename(output->tmp_path, output->path) == 0) ? 0 : ERR_FAILURE;
+	}
+	if (ret == ERR_FAILURE) {
+		if (output->replaced_path != NULL) {
+			unlink(output->replaced_path);
+			free(output->replaced_path);
+			output->replaced_path = NULL;
+		}
+		return ERR_FAILURE;
+	}
+	free(output->tmp_path);
+	output->tmp_path = NULL;
+	return 0;
+}
+
+void _output_unlink(output_file_t* output) {
+	if (output->replaced_path != NULL) {
+		rename(output->replaced_path, output->path);
+		free(output->replaced_path);
+		output->replaced_path = NULL;
+	} else {
+		unlink(output->path);
+	}
+	_output_discard(output);
+}
+
+int _output_finish(output_file_t* output, CzarrapoDurability durability, sync_batch_t** batch) {
+	int ret = 0;
+
+	/* The replaced file is gone for good now */
+	if (output->replaced_path != NULL) {
+		unlink(output->replaced_path);
+		free(output->replaced_path);
+		output->replaced_path = NULL;
+	}
+
+	/* The new directory entry must be durable too */
+	if (durability == CZ_DURABILITY_FILE && fsync(output->dir_fd) != 0)
+		ret = ERR_FAILURE;
+	if (durability == CZ_DURABILITY_BATCH && __sync_batch_add(batch, output->dir_fd) == ERR_FAILURE)
+		ret = ERR_FAILURE;
+
+	if (fclose(output->fp) != 0)
+		ret = ERR_FAILURE;
+	output->fp = NULL;
+	_output_discard(output);
+
+	return ret;
+}
+
+int _output_publish(output_file_t* output, CzarrapoDurability durability, sync_batch_t** batch) {
+	if (_output_prepare(output, durability) == ERR_FAILURE || _output_link(output, false) == ERR_FAILURE) {
+		_output_discard(output);
+		return ERR_FAILURE;
+	}
+	return _output_finish(output, durability, batch);
+}
+
+void _output_discard(output_file_t* output) {
+	if (output == NULL)
+		return;
+
+	if (output->fp != NULL)
+		fclose(output->fp);
+	if (output->tmp_path != NULL) {
+		unlink(output->tmp_path);
+		free(output->tmp_path);
+	}
+	if (output->replaced_path != NULL) {
+		unlink(output->replaced_path);
+		free(output->replaced_path);
+	}
+	if (output->dir_fd >= 0)
+		close(output->dir_fd);
+	free(output->path);
+	free(output);
+}
+
+int _sync_batch_flush(sync_batch_t* batch) {
+	int ret = 0;
+
+	if (batch == NULL)
+		return 0;
+
+	for (int i=0; i<batch->count; ++i) {
+		#ifdef __linux__
+		if (syncfs(batch->fds[i]) != 0)
+			ret = ERR_FAILURE;
+		#else
+		sync();
+		#endif
+		close(batch->fds[i]);
+	}
+	batch->count = 0;
+
+	return ret;
+}
+
+void _sync_batch_free(sync_batch_t* batch) {
+	if (batch == NULL)
+		return;
+
+	for (int i=0; i<batch->count; ++i)
+		close(batch->fds[i]);
+	free(batch->fds);
+	free(batch->devs);
+	free(batch);
+}
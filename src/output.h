@@ -0,0 +1,91 @@
+#ifndef _CZOUTPUT_H
+#define _CZOUTPUT_H
+
+/* Standard library */
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+/*
+ * How hard to try to get output files onto stable storage before reporting success:
+ * - CZ_DURABILITY_NONE: leave write-back to the OS.
+ * - CZ_DURABILITY_FILE: fdatasync() each output file, and its directory, as part of the call that writes it.
+ * - CZ_DURABILITY_BATCH: defer to czarrapo_sync(), which syncs every filesystem written to since the last call once.
+ * Output files are always published atomically: they only appear under their final name once fully written.
+ */
+typedef enum {
+	CZ_DURABILITY_NONE = 0,
+	CZ_DURABILITY_FILE,
+	CZ_DURABILITY_BATCH
+} CzarrapoDurability;
+
+/* Output file being written under a temporary name, published with _output_publish() */
+typedef struct output_file output_file_t;
+
+/* Set of filesystems with unsynced output, flushed together by _sync_batch_flush() */
+typedef struct sync_batch sync_batch_t;
+
+/*
+ * Opens a new output file that will replace 'path' once published. The stream is fully buffered, with a buffer of
+ * 'io_size' bytes.
+ * RETURNS: a pointer to the output file, NULL on failure.
+ */
+output_file_t* _output_open(const char* path, int io_size);
+
+/* Stream to write output data to */
+FILE* _output_stream(output_file_t* output);
+
+/*
+ * Writes 'iovcnt' buffers in order, straight to the file with a single writev() when the kernel takes them all at once.
+ * Anything buffered in the stream is flushed first, so both can be mixed.
+ * RETURNS: zero on success, negative value on error.
+ */
+int _output_writev(output_file_t* output, const struct iovec* iov, int iovcnt);
+
+/*
+ * Flushes the file, applies the 'durability' mode and moves it into place. With CZ_DURABILITY_BATCH its filesystem is
+ * recorded in 'batch'. Frees 'output' in all cases; on failure nothing is left under the final name.
+ * RETURNS: zero on success, negative value on error.
+ */
+int _output_publish(output_file_t* output, CzarrapoDurability durability, sync_batch_t** batch);
+
+/*
+ * Publishing in steps, for sets of files that must all appear or none: _output_prepare() every file, then
+ * _output_link() each, undoing the ones already linked with _output_unlink() if one fails, and _output_finish() them
+ * all once every link succeeded. _output_publish() does the three for a single file.
+ */
+
+/*
+ * Flushes the file and, in CZ_DURABILITY_FILE mode, syncs its data. 'output' is left open: publish or discard it after.
+ * RETURNS: zero on success, negative value on error.
+ */
+int _output_prepare(output_file_t* output, CzarrapoDurability durability);
+
+/*
+ * Moves the file into place. With 'keep_replaced', the file it replaces keeps a temporary name, so _output_unlink()
+ * can put it back; if no such name can be made, nothing is replaced. On failure 'output' is left as it was.
+ * RETURNS: zero on success, negative value on error.
+ */
+int _output_link(output_file_t* output, bool keep_replaced);
+
+/* Undoes _output_link(): restores the file it replaced, if it kept it, or removes the new name. Frees 'output'. */
+void _output_unlink(output_file_t* output);
+
+/*
+ * Completes the publication of a linked file: drops the replaced file, syncs the directory entry or records it in
+ * 'batch' as 'durability' asks, and frees 'output'. The file stays published if this fails.
+ * RETURNS: zero on success, negative value on error.
+ */
+int _output_finish(output_file_t* output, CzarrapoDurability durability, sync_batch_t** batch);
+
+/* Throws away a partially written output file. Frees 'output'. */
+void _output_discard(output_file_t* output);
+
+/*
+ * Syncs every filesystem recorded in 'batch' and empties it.
+ * RETURNS: zero on success, negative value on error.
+ */
+int _sync_batch_flush(sync_batch_t* batch);
+void _sync_batch_free(sync_batch_t* batch);
+
+#endif
@@ -0,0 +1,134 @@
+/* syscall() is a GNU extension */
+#define _GNU_SOURCE
+
+/* Standard library */
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+#endif
+
+/* Internal modules */
+#include "perf.h"
+
+#ifdef __linux__
+
+/* Event type and config for each CzarrapoCounter */
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} _counter_events[CZ_NUM_COUNTERS] = {
+	[CZ_COUNTER_CYCLES]		= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	[CZ_COUNTER_INSTRUCTIONS]	= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	[CZ_COUNTER_CACHE_MISSES]	= { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	[CZ_COUNTER_DTLB_MISSES]	= { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	[CZ_COUNTER_CONTEXT_SWITCHES]	= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	[CZ_COUNTER_TASK_CLOCK]		= { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+};
+
+/* Opens a disabled counter for the calling thread and its future children */
+static int __open_counter(CzarrapoCounter counter) {
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = _counter_events[counter].type;
+	attr.config = _counter_events[counter].config;
+	attr.disabled = 1;
+	attr.inherit = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	/* Count kernel time too (file reads are part of every phase), unless we are not allowed to */
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+		attr.exclude_kernel = 1;
+		fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	}
+	return fd;
+}
+
+#endif
+
+void _perf_phase_begin(perf_phase_t* phase, CzarrapoPhaseStats* stats) {
+	phase->stats = stats;
+	for (int i=0; i<CZ_NUM_COUNTERS; ++i)
+		phase->fds[i] = -1;
+	if (stats == NULL)
+		return;
+
+	/* Opening the counters is not part of the phase; starting them is, so the phase CPU time never exceeds wall time */
+	#ifdef __linux__
+	for (int i=0; i<CZ_NUM_COUNTERS; ++i)
+		phase->fds[i] = __open_counter(i);
+	#endif
+	clock_gettime(CLOCK_MONOTONIC, &phase->start);
+	#ifdef __linux__
+	for (int i=0; i<CZ_NUM_COUNTERS; ++i) {
+		if (phase->fds[i] >= 0)
+			ioctl(phase->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+	#endif
+}
+
+void _perf_phase_end(perf_phase_t* phase, long long bytes, long long ops) {
+	CzarrapoPhaseStats* stats = phase->stats;
+	struct timespec end;
+
+	if (stats == NULL)
+		return;
+
+	#ifdef __linux__
+	for (int i=0; i<CZ_NUM_COUNTERS; ++i) {
+		if (phase->fds[i] >= 0)
+			ioctl(phase->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	}
+	#endif
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stats->wall_ns += (end.tv_sec - phase->start.tv_sec) * 1000000000LL + (end.tv_nsec - phase->start.tv_nsec);
+	stats->bytes += bytes;
+	stats->ops += ops;
+	++stats->runs;
+
+	#ifdef __linux__
+	for (int i=0; i<CZ_NUM_COUNTERS; ++i) {
+		uint64_t values[3];		/* Value, time enabled, time running */
+
+		if (phase->fds[i] < 0)
+			continue;
+		if (read(phase->fds[i], values, sizeof(values)) == sizeof(values) && values[2] > 0) {
+			/* Multiplexed counters only ran for part of the phase: extrapolate */
+			if (values[2] < values[1])
+				values[0] = (uint64_t) ((double) values[0] * values[1] / values[2]);
+			if (stats->counters[i] < 0)
+				stats->counters[i] = 0;
+			stats->counters[i] += values[0];
+		}
+		close(phase->fds[i]);
+		phase->fds[i] = -1;
+	}
+	#endif
+}
+
+void _perf_phase_abort(perf_phase_t* phase) {
+	for (int i=0; i<CZ_NUM_COUNTERS; ++i) {
+		if (phase->fds[i] >= 0)
+			close(phase->fds[i]);
+		phase->fds[i] = -1;
+	}
+	phase->stats = NULL;
+}
+
+void _perf_stats_reset(CzarrapoPhaseStats* stats) {
+	for (int phase=0; phase<CZ_NUM_PHASES; ++phase) {
+		memset(&stats[phase], 0, sizeof(CzarrapoPhaseStats));
+		for (int i=0; i<CZ_NUM_COUNTERS; ++i)
+			stats[phase].counters[i] = -1;
+	}
+}
@@ -0,0 +1,67 @@
+#ifndef _CZPERF_H
+#define _CZPERF_H
+
+/* Standard library */
+#include <time.h>
+
+/* Phases of encryption and decryption that are profiled separately */
+typedef enum {
+	CZ_PHASE_BLOCK_SELECT = 0,	/* Encryption: picking the key block */
+	CZ_PHASE_ENCRYPT,		/* Encryption: bulk cipher pass */
+	CZ_PHASE_FAST_SEARCH,		/* Decryption: key block search in fast mode */
+	CZ_PHASE_SLOW_SEARCH,		/* Decryption: key block search in slow mode */
+	CZ_PHASE_DECRYPT,		/* Decryption: bulk cipher pass */
+	CZ_NUM_PHASES
+} CzarrapoPhase;
+
+/* Counters collected for each phase, from perf_event_open() */
+typedef enum {
+	CZ_COUNTER_CYCLES = 0,
+	CZ_COUNTER_INSTRUCTIONS,
+	CZ_COUNTER_CACHE_MISSES,	/* Last level cache */
+	CZ_COUNTER_DTLB_MISSES,		/* Data TLB load misses */
+	CZ_COUNTER_CONTEXT_SWITCHES,
+	CZ_COUNTER_TASK_CLOCK,		/* CPU time, in nanoseconds, summed over threads */
+	CZ_NUM_COUNTERS
+} CzarrapoCounter;
+
+/*
+ * Totals for one phase over every run since profiling was enabled. Counters include the threads a phase starts. A
+ * counter the CPU, kernel or permissions do not provide (see /proc/sys/kernel/perf_event_paranoid) stays at -1.
+ * Counters the kernel had to multiplex are scaled to the whole phase.
+ */
+typedef struct {
+	long long runs;
+	long long bytes;			/* Size of the files processed */
+	long long ops;				/* Primitive operations the phase is bound by: candidate hashes in fast
+						 * search, RSA private operations in slow search; zero elsewhere */
+	long long wall_ns;
+	long long counters[CZ_NUM_COUNTERS];
+} CzarrapoPhaseStats;
+
+/* One phase being measured */
+typedef struct {
+	CzarrapoPhaseStats* stats;		/* NULL if profiling is disabled */
+	int fds[CZ_NUM_COUNTERS];
+	struct timespec start;
+} perf_phase_t;
+
+/*
+ * Starts counting a phase on the calling thread and on the threads it starts from now on. Does nothing if 'stats' is
+ * NULL.
+ */
+void _perf_phase_begin(perf_phase_t* phase, CzarrapoPhaseStats* stats);
+
+/*
+ * Stops counting and adds the phase, which went over 'bytes' bytes with 'ops' primitive operations, to its stats. Threads
+ * started by the phase count up to this point, whether they have exited or not.
+ */
+void _perf_phase_end(perf_phase_t* phase, long long bytes, long long ops);
+
+/* Stops counting without recording anything, for phases that failed */
+void _perf_phase_abort(perf_phase_t* phase);
+
+/* Resets every phase to zero runs, with all counters unavailable */
+void _perf_stats_reset(CzarrapoPhaseStats* stats);
+
+#endif
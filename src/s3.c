@@ -0,0 +1,568 @@
+/* fopencookie() is a GNU extension */
+#define _GNU_SOURCE
+
+/* Standard library */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* OpenSSL */
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+/* Internal modules */
+#include "common.h"
+#include "http.h"
+#include "s3.h"
+#include "threading.h"
+
+/* Hex encoded SHA-256, plus NUL */
+#define _SHA256_HEX_SIZE	65
+
+/* Longest ETag we keep; stores return a quoted hex digest, possibly with a part count suffix */
+#define _ETAG_SIZE		128
+
+#ifdef CZ_NO_THREADS
+	#define _S3_BUFFERS	1
+#else
+	#define _S3_BUFFERS	(S3_MAX_UPLOADS + 1)
+#endif
+
+/* Part waiting to be uploaded */
+typedef struct {
+	int number;		/* 1-based part number */
+	unsigned char* data;
+	size_t len;
+} s3_part_t;
+
+struct s3_upload {
+	http_endpoint_t endpoint;
+	char* region;
+	char* access_key;
+	char* secret_key;
+	char* path;			/* "/<bucket>/<key>", URI encoded */
+	char* upload_id;		/* URI encoded */
+	FILE* stream;			/* What the caller writes to */
+
+	unsigned char* fill;		/* Part being filled by the caller */
+	size_t fill_len;
+	int num_parts;			/* Parts handed out for upload so far */
+	char (*etags)[_ETAG_SIZE];	/* ETag of each part, by part number - 1 */
+	int etags_capacity;
+	bool failed;			/* A part could not be uploaded */
+
+	unsigned char* buffers[_S3_BUFFERS];
+
+	#ifndef CZ_NO_THREADS
+	czthread_t threads[S3_MAX_UPLOADS];
+	int num_threads;
+	s3_part_t pending[_S3_BUFFERS];	/* FIFO of full parts */
+	int pending_head;
+	int pending_count;
+	unsigned char* free_buffers[_S3_BUFFERS];
+	int num_free;
+	bool done;			/* No more parts will be queued */
+	bool synchronized;		/* lock, work and space are initialized */
+	czmutex_t lock;
+	czcond_t work;			/* Signalled when a part is queued */
+	czcond_t space;			/* Signalled when a buffer is given back */
+	#endif
+};
+
+/* Writes the lowercase hex encoding of 'len' bytes of 'in' to 'out', which needs 2 * len + 1 bytes */
+static void __hex(char* out, const unsigned char* in, size_t len) {
+	for (size_t i=0; i<len; ++i)
+		sprintf(&out[2 * i], "%02x", in[i]);
+	out[2 * len] = '\0';
+}
+
+static int __sha256_hex(char* out, const void* data, size_t len) {
+	unsigned char digest[32];
+
+	if (EVP_Digest(data, len, digest, NULL, EVP_sha256(), NULL) != 1)
+		return ERR_FAILURE;
+	__hex(out, digest, sizeof(digest));
+	return 0;
+}
+
+static int __hmac_sha256(unsigned char* out, const void* key, size_t key_len, const char* data) {
+	unsigned int out_len;
+
+	return HMAC(EVP_sha256(), key, key_len, (const unsigned char*) data, strlen(data), out, &out_len) == NULL ? ERR_FAILURE : 0;
+}
+
+/* URI encodes 'in' as SigV4 expects: everything but unreserved characters, and '/' unless 'keep_slash' is set */
+static char* __uri_encode(const char* in, bool keep_slash) {
+	char* out;
+	size_t pos = 0;
+
+	if ( (out = malloc(3 * strlen(in) + 1)) == NULL )
+		return NULL;
+
+	for (const unsigned char* c = (const unsigned char*) in; *c != '\0'; ++c) {
+		if ((*c >= 'A' && *c <= 'Z') || (*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9')
+			|| *c == '-' || *c == '.' || *c == '_' || *c == '~' || (keep_slash && *c == '/')) {
+			out[pos++] = *c;
+		} else {
+			pos += sprintf(&out[pos], "%%%02X", *c);
+		}
+	}
+	out[pos] = '\0';
+
+	return out;
+}
+
+/*
+ * Sends one request signed with AWS Signature Version 4. 'query' must already be in canonical form (parameters sorted
+ * and encoded). Transport errors, 5xx/429 responses and 200 responses carrying an error document are retried.
+ * RETURNS: zero on a 2xx response, which is left in 'response' for the caller to free; negative value otherwise.
+ */
+static int __s3_request(s3_upload_t* upload, const char* method, const char* query, const unsigned char* body,
+	size_t body_len, http_response_t* response) {
+	char payload_hash[_SHA256_HEX_SIZE], canonical_hash[_SHA256_HEX_SIZE];
+	char amz_date[17], date[9];
+	char scope[128];
+	unsigned char key[32];
+	unsigned char signature[32];
+	char signature_hex[_SHA256_HEX_SIZE];
+	struct tm now;
+	time_t t;
+
+	if (__sha256_hex(payload_hash, body, body_len) == ERR_FAILURE)
+		return ERR_FAILURE;
+
+	size_t target_len = strlen(upload->path) + strlen(query) + 2;
+	char target[target_len];
+	snprintf(target, target_len, "%s%s%s", upload->path, query[0] != '\0' ? "?" : "", query);
+
+	for (int attempt=0; attempt<S3_RETRIES; ++attempt) {
+
+		/* Back off before retrying: 200 ms, 400 ms... */
+		if (attempt > 0) {
+			long delay_ms = 200L << (attempt - 1);
+			struct timespec delay = { delay_ms / 1000, (delay_ms % 1000) * 1000000L };
+			nanosleep(&delay, NULL);
+		}
+
+		/* Signed each time, as the signature is only valid for a few minutes */
+		t = time(NULL);
+		gmtime_r(&t, &now);
+		strftime(amz_date, sizeof(amz_date), "%Y%m%dT%H%M%SZ", &now);
+		strftime(date, sizeof(date), "%Y%m%d", &now);
+		snprintf(scope, sizeof(scope), "%s/%s/s3/aws4_request", date, upload->region);
+
+		size_t canonical_len = strlen(method) + target_len + strlen(upload->endpoint.authority) + 384;
+		char canonical[canonical_len];
+		snprintf(canonical, canonical_len, "%s\n%s\n%s\nhost:%s\nx-amz-content-sha256:%s\nx-amz-date:%s\n\n"
+			"host;x-amz-content-sha256;x-amz-date\n%s", method, upload->path, query, upload->endpoint.authority,
+			payload_hash, amz_date, payload_hash);
+		if (__sha256_hex(canonical_hash, canonical, strlen(canonical)) == ERR_FAILURE)
+			return ERR_FAILURE;
+
+		char string_to_sign[384];
+		snprintf(string_to_sign, sizeof(string_to_sign), "AWS4-HMAC-SHA256\n%s\n%s\n%s", amz_date, scope, canonical_hash);
+
+		/* Signing key: HMAC chain over the secret, date, region, service and terminator */
+		size_t secret_len = strlen(upload->secret_key) + 5;
+		char secret[secret_len];
+		snprintf(secret, secret_len, "AWS4%s", upload->secret_key);
+		bool ok = __hmac_sha256(key, secret, strlen(secret), date) == 0
+			&& __hmac_sha256(key, key, sizeof(key), upload->region) == 0
+			&& __hmac_sha256(key, key, sizeof(key), "s3") == 0
+			&& __hmac_sha256(key, key, sizeof(key), "aws4_request") == 0
+			&& __hmac_sha256(signature, key, sizeof(key), string_to_sign) == 0;
+		OPENSSL_cleanse(secret, secret_len);
+		OPENSSL_cleanse(key, sizeof(key));
+		if (!ok)
+			return ERR_FAILURE;
+		__hex(signature_hex, signature, sizeof(signature));
+
+		char date_header[32], hash_header[96], auth_header[512];
+		snprintf(date_header, sizeof(date_header), "x-amz-date: %s", amz_date);
+		snprintf(hash_header, sizeof(hash_header), "x-amz-content-sha256: %s", payload_hash);
+		snprintf(auth_header, sizeof(auth_header), "Authorization: AWS4-HMAC-SHA256 Credential=%s/%s, "
+			"SignedHeaders=host;x-amz-content-sha256;x-amz-date, Signature=%s", upload->access_key, scope, signature_hex);
+		const char* headers[] = { date_header, hash_header, auth_header };
+
+		if (_http_request(&upload->endpoint, method, target, headers, 3, body, body_len, response) == ERR_FAILURE) {
+			DEBUG_PRINT(("[DEBUG] S3 %s %s: no response (attempt %i).\n", method, target, attempt + 1));
+			continue;
+		}
+
+		/* Completion can fail after the store has already answered 200 */
+		if (response->status >= 200 && response->status < 300 && strstr((const char*) response->body, "<Error>") == NULL)
+			return 0;
+		DEBUG_PRINT(("[DEBUG] S3 %s %s: status %i (attempt %i).\n", method, target, response->status, attempt + 1));
+
+		bool retry = response->status == 200 || response->status == 429 || response->status >= 500;
+		_http_response_free(response);
+		if (!retry)
+			break;
+	}
+
+	return ERR_FAILURE;
+}
+
+/* Uploads one part and records its ETag */
+static int __s3_upload_part(s3_upload_t* upload, const s3_part_t* part, char* etag) {
+	http_response_t response;
+	char query[strlen(upload->upload_id) + 40];
+
+	snprintf(query, sizeof(query), "partNumber=%d&uploadId=%s", part->number, upload->upload_id);
+	if (__s3_request(upload, "PUT", query, part->data, part->len, &response) == ERR_FAILURE)
+		return ERR_FAILURE;
+
+	int ret = _http_response_header(&response, "ETag", etag, _ETAG_SIZE);
+	_http_response_free(&response);
+	DEBUG_PRINT(("[DEBUG] S3 part %i uploaded (%zu bytes).\n", part->number, part->len));
+
+	return ret;
+}
+
+/* Makes room for the ETag of part 'number' */
+static int __s3_reserve_etag(s3_upload_t* upload, int number) {
+	if (number <= upload->etags_capacity)
+		return 0;
+
+	int capacity = upload->etags_capacity ? 2 * upload->etags_capacity : 64;
+	char (*etags)[_ETAG_SIZE] = realloc(upload->etags, capacity * sizeof(*etags));
+	if (etags == NULL)
+		return ERR_FAILURE;
+	upload->etags = etags;
+	upload->etags_capacity = capacity;
+	return 0;
+}
+
+#ifndef CZ_NO_THREADS
+
+/* Uploader thread: uploads queued parts until there are no more, or one fails */
+static int __s3_uploader_main(void* upload_ptr) {
+	s3_upload_t* upload = (s3_upload_t*) upload_ptr;
+	s3_part_t part;
+	char etag[_ETAG_SIZE];
+
+	_mutex_lock(&upload->lock);
+	while (true) {
+
+		while (upload->pending_count == 0 && !upload->done && !upload->failed)
+			_cond_wait(&upload->work, &upload->lock);
+		if (upload->failed || upload->pending_count == 0)
+			break;
+
+		part = upload->pending[upload->pending_head];
+		upload->pending_head = (upload->pending_head + 1) % _S3_BUFFERS;
+		--upload->pending_count;
+		_mutex_unlock(&upload->lock);
+
+		int ret = __s3_upload_part(upload, &part, etag);
+
+		_mutex_lock(&upload->lock);
+		if (ret == ERR_FAILURE) {
+			upload->failed = true;
+			_cond_broadcast(&upload->work);
+		} else {
+			strcpy(upload->etags[part.number - 1], etag);
+		}
+		upload->free_buffers[upload->num_free++] = part.data;
+		_cond_broadcast(&upload->space);
+	}
+	_mutex_unlock(&upload->lock);
+
+	return 0;
+}
+
+#endif
+
+/* Hands the part being filled out for upload and starts a new one */
+static int __s3_push_part(s3_upload_t* upload) {
+	s3_part_t part = { upload->num_parts + 1, upload->fill, upload->fill_len };
+
+	#ifndef CZ_NO_THREADS
+	_mutex_lock(&upload->lock);
+	if (upload->failed || __s3_reserve_etag(upload, part.number) == ERR_FAILURE) {
+		_mutex_unlock(&upload->lock);
+		return ERR_FAILURE;
+	}
+	upload->pending[(upload->pending_head + upload->pending_count) % _S3_BUFFERS] = part;
+	++upload->pending_count;
+	++upload->num_parts;
+	_cond_signal(&upload->work);
+
+	/* Wait for an uploader to give a buffer back */
+	while (upload->num_free == 0 && !upload->failed)
+		_cond_wait(&upload->space, &upload->lock);
+	if (upload->failed) {
+		_mutex_unlock(&upload->lock);
+		return ERR_FAILURE;
+	}
+	upload->fill = upload->free_buffers[--upload->num_free];
+	_mutex_unlock(&upload->lock);
+
+	#else
+	/* No threads: upload in place */
+	if (upload->failed)
+		return ERR_FAILURE;
+	if (__s3_reserve_etag(upload, part.number) == ERR_FAILURE || __s3_upload_part(upload, &part, upload->etags[part.number - 1]) == ERR_FAILURE) {
+		upload->failed = true;
+		return ERR_FAILURE;
+	}
+	++upload->num_parts;
+	#endif
+
+	upload->fill_len = 0;
+	return 0;
+}
+
+/* fopencookie() write callback: cut the data into parts */
+static ssize_t __s3_cookie_write(void* cookie, const char* buf, size_t size) {
+	s3_upload_t* upload = (s3_upload_t*) cookie;
+	size_t written = 0, len;
+
+	while (written < size) {
+		len = S3_PART_SIZE - upload->fill_len;
+		if (len > size - written)
+			len = size - written;
+		memcpy(&upload->fill[upload->fill_len], &buf[written], len);
+		upload->fill_len += len;
+		written += len;
+
+		if (upload->fill_len == S3_PART_SIZE && __s3_push_part(upload) == ERR_FAILURE)
+			return 0;
+	}
+
+	return size;
+}
+
+static int __s3_cookie_close(void* cookie) {
+	(void) cookie;
+	return 0;
+}
+
+#ifndef CZ_NO_THREADS
+/* Lets the uploaders finish what is queued, or stop right away if the upload failed, and joins them */
+static void __s3_stop(s3_upload_t* upload, bool abort) {
+	_mutex_lock(&upload->lock);
+	upload->done = true;
+	if (abort)
+		upload->failed = true;
+	_cond_broadcast(&upload->work);
+	_cond_broadcast(&upload->space);
+	_mutex_unlock(&upload->lock);
+
+	for (int i=0; i<upload->num_threads; ++i)
+		_thread_join(upload->threads[i], NULL);
+	upload->num_threads = 0;
+}
+#endif
+
+static void __s3_free(s3_upload_t* upload) {
+	#ifndef CZ_NO_THREADS
+	if (upload->synchronized) {
+		_cond_destroy(&upload->space);
+		_cond_destroy(&upload->work);
+		_mutex_destroy(&upload->lock);
+	}
+	#endif
+	for (int i=0; i<_S3_BUFFERS; ++i)
+		free(upload->buffers[i]);
+	if (upload->secret_key != NULL) {
+		OPENSSL_cleanse(upload->secret_key, strlen(upload->secret_key));
+		free(upload->secret_key);
+	}
+	free(upload->access_key);
+	free(upload->region);
+	free(upload->path);
+	free(upload->upload_id);
+	free(upload->etags);
+	free(upload);
+}
+
+/* Starts the multipart upload and keeps its ID */
+static int __s3_create(s3_upload_t* upload) {
+	http_response_t response;
+	const char* start;
+	const char* end;
+
+	if (__s3_request(upload, "POST", "uploads=", NULL, 0, &response) == ERR_FAILURE)
+		return ERR_FAILURE;
+
+	if ( (start = strstr((const char*) response.body, "<UploadId>")) == NULL
+		|| (end = strstr(start, "</UploadId>")) == NULL ) {
+		_http_response_free(&response);
+		return ERR_FAILURE;
+	}
+	start += strlen("<UploadId>");
+
+	char upload_id[end - start + 1];
+	memcpy(upload_id, start, end - start);
+	upload_id[end - start] = '\0';
+	_http_response_free(&response);
+
+	if ( (upload->upload_id = __uri_encode(upload_id, false)) == NULL )
+		return ERR_FAILURE;
+	DEBUG_PRINT(("[DEBUG] S3 multipart upload %s started.\n", upload_id));
+
+	return 0;
+}
+
+s3_upload_t* _s3_upload_open(const CzarrapoS3Target* target) {
+	s3_upload_t* upload;
+	cookie_io_functions_t cookie_functions = { NULL, __s3_cookie_write, NULL, __s3_cookie_close };
+
+	if ( (upload = calloc(1, sizeof(s3_upload_t))) == NULL )
+		return NULL;
+
+	if (_http_parse_url(&upload->endpoint, target->endpoint) == ERR_FAILURE
+		|| (upload->region = strdup(target->region)) == NULL
+		|| (upload->access_key = strdup(target->access_key)) == NULL
+		|| (upload->secret_key = strdup(target->secret_key)) == NULL) {
+		__s3_free(upload);
+		return NULL;
+	}
+
+	/* Path-style addressing: /<bucket>/<key> */
+	char* bucket = __uri_encode(target->bucket, false);
+	char* key = __uri_encode(target->key, true);
+	if (bucket != NULL && key != NULL && (upload->path = malloc(strlen(bucket) + strlen(key) + 3)) != NULL)
+		sprintf(upload->path, "/%s/%s", bucket, key);
+	free(bucket);
+	free(key);
+	if (upload->path == NULL) {
+		__s3_free(upload);
+		return NULL;
+	}
+
+	for (int i=0; i<_S3_BUFFERS; ++i) {
+		if ( (upload->buffers[i] = malloc(S3_PART_SIZE)) == NULL ) {
+			__s3_free(upload);
+			return NULL;
+		}
+	}
+	upload->fill = upload->buffers[0];
+
+	if (__s3_create(upload) == ERR_FAILURE) {
+		__s3_free(upload);
+		return NULL;
+	}
+
+	#ifndef CZ_NO_THREADS
+	for (int i=1; i<_S3_BUFFERS; ++i)
+		upload->free_buffers[upload->num_free++] = upload->buffers[i];
+
+	if (_mutex_init(&upload->lock) == ERR_FAILURE) {
+		_s3_upload_abort(upload);
+		return NULL;
+	}
+	if (_cond_init(&upload->work) == ERR_FAILURE) {
+		_mutex_destroy(&upload->lock);
+		_s3_upload_abort(upload);
+		return NULL;
+	}
+	if (_cond_init(&upload->space) == ERR_FAILURE) {
+		_cond_destroy(&upload->work);
+		_mutex_destroy(&upload->lock);
+		_s3_upload_abort(upload);
+		return NULL;
+	}
+	upload->synchronized = true;
+	#endif
+
+	if ( (upload->stream = fopencookie(upload, "wb", cookie_functions)) == NULL ) {
+		_s3_upload_abort(upload);
+		return NULL;
+	}
+	setvbuf(upload->stream, NULL, _IOFBF, 64 * 1024);
+
+	#ifndef CZ_NO_THREADS
+	for (int i=0; i<S3_MAX_UPLOADS; ++i) {
+		if (_thread_create(&upload->threads[i], __s3_uploader_main, upload) == ERR_FAILURE) {
+			_s3_upload_abort(upload);
+			return NULL;
+		}
+		++upload->num_threads;
+	}
+	#endif
+
+	return upload;
+}
+
+FILE* _s3_upload_stream(s3_upload_t* upload) {
+	return upload->stream;
+}
+
+int _s3_upload_complete(s3_upload_t* upload) {
+	http_response_t response;
+	bool failed = false;
+
+	/* Flush buffered data; the last part may be shorter than S3_PART_SIZE, and there is always at least one */
+	if (fclose(upload->stream) != 0)
+		failed = true;
+	upload->stream = NULL;
+	if (!failed && (upload->fill_len > 0 || upload->num_parts == 0) && __s3_push_part(upload) == ERR_FAILURE)
+		failed = true;
+
+	#ifndef CZ_NO_THREADS
+	__s3_stop(upload, failed);
+	#endif
+	if (failed || upload->failed) {
+		_s3_upload_abort(upload);
+		return ERR_FAILURE;
+	}
+
+	/* Part list, in order */
+	size_t xml_len = 64 + (size_t) upload->num_parts * (_ETAG_SIZE + 64);
+	char* xml = malloc(xml_len);
+	if (xml == NULL) {
+		_s3_upload_abort(upload);
+		return ERR_FAILURE;
+	}
+	size_t pos = sprintf(xml, "<CompleteMultipartUpload>");
+	for (int i=0; i<upload->num_parts; ++i)
+		pos += sprintf(&xml[pos], "<Part><PartNumber>%d</PartNumber><ETag>%s</ETag></Part>", i + 1, upload->etags[i]);
+	pos += sprintf(&xml[pos], "</CompleteMultipartUpload>");
+
+	char query[strlen(upload->upload_id) + 16];
+	snprintf(query, sizeof(query), "uploadId=%s", upload->upload_id);
+	int ret = __s3_request(upload, "POST", query, (const unsigned char*) xml, pos, &response);
+	free(xml);
+	if (ret == ERR_FAILURE) {
+		_s3_upload_abort(upload);
+		return ERR_FAILURE;
+	}
+	_http_response_free(&response);
+	DEBUG_PRINT(("[DEBUG] S3 multipart upload completed (%i parts).\n", upload->num_parts));
+
+	__s3_free(upload);
+	return 0;
+}
+
+void _s3_upload_abort(s3_upload_t* upload) {
+	http_response_t response;
+
+	if (upload == NULL)
+		return;
+
+	#ifndef CZ_NO_THREADS
+	if (upload->synchronized)
+		__s3_stop(upload, true);
+	#endif
+
+	/* Nothing buffered gets uploaded any more */
+	upload->failed = true;
+	if (upload->stream != NULL) {
+		fclose(upload->stream);
+		upload->stream = NULL;
+	}
+
+	/* Best effort: a store that misses this keeps the parts until its lifecycle rules clean them up */
+	char query[strlen(upload->upload_id) + 16];
+	snprintf(query, sizeof(query), "uploadId=%s", upload->upload_id);
+	if (__s3_request(upload, "DELETE", query, NULL, 0, &response) == 0)
+		_http_response_free(&response);
+
+	__s3_free(upload);
+}
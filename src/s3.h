@@ -0,0 +1,60 @@
+#ifndef _CZS3_H
+#define _CZS3_H
+
+/* Standard library */
+#include <stdio.h>
+
+/* Size of each uploaded part but the last one. S3 requires at least 5 MiB. */
+#ifndef S3_PART_SIZE
+	#define S3_PART_SIZE	(8 * 1024 * 1024)
+#endif
+
+/* Parts uploaded concurrently; at most S3_MAX_UPLOADS + 1 parts are held in memory */
+#ifndef S3_MAX_UPLOADS
+	#define S3_MAX_UPLOADS	4
+#endif
+
+/* Attempts for each request before the upload is given up */
+#ifndef S3_RETRIES
+	#define S3_RETRIES	3
+#endif
+
+/*
+ * Object to upload to an S3-compatible store. Requests are signed with AWS Signature Version 4 and use path-style
+ * addressing ("<endpoint>/<bucket>/<key>"), which AWS and self-hosted stores such as MinIO all accept.
+ */
+typedef struct {
+	const char* endpoint;		/* "https://s3.<region>.amazonaws.com", "http://127.0.0.1:9000"... */
+	const char* region;		/* "us-east-1" for most self-hosted stores */
+	const char* bucket;
+	const char* key;		/* Object name */
+	const char* access_key;
+	const char* secret_key;
+} CzarrapoS3Target;
+
+/*
+ * Multipart upload in progress. Data written to its stream is cut into S3_PART_SIZE parts, which are uploaded by
+ * S3_MAX_UPLOADS threads while more data is produced. The object only becomes visible once the upload is completed.
+ */
+typedef struct s3_upload s3_upload_t;
+
+/*
+ * Starts a multipart upload to 'target'.
+ * RETURNS: a pointer to the upload, NULL on failure.
+ */
+s3_upload_t* _s3_upload_open(const CzarrapoS3Target* target);
+
+/* Stream to write object data to */
+FILE* _s3_upload_stream(s3_upload_t* upload);
+
+/*
+ * Uploads the remaining data, waits for every part and completes the upload, so the object appears atomically. If any
+ * part failed the upload is aborted instead. Frees 'upload' in all cases.
+ * RETURNS: zero on success, negative value on error.
+ */
+int _s3_upload_complete(s3_upload_t* upload);
+
+/* Stops the uploaders and aborts the upload, so the store drops every part already sent. Frees 'upload'. */
+void _s3_upload_abort(s3_upload_t* upload);
+
+#endif
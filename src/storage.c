@@ -0,0 +1,172 @@
+/* statfs() and major()/minor() are Linux extensions */
+#define _GNU_SOURCE
+
+/* Standard library */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+	#include <sys/statfs.h>
+	#include <sys/sysmacros.h>
+#endif
+
+/* Internal modules */
+#include "common.h"
+#include "decrypt.h"
+#include "storage.h"
+
+#ifdef __linux__
+
+/* Filesystem magic numbers (see statfs(2)), for filesystems whose type gives the storage class away */
+static const struct {
+	unsigned long magic;
+	CzarrapoStorageClass storage;
+} _filesystems[] = {
+	{ 0x6969, CZ_STORAGE_NETWORK },			/* NFS */
+	{ 0x517b, CZ_STORAGE_NETWORK },			/* SMB */
+	{ 0xff534d42, CZ_STORAGE_NETWORK },		/* CIFS */
+	{ 0xfe534d42, CZ_STORAGE_NETWORK },		/* SMB2 */
+	{ 0x00c36400, CZ_STORAGE_NETWORK },		/* Ceph */
+	{ 0x01021997, CZ_STORAGE_NETWORK },		/* 9P */
+	{ 0x5346414f, CZ_STORAGE_NETWORK },		/* AFS */
+	{ 0x0bd00bd0, CZ_STORAGE_NETWORK },		/* Lustre */
+	{ 0x65735546, CZ_STORAGE_NETWORK },		/* FUSE: sshfs, s3fs... assumed remote */
+	{ 0x01021994, CZ_STORAGE_MEMORY },		/* tmpfs */
+	{ 0x858458f6, CZ_STORAGE_MEMORY },		/* ramfs */
+};
+
+/* Reads an integer from a sysfs file. RETURNS: the value, negative value on error. */
+static long long int __sysfs_read(const char* path) {
+	FILE* fp;
+	long long int value;
+
+	if ( (fp = fopen(path, "r")) == NULL )
+		return ERR_FAILURE;
+	if (fscanf(fp, "%lld", &value) != 1)
+		value = ERR_FAILURE;
+	fclose(fp);
+	return value;
+}
+
+/*
+ * Reads a queue attribute of block device 'dev'. Partitions have no queue of their own: their disk's is one level up
+ * in sysfs.
+ */
+static long long int __queue_attribute(dev_t dev, const char* attribute) {
+	char path[128];
+	long long int value;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/%s", major(dev), minor(dev), attribute);
+	if ( (value = __sysfs_read(path)) >= 0 )
+		return value;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/%s", major(dev), minor(dev), attribute);
+	return __sysfs_read(path);
+}
+
+/* Detects the storage class of an existing path. RETURNS: zero on success, negative value on error. */
+static int __detect(const char* path, CzarrapoIoPolicy* policy) {
+	struct statfs fs;
+	struct stat st;
+	long long int rotational, depth;
+
+	if (statfs(path, &fs) != 0 || stat(path, &st) != 0)
+		return ERR_FAILURE;
+
+	for (size_t i=0; i<sizeof(_filesystems) / sizeof(_filesystems[0]); ++i) {
+		if ((unsigned long) fs.f_type == _filesystems[i].magic) {
+			policy->storage = _filesystems[i].storage;
+			return 0;
+		}
+	}
+
+	/* Local filesystem: ask its block device, if it has one (btrfs and overlays use anonymous devices) */
+	if ( (rotational = __queue_attribute(st.st_dev, "rotational")) < 0 )
+		return ERR_FAILURE;
+	policy->storage = rotational ? CZ_STORAGE_HDD : CZ_STORAGE_SSD;
+	if ( (depth = __queue_attribute(st.st_dev, "nr_requests")) > 0 )
+		policy->queue_depth = (depth > INT_MAX) ? INT_MAX : (int) depth;
+	return 0;
+}
+
+#endif
+
+void _storage_default(CzarrapoIoPolicy* policy) {
+	policy->storage = CZ_STORAGE_UNKNOWN;
+	policy->queue_depth = -1;
+	policy->io_size = IO_SIZE_FLASH;
+	policy->select = CZ_SELECT_RANDOM;
+	policy->parallelism = INT_MAX;
+	policy->memory_budget = SLOW_MODE_MEMORY_BUDGET;
+}
+
+const char* _storage_name(CzarrapoStorageClass storage) {
+	switch (storage) {
+		case CZ_STORAGE_SSD:		return "ssd";
+		case CZ_STORAGE_HDD:		return "hdd";
+		case CZ_STORAGE_NETWORK:	return "network";
+		case CZ_STORAGE_MEMORY:		return "memory";
+		default:			return "unknown";
+	}
+}
+
+int czarrapo_storage_policy(const char* path, CzarrapoIoPolicy* policy) {
+	int ret = ERR_FAILURE;
+
+	_storage_default(policy);
+
+	#ifdef __linux__
+	/* Files that do not exist yet will live in their directory */
+	if ( (ret = __detect(path, policy)) == ERR_FAILURE ) {
+		const char* slash = strrchr(path, '/');
+		char dir[slash != NULL ? slash - path + 2 : 2];
+
+		if (slash == NULL)
+			strcpy(dir, ".");
+		else {
+			memcpy(dir, path, slash - path + 1);
+			dir[slash - path + 1] = '\0';
+		}
+		ret = __detect(dir, policy);
+	}
+	#else
+	(void) path;
+	#endif
+
+	switch (policy->storage) {
+
+		/* Seeks cost milliseconds: large sequential requests, one file at a time, never read twice */
+		case CZ_STORAGE_HDD:
+			policy->io_size = IO_SIZE_DISK;
+			policy->select = CZ_SELECT_PRELOAD;
+			policy->parallelism = 1;
+			policy->memory_budget = 4 * SLOW_MODE_MEMORY_BUDGET;
+			break;
+
+		/* Every request is a round trip: same as disks, with a few files in flight to hide latency */
+		case CZ_STORAGE_NETWORK:
+			policy->io_size = IO_SIZE_DISK;
+			policy->select = CZ_SELECT_PRELOAD;
+			policy->parallelism = IO_NETWORK_STREAMS;
+			policy->memory_budget = 4 * SLOW_MODE_MEMORY_BUDGET;
+			break;
+
+		/* Parallel random reads are what flash is good at, up to its queue size */
+		case CZ_STORAGE_SSD:
+			if (policy->queue_depth > 0)
+				policy->parallelism = policy->queue_depth;
+			break;
+
+		/* Reading the file again is only a copy: slow mode search does not keep its own */
+		case CZ_STORAGE_MEMORY:
+			policy->memory_budget = 0;
+			break;
+
+		default:
+			break;
+	}
+
+	return ret;
+}
@@ -0,0 +1,73 @@
+#ifndef _CZSTORAGE_H
+#define _CZSTORAGE_H
+
+/* Standard library */
+#include <stdbool.h>
+
+/* Buffer size for files on flash, in memory or on unknown storage */
+#ifndef IO_SIZE_FLASH
+	#define IO_SIZE_FLASH		(128 * 1024)
+#endif
+
+/* Buffer size for files on spinning disks and network filesystems, where each request is expensive */
+#ifndef IO_SIZE_DISK
+	#define IO_SIZE_DISK		(1024 * 1024)
+#endif
+
+/* Files read or written at once on a network filesystem */
+#ifndef IO_NETWORK_STREAMS
+	#define IO_NETWORK_STREAMS	4
+#endif
+
+/* On spinning disks and network filesystems, files up to this size are read whole to pick the RSA block */
+#ifndef SELECT_PRELOAD_LIMIT
+	#define SELECT_PRELOAD_LIMIT	(16LL * 1024 * 1024)
+#endif
+
+/* Kind of storage behind a file */
+typedef enum {
+	CZ_STORAGE_UNKNOWN = 0,
+	CZ_STORAGE_SSD,			/* Non-rotational block device */
+	CZ_STORAGE_HDD,			/* Rotational block device */
+	CZ_STORAGE_NETWORK,		/* NFS, SMB, FUSE and other remote filesystems */
+	CZ_STORAGE_MEMORY		/* tmpfs, ramfs */
+} CzarrapoStorageClass;
+
+/* How encryption reads the candidate blocks when picking the RSA block */
+typedef enum {
+	CZ_SELECT_RANDOM = 0,		/* One seek and read per candidate */
+	CZ_SELECT_PRELOAD		/* One sequential read of the whole file, candidates checked in memory */
+} CzarrapoSelectStrategy;
+
+/* Which file of an operation a policy applies to */
+typedef enum {
+	CZ_IO_INPUT = 0,
+	CZ_IO_OUTPUT,
+	CZ_IO_SIDES
+} CzarrapoIoSide;
+
+/* I/O decisions taken for one file, from the storage it lives on */
+typedef struct {
+	CzarrapoStorageClass storage;
+	int queue_depth;			/* Requests the device queue holds, -1 if unknown */
+	int io_size;				/* Buffer size for reads and writes */
+	CzarrapoSelectStrategy select;		/* How candidate blocks are read (inputs to encryption) */
+	int parallelism;			/* Files read or written at once by the watch-folder service */
+	long long int memory_budget;		/* Slow mode search keeps bodies up to this size in memory (inputs) */
+} CzarrapoIoPolicy;
+
+/*
+ * Detects the storage behind 'path' (or behind its directory, if it does not exist yet) and fills 'policy' with the I/O
+ * decisions for it. Detection uses the filesystem type and, for block devices, their rotational flag and queue size in
+ * sysfs (Linux only). Undetected storage gets the same policy as flash.
+ * RETURNS: zero if the storage was detected, negative value otherwise ('policy' is filled in both cases).
+ */
+int czarrapo_storage_policy(const char* path, CzarrapoIoPolicy* policy);
+
+/* Fills 'policy' with the decisions for unknown storage */
+void _storage_default(CzarrapoIoPolicy* policy);
+
+/* Human-readable name of a storage class */
+const char* _storage_name(CzarrapoStorageClass storage);
+
+#endif
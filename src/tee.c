@@ -0,0 +1,339 @@
+/* fopencookie() is a GNU extension */
+#define _GNU_SOURCE
+
+/* Standard library */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* Internal modules */
+#include "common.h"
+#include "output.h"
+#include "tee.h"
+#include "threading.h"
+
+/* One destination and its writer thread */
+typedef struct {
+	tee_t* tee;
+	output_file_t* output;
+	#ifndef CZ_NO_THREADS
+	czthread_t thread;
+	bool started;
+	#endif
+	long long int consumed;		/* Chunks written so far */
+	bool failed;
+} tee_writer_t;
+
+struct tee {
+	tee_writer_t* writers;
+	int num_writers;
+	FILE* stream;			/* What the caller writes to */
+	bool direct;			/* Single destination: 'stream' is the output file's own stream */
+
+	#ifndef CZ_NO_THREADS
+	unsigned char* ring;		/* TEE_MAX_LAG chunks of TEE_CHUNK_SIZE bytes, shared by all writers */
+	size_t ring_len[TEE_MAX_LAG];
+	long long int produced;		/* Chunks pushed so far */
+	bool done;			/* No more chunks will be pushed */
+	bool aborted;			/* Writers must stop right away */
+	bool synchronized;		/* lock, data and space are initialized */
+	czmutex_t lock;
+	czcond_t data;			/* Signalled when a chunk is pushed */
+	czcond_t space;			/* Signalled when a writer frees up a chunk */
+	#endif
+};
+
+#ifndef CZ_NO_THREADS
+
+/* Chunks the slowest live writer still has to write. Called with the lock held. */
+static long long int __tee_lag(const tee_t* tee) {
+	long long int lag = 0;
+
+	for (int i=0; i<tee->num_writers; ++i) {
+		if (!tee->writers[i].failed && tee->produced - tee->writers[i].consumed > lag)
+			lag = tee->produced - tee->writers[i].consumed;
+	}
+	return lag;
+}
+
+/* Writer thread: writes every chunk, in order, to its own destination */
+static int __tee_writer_main(void* writer_ptr) {
+	tee_writer_t* writer = (tee_writer_t*) writer_ptr;
+	tee_t* tee = writer->tee;
+	FILE* fp = _output_stream(writer->output);
+	int slot;
+
+	_mutex_lock(&tee->lock);
+	while (true) {
+
+		while (writer->consumed == tee->produced && !tee->done && !tee->aborted)
+			_cond_wait(&tee->data, &tee->lock);
+		if (tee->aborted || writer->consumed == tee->produced)
+			break;
+
+		/* The producer does not touch this slot until every writer is past it */
+		slot = writer->consumed % TEE_MAX_LAG;
+		_mutex_unlock(&tee->lock);
+		bool ok = fwrite(&tee->ring[slot * TEE_CHUNK_SIZE], sizeof(unsigned char), tee->ring_len[slot], fp) == tee->ring_len[slot];
+		_mutex_lock(&tee->lock);
+
+		/* A failed destination no longer holds the others back */
+		if (!ok) {
+			writer->failed = true;
+			_cond_signal(&tee->space);
+			break;
+		}
+
+		++writer->consumed;
+		_cond_signal(&tee->space);
+	}
+	_mutex_unlock(&tee->lock);
+
+	return 0;
+}
+
+/* Buffers one chunk for all writers, waiting if the slowest one is TEE_MAX_LAG chunks behind */
+static int __tee_push(tee_t* tee, const char* buf, size_t len) {
+	int slot;
+
+	_mutex_lock(&tee->lock);
+	while (__tee_lag(tee) >= TEE_MAX_LAG && !tee->aborted)
+		_cond_wait(&tee->space, &tee->lock);
+	if (tee->aborted) {
+		_mutex_unlock(&tee->lock);
+		return ERR_FAILURE;
+	}
+	slot = tee->produced % TEE_MAX_LAG;
+	_mutex_unlock(&tee->lock);
+
+	/* Every live writer is past this slot, so it can be filled without the lock */
+	memcpy(&tee->ring[slot * TEE_CHUNK_SIZE], buf, len);
+	tee->ring_len[slot] = len;
+
+	_mutex_lock(&tee->lock);
+	++tee->produced;
+	_cond_broadcast(&tee->data);
+	_mutex_unlock(&tee->lock);
+
+	return 0;
+}
+
+/* Stops the writer threads: after draining every chunk, or right away if 'abort' is set */
+static void __tee_stop(tee_t* tee, bool abort) {
+	_mutex_lock(&tee->lock);
+	tee->done = true;
+	tee->aborted = abort;
+	_cond_broadcast(&tee->data);
+	_cond_broadcast(&tee->space);
+	_mutex_unlock(&tee->lock);
+
+	for (int i=0; i<tee->num_writers; ++i) {
+		if (tee->writers[i].started)
+			_thread_join(tee->writers[i].thread, NULL);
+		tee->writers[i].started = false;
+	}
+}
+
+#endif
+
+/* fopencookie() write callback: fan the data out to every destination */
+static ssize_t __tee_cookie_write(void* cookie, const char* buf, size_t size) {
+	tee_t* tee = (tee_t*) cookie;
+	size_t written = 0, len;
+
+	while (written < size) {
+		len = (size - written < TEE_CHUNK_SIZE) ? size - written : TEE_CHUNK_SIZE;
+
+		#ifndef CZ_NO_THREADS
+		if (__tee_push(tee, &buf[written], len) == ERR_FAILURE)
+			return 0;
+		#else
+		/* No threads: write to each destination in turn */
+		for (int i=0; i<tee->num_writers; ++i) {
+			if (!tee->writers[i].failed && fwrite(&buf[written], sizeof(unsigned char), len, _output_stream(tee->writers[i].output)) != len)
+				tee->writers[i].failed = true;
+		}
+		#endif
+
+		written += len;
+	}
+
+	return size;
+}
+
+static int __tee_cookie_close(void* cookie) {
+	(void) cookie;
+	return 0;
+}
+
+/* Frees the tee struct itself; the destinations must have been published or discarded already */
+static void __tee_free(tee_t* tee) {
+	#ifndef CZ_NO_THREADS
+	if (tee->synchronized) {
+		_cond_destroy(&tee->space);
+		_cond_destroy(&tee->data);
+		_mutex_destroy(&tee->lock);
+	}
+	free(tee->ring);
+	#endif
+	free(tee->writers);
+	free(tee);
+}
+
+tee_t* _tee_open(const char* const* paths, int num_paths, int io_size) {
+	tee_t* tee;
+	cookie_io_functions_t cookie_functions = { NULL, __tee_cookie_write, NULL, __tee_cookie_close };
+
+	if (num_paths < 1)
+		return NULL;
+
+	if ( (tee = calloc(1, sizeof(tee_t))) == NULL )
+		return NULL;
+	if ( (tee->writers = calloc(num_paths, sizeof(tee_writer_t))) == NULL ) {
+		free(tee);
+		return NULL;
+	}
+
+	/* Open every destination */
+	for (int i=0; i<num_paths; ++i) {
+		tee->writers[i].tee = tee;
+		if ( (tee->writers[i].output = _output_open(paths[i], io_size)) == NULL ) {
+			for (int j=0; j<i; ++j)
+				_output_discard(tee->writers[j].output);
+			free(tee->writers);
+			free(tee);
+			return NULL;
+		}
+		++tee->num_writers;
+	}
+
+	/* A single destination needs no fan-out */
+	if (num_paths == 1) {
+		tee->direct = true;
+		tee->stream = _output_stream(tee->writers[0].output);
+		return tee;
+	}
+
+	#ifndef CZ_NO_THREADS
+	if ( (tee->ring = malloc((size_t) TEE_MAX_LAG * TEE_CHUNK_SIZE)) == NULL ) {
+		_tee_discard(tee);
+		return NULL;
+	}
+	if (_mutex_init(&tee->lock) == ERR_FAILURE) {
+		_tee_discard(tee);
+		return NULL;
+	}
+	if (_cond_init(&tee->data) == ERR_FAILURE) {
+		_mutex_destroy(&tee->lock);
+		_tee_discard(tee);
+		return NULL;
+	}
+	if (_cond_init(&tee->space) == ERR_FAILURE) {
+		_cond_destroy(&tee->data);
+		_mutex_destroy(&tee->lock);
+		_tee_discard(tee);
+		return NULL;
+	}
+	tee->synchronized = true;
+	#endif
+
+	if ( (tee->stream = fopencookie(tee, "wb", cookie_functions)) == NULL ) {
+		_tee_discard(tee);
+		return NULL;
+	}
+	setvbuf(tee->stream, NULL, _IOFBF, TEE_CHUNK_SIZE);
+
+	#ifndef CZ_NO_THREADS
+	for (int i=0; i<tee->num_writers; ++i) {
+		if (_thread_create(&tee->writers[i].thread, __tee_writer_main, &tee->writers[i]) == ERR_FAILURE) {
+			_tee_discard(tee);
+			return NULL;
+		}
+		tee->writers[i].started = true;
+	}
+	#endif
+
+	return tee;
+}
+
+FILE* _tee_stream(tee_t* tee) {
+	return tee->stream;
+}
+
+int _tee_publish(tee_t* tee, CzarrapoDurability durability, sync_batch_t** batch) {
+	bool failed = false;
+	int ret = 0;
+
+	if (tee->direct) {
+		ret = _output_publish(tee->writers[0].output, durability, batch);
+		__tee_free(tee);
+		return ret;
+	}
+
+	/* Flush what is still buffered into the ring, then let every writer drain it */
+	if (fclose(tee->stream) != 0)
+		failed = true;
+	tee->stream = NULL;
+	#ifndef CZ_NO_THREADS
+	__tee_stop(tee, false);
+	#endif
+
+	for (int i=0; i<tee->num_writers; ++i) {
+		if (tee->writers[i].failed)
+			failed = true;
+	}
+
+	/* All or nothing: sync every destination before any is published */
+	for (int i=0; i<tee->num_writers && !failed; ++i) {
+		if (_output_prepare(tee->writers[i].output, durability) == ERR_FAILURE)
+			failed = true;
+	}
+
+	/* Then link them, putting back what the linked ones replaced if one fails */
+	for (int i=0; i<tee->num_writers && !failed; ++i) {
+		if (_output_link(tee->writers[i].output, true) == ERR_FAILURE) {
+			for (int j=0; j<i; ++j) {
+				_output_unlink(tee->writers[j].output);
+				tee->writers[j].output = NULL;
+			}
+			failed = true;
+		}
+	}
+	if (failed) {
+		for (int i=0; i<tee->num_writers; ++i) {
+			_output_discard(tee->writers[i].output);
+			tee->writers[i].output = NULL;
+		}
+		__tee_free(tee);
+		return ERR_FAILURE;
+	}
+
+	/* Every destination is in place: only durability of the directory entries can still fail */
+	for (int i=0; i<tee->num_writers; ++i) {
+		if (_output_finish(tee->writers[i].output, durability, batch) == ERR_FAILURE)
+			ret = ERR_FAILURE;
+		tee->writers[i].output = NULL;
+	}
+
+	__tee_free(tee);
+	return ret;
+}
+
+void _tee_discard(tee_t* tee) {
+	if (tee == NULL)
+		return;
+
+	#ifndef CZ_NO_THREADS
+	if (tee->synchronized)
+		__tee_stop(tee, true);
+	#endif
+	if (!tee->direct && tee->stream != NULL)
+		fclose(tee->stream);
+
+	for (int i=0; i<tee->num_writers; ++i)
+		_output_discard(tee->writers[i].output);
+
+	__tee_free(tee);
+}
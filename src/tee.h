@@ -0,0 +1,48 @@
+#ifndef _CZTEE_H
+#define _CZTEE_H
+
+/* Standard library */
+#include <stdio.h>
+
+/* Internal modules */
+#include "output.h"
+
+/* Size of each buffered ciphertext chunk handed to the destination writers */
+#ifndef TEE_CHUNK_SIZE
+	#define TEE_CHUNK_SIZE	(64 * 1024)
+#endif
+
+/* How many chunks the slowest destination may fall behind before the encryption pass waits for it */
+#ifndef TEE_MAX_LAG
+	#define TEE_MAX_LAG	64
+#endif
+
+/*
+ * Set of output files receiving the same data. Data written to the tee stream is buffered once and written to each
+ * destination by its own writer thread, so a slow destination only holds the others back once it is TEE_MAX_LAG
+ * chunks behind. With a single destination the output file's own stream is used directly.
+ */
+typedef struct tee tee_t;
+
+/*
+ * Opens 'num_paths' output files (see _output_open()), buffered by 'io_size' bytes, and starts their writers.
+ * RETURNS: a pointer to the tee, NULL on failure.
+ */
+tee_t* _tee_open(const char* const* paths, int num_paths, int io_size);
+
+/* Stream to write output data to */
+FILE* _tee_stream(tee_t* tee);
+
+/*
+ * Waits for every destination to catch up, then publishes all of them: every file is prepared first, then each is
+ * linked, and if a link fails the ones already linked are undone (see _output_link()). If any destination failed, none
+ * is published. Frees 'tee' in all cases. An error syncing directory entries once every file is in place is reported,
+ * but the files stay.
+ * RETURNS: zero on success, negative value on error.
+ */
+int _tee_publish(tee_t* tee, CzarrapoDurability durability, sync_batch_t** batch);
+
+/* Stops the writers and throws away every destination. Frees 'tee'. */
+void _tee_discard(tee_t* tee);
+
+#endif
@@ -1,10 +1,10 @@
 #include <stdlib.h>
 #include <string.h>
 
-#ifndef __STDC_NO_THREADS__
-
 #include "thread.h"
 
+#ifndef CZ_NO_THREADS
+
 thread_data_t* __thread_data_init(int block_size, long long int index) {
 	thread_data_t* thread_data = malloc(sizeof(thread_data_t));
 
@@ -15,12 +15,24 @@ thread_data_t* __thread_data_init(int block_size, long long int index) {
 	}
 
 	thread_data->index = index;
+	thread_data->owned = true;
+
+	return thread_data;
+}
+
+thread_data_t* __thread_data_init_view(const unsigned char* block, int size, long long int index) {
+	thread_data_t* thread_data = malloc(sizeof(thread_data_t));
+
+	thread_data->block = (unsigned char*) block;
+	thread_data->size = size;
+	thread_data->index = index;
+	thread_data->owned = false;
 
 	return thread_data;
 }
 
 void __thread_data_free(thread_data_t* thread_data) {
-	if (thread_data->block != NULL) {
+	if (thread_data->owned && thread_data->block != NULL) {
 		free(thread_data->block);
 	}
 	free(thread_data);
@@ -36,6 +48,8 @@ thread_context_t* __thread_context_init(unsigned char* output, long long int* ou
 	thread_context->output_index = output_index;
 	thread_context->queue = queue;
 	thread_context->header = header;
+	thread_context->blinding = NULL;
+	thread_context->rsa_ops = NULL;
 
 	/* Init a new context with no RSA keys */
 	if ( (thread_context->ctx = czarrapo_init(NULL, NULL, NULL, ctx->password, ctx->fast)) == NULL ) {
@@ -58,11 +72,15 @@ void __thread_context_free(thread_context_t* thread_context) {
 	free(thread_context);
 }
 
-reader_data_t* __reader_data_init(const char* input_file, int block_size, tlock_queue_t* queue, const CzarrapoHeader* header) {
+reader_data_t* __reader_data_init(const char* input_file, const unsigned char* ciphertext, long long int ciphertext_size, const unsigned char* modulus, int block_size, int io_size, tlock_queue_t* queue, const CzarrapoHeader* header) {
 	reader_data_t* reader_data = malloc(sizeof(reader_data_t));
 
 	reader_data->input_file = input_file;
+	reader_data->ciphertext = ciphertext;
+	reader_data->ciphertext_size = ciphertext_size;
+	reader_data->modulus = modulus;
 	reader_data->block_size = block_size;
+	reader_data->io_size = io_size;
 	reader_data->queue = queue;
 	reader_data->header = header;
 
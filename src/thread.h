@@ -3,11 +3,11 @@
 
 /* Standard library */
 #include <stdbool.h>
-#include <threads.h>
 
 /* Internal modules */
 #include "common.h"
 #include "context.h"
+#include "threading.h"
 #include <tlock-queue/src/tlock_queue.h>
 
 /* Struct and functions for the actual data passed to the queue */
@@ -15,8 +15,10 @@ typedef struct {
 	unsigned char* block;
 	long long int index;
 	int size;
+	bool owned;		/* false if 'block' points into a buffer owned by someone else */
 } thread_data_t;
 thread_data_t* __thread_data_init(int block_size, long long int index);
+thread_data_t* __thread_data_init_view(const unsigned char* block, int size, long long int index);
 void __thread_data_free(thread_data_t* thread_data);
 
 /* Struct and functions for the inital data passed to each processing thread */
@@ -26,6 +28,8 @@ typedef struct {
 	tlock_queue_t* queue;
 	const CzarrapoHeader* header;
 	CzarrapoContext* ctx;
+	blinding_pool_t* blinding;	/* Not owned: outlives the thread so the refiller can keep serving it */
+	long long int* rsa_ops;		/* RSA operations done by the thread, counted here; NULL to not count them */
 } thread_context_t;
 thread_context_t* __thread_context_init(unsigned char* output, long long int* output_index, tlock_queue_t* queue, const CzarrapoContext* ctx, const CzarrapoHeader* header);
 void __thread_context_free(thread_context_t* thread_context);
@@ -33,11 +37,15 @@ void __thread_context_free(thread_context_t* thread_context);
 /* Struct and functions for the inital data passed to the file read thread */
 typedef struct {
 	const char* input_file;
+	const unsigned char* ciphertext;	/* File body already in memory, or NULL to read from input_file */
+	long long int ciphertext_size;
+	const unsigned char* modulus;		/* Key modulus (block_size bytes, big-endian) to pre-filter blocks */
 	tlock_queue_t* queue;
 	const CzarrapoHeader* header;
 	int block_size;
+	int io_size;				/* Buffer size for the file stream */
 } reader_data_t;
-reader_data_t* __reader_data_init(const char* input_file, int block_size, tlock_queue_t* queue, const CzarrapoHeader* header);
+reader_data_t* __reader_data_init(const char* input_file, const unsigned char* ciphertext, long long int ciphertext_size, const unsigned char* modulus, int block_size, int io_size, tlock_queue_t* queue, const CzarrapoHeader* header);
 void __reader_data_free(reader_data_t* reader_data);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,160 @@
+/* Standard library */
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Internal modules */
+#include "common.h"
+#include "threading.h"
+
+#if defined(CZ_THREADS_C11)
+
+/* C11 backend */
+
+int _thread_create(czthread_t* thread, czthread_start_t func, void* arg) {
+	return (thrd_create(thread, func, arg) == thrd_success) ? 0 : ERR_FAILURE;
+}
+
+int _thread_join(czthread_t thread, int* res) {
+	return (thrd_join(thread, res) == thrd_success) ? 0 : ERR_FAILURE;
+}
+
+_Noreturn void _thread_exit(int res) {
+	thrd_exit(res);
+}
+
+void _thread_yield(void) {
+	thrd_yield();
+}
+
+unsigned long _thread_id(void) {
+	return (unsigned long) thrd_current();
+}
+
+int _mutex_init(czmutex_t* mutex) {
+	return (mtx_init(mutex, mtx_plain) == thrd_success) ? 0 : ERR_FAILURE;
+}
+
+void _mutex_destroy(czmutex_t* mutex) {
+	mtx_destroy(mutex);
+}
+
+void _mutex_lock(czmutex_t* mutex) {
+	mtx_lock(mutex);
+}
+
+void _mutex_unlock(czmutex_t* mutex) {
+	mtx_unlock(mutex);
+}
+
+int _cond_init(czcond_t* cond) {
+	return (cnd_init(cond) == thrd_success) ? 0 : ERR_FAILURE;
+}
+
+void _cond_destroy(czcond_t* cond) {
+	cnd_destroy(cond);
+}
+
+void _cond_wait(czcond_t* cond, czmutex_t* mutex) {
+	cnd_wait(cond, mutex);
+}
+
+void _cond_signal(czcond_t* cond) {
+	cnd_signal(cond);
+}
+
+void _cond_broadcast(czcond_t* cond) {
+	cnd_broadcast(cond);
+}
+
+#elif defined(CZ_THREADS_POSIX)
+
+/* POSIX backend */
+#include <sched.h>
+
+/* pthreads entry points return void*: carry the C11-style entry point and its argument through a trampoline */
+typedef struct {
+	czthread_start_t func;
+	void* arg;
+} thread_start_data_t;
+
+static void* __thread_trampoline(void* start_data_ptr) {
+	thread_start_data_t start_data = *(thread_start_data_t*) start_data_ptr;
+
+	free(start_data_ptr);
+	return (void*)(intptr_t) start_data.func(start_data.arg);
+}
+
+int _thread_create(czthread_t* thread, czthread_start_t func, void* arg) {
+	thread_start_data_t* start_data;
+
+	if ( (start_data = malloc(sizeof(thread_start_data_t))) == NULL )
+		return ERR_FAILURE;
+	start_data->func = func;
+	start_data->arg = arg;
+
+	if (pthread_create(thread, NULL, __thread_trampoline, start_data) != 0) {
+		free(start_data);
+		return ERR_FAILURE;
+	}
+	return 0;
+}
+
+int _thread_join(czthread_t thread, int* res) {
+	void* ret;
+
+	if (pthread_join(thread, &ret) != 0)
+		return ERR_FAILURE;
+	if (res != NULL)
+		*res = (int)(intptr_t) ret;
+	return 0;
+}
+
+_Noreturn void _thread_exit(int res) {
+	pthread_exit((void*)(intptr_t) res);
+}
+
+void _thread_yield(void) {
+	sched_yield();
+}
+
+unsigned long _thread_id(void) {
+	return (unsigned long) pthread_self();
+}
+
+int _mutex_init(czmutex_t* mutex) {
+	return (pthread_mutex_init(mutex, NULL) == 0) ? 0 : ERR_FAILURE;
+}
+
+void _mutex_destroy(czmutex_t* mutex) {
+	pthread_mutex_destroy(mutex);
+}
+
+void _mutex_lock(czmutex_t* mutex) {
+	pthread_mutex_lock(mutex);
+}
+
+void _mutex_unlock(czmutex_t* mutex) {
+	pthread_mutex_unlock(mutex);
+}
+
+int _cond_init(czcond_t* cond) {
+	return (pthread_cond_init(cond, NULL) == 0) ? 0 : ERR_FAILURE;
+}
+
+void _cond_destroy(czcond_t* cond) {
+	pthread_cond_destroy(cond);
+}
+
+void _cond_wait(czcond_t* cond, czmutex_t* mutex) {
+	pthread_cond_wait(cond, mutex);
+}
+
+void _cond_signal(czcond_t* cond) {
+	pthread_cond_signal(cond);
+}
+
+void _cond_broadcast(czcond_t* cond) {
+	pthread_cond_broadcast(cond);
+}
+
+#endif
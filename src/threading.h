@@ -0,0 +1,54 @@
+#ifndef _CZTHREADING_H
+#define _CZTHREADING_H
+
+/*
+ * Thin portable threading layer. C11 threads are used when the C library provides them, POSIX threads otherwise, so
+ * parallel code paths do not depend on the libc we are built against. If neither is available CZ_NO_THREADS is
+ * defined and callers must fall back to serial code. Define CZ_USE_PTHREADS to force the POSIX backend.
+ */
+#if !defined(__STDC_NO_THREADS__) && !defined(CZ_USE_PTHREADS)
+	#include <threads.h>
+	#define CZ_THREADS_C11
+	#define CZ_THREADS_BACKEND	"C11"
+	typedef thrd_t czthread_t;
+	typedef mtx_t czmutex_t;
+	typedef cnd_t czcond_t;
+#elif defined(__unix__) || defined(__APPLE__)
+	#include <pthread.h>
+	#define CZ_THREADS_POSIX
+	#define CZ_THREADS_BACKEND	"POSIX"
+	typedef pthread_t czthread_t;
+	typedef pthread_mutex_t czmutex_t;
+	typedef pthread_cond_t czcond_t;
+#else
+	#define CZ_NO_THREADS
+#endif
+
+#ifndef CZ_NO_THREADS
+
+/* Thread entry point; the return value is the thread exit status */
+typedef int (*czthread_start_t)(void*);
+
+/* Threads. Functions returning int return zero on success, negative value on error. */
+int _thread_create(czthread_t* thread, czthread_start_t func, void* arg);
+int _thread_join(czthread_t thread, int* res);
+_Noreturn void _thread_exit(int res);
+void _thread_yield(void);
+unsigned long _thread_id(void);
+
+/* Mutexes (non-recursive) */
+int _mutex_init(czmutex_t* mutex);
+void _mutex_destroy(czmutex_t* mutex);
+void _mutex_lock(czmutex_t* mutex);
+void _mutex_unlock(czmutex_t* mutex);
+
+/* Condition variables */
+int _cond_init(czcond_t* cond);
+void _cond_destroy(czcond_t* cond);
+void _cond_wait(czcond_t* cond, czmutex_t* mutex);
+void _cond_signal(czcond_t* cond);
+void _cond_broadcast(czcond_t* cond);
+
+#endif
+
+#endif
@@ -0,0 +1,682 @@
+/* inotify and pipe2() are Linux extensions */
+#define _GNU_SOURCE
+
+/* Standard library */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+	#include <poll.h>
+	#include <sys/inotify.h>
+#endif
+
+/* Internal modules */
+#include "common.h"
+#include "context.h"
+#include "encrypt.h"
+#include "threading.h"
+#include "watch.h"
+
+#if defined(__linux__) && !defined(CZ_NO_THREADS)
+
+/* Buckets of the set of pending files */
+#define _WATCH_BUCKETS		1024
+
+/* One file waiting to be encrypted */
+typedef struct watch_item {
+	struct watch_item* next;
+	struct watch_item* bucket_next;	/* Next pending file in the same bucket */
+	char* path;			/* Plaintext file */
+	char* output;			/* Encrypted copy */
+	struct timespec detected;
+	bool running;			/* Taken by a worker */
+	bool again;			/* Written again while a worker had it: encrypt it once more */
+	bool encrypted;			/* The worker published its encrypted copy */
+	struct stat encrypted_st;	/* Version of the plaintext that was encrypted */
+} watch_item_t;
+
+/* One worker thread and its own context */
+typedef struct {
+	CzarrapoWatch* watch;
+	CzarrapoContext* ctx;
+	czthread_t thread;
+	bool started;
+} watch_worker_t;
+
+struct czarrapo_watch {
+	char** dirs;
+	char** outputs;			/* Where the files of each directory are encrypted to */
+	int* wds;			/* inotify watch descriptor for each directory */
+	int num_dirs;
+	bool remove_plaintext;
+	int inotify_fd;
+	int stop_pipe[2];		/* Written to by czarrapo_watch_stop() to wake up the watcher */
+	czthread_t watcher;
+	bool watcher_started;
+
+	watch_worker_t* workers;
+	int num_workers;
+
+	/* Files detected but not handed to the workers yet; only touched by the watcher */
+	watch_item_t* batch_head;
+	watch_item_t* batch_tail;
+	int batch_len;
+	struct timespec batch_start;	/* When the oldest file in the batch was detected */
+
+	/* Shared with the workers, under 'lock' */
+	watch_item_t* head;
+	watch_item_t* tail;
+	long long int queued;		/* Files in the queue */
+	int idle;			/* Workers waiting for files */
+	bool done;			/* No more files will be queued */
+	bool synchronized;		/* lock and ready are initialized */
+	czmutex_t lock;
+	czcond_t ready;			/* Signalled when files are queued */
+	CzarrapoWatchStats stats;	/* Latency fields hold sums until reported */
+	struct timespec start;
+
+	/* Every file from detection until a worker is done with it, by path, under 'lock': a file is never queued twice */
+	watch_item_t* pending[_WATCH_BUCKETS];
+};
+
+/* Nanoseconds since 'from' */
+static long long int __elapsed_ns(const struct timespec* from) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - from->tv_sec) * 1000000000LL + (now.tv_nsec - from->tv_nsec);
+}
+
+static void __watch_items_free(watch_item_t* item) {
+	watch_item_t* next;
+
+	for (; item != NULL; item = next) {
+		next = item->next;
+		free(item->path);
+		free(item->output);
+		free(item);
+	}
+}
+
+/* RETURNS: whether 'a' and 'b' describe the same version of the same file. */
+static bool __watch_same_file(const struct stat* a, const struct stat* b) {
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+		&& a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* Bucket of 'path' in the set of pending files (FNV-1a) */
+static watch_item_t** __watch_bucket(CzarrapoWatch* watch, const char* path) {
+	unsigned int hash = 2166136261u;
+
+	for (; *path != '\0'; ++path)
+		hash = (hash ^ (unsigned char) *path) * 16777619u;
+	return &watch->pending[hash % _WATCH_BUCKETS];
+}
+
+/* Pending file with path 'path', NULL if there is none. Needs 'lock'. */
+static watch_item_t* __watch_pending_find(CzarrapoWatch* watch, const char* path) {
+	watch_item_t* item;
+
+	for (item = *__watch_bucket(watch, path); item != NULL; item = item->bucket_next) {
+		if (strcmp(item->path, path) == 0)
+			return item;
+	}
+	return NULL;
+}
+
+/* Takes 'item' out of the set of pending files. Needs 'lock'. */
+static void __watch_pending_remove(CzarrapoWatch* watch, watch_item_t* item) {
+	watch_item_t** link = __watch_bucket(watch, item->path);
+
+	while (*link != item)
+		link = &(*link)->bucket_next;
+	*link = item->bucket_next;
+}
+
+/* Appends the items from 'head' to 'tail' ('count' of them) to the queue and wakes the workers up. Needs 'lock'. */
+static void __watch_enqueue(CzarrapoWatch* watch, watch_item_t* head, watch_item_t* tail, int count) {
+	if (watch->tail != NULL)
+		watch->tail->next = head;
+	else
+		watch->head = head;
+	watch->tail = tail;
+	watch->queued += count;
+	watch->stats.pending += count;
+	_cond_broadcast(&watch->ready);
+}
+
+/*
+ * Hands the pending batch to the workers if any of them is idle, if it is full, if it has waited WATCH_BATCH_DELAY_MS,
+ * or if 'force' is set. Coalescing only happens while every worker is busy, so a lone file is never held back.
+ */
+static void __watch_flush(CzarrapoWatch* watch, bool force) {
+	if (watch->batch_len == 0)
+		return;
+
+	_mutex_lock(&watch->lock);
+	if (force || watch->idle > 0 || watch->batch_len >= WATCH_BATCH_SIZE || __elapsed_ns(&watch->batch_start) >= WATCH_BATCH_DELAY_MS * 1000000LL) {
+		__watch_enqueue(watch, watch->batch_head, watch->batch_tail, watch->batch_len);
+		watch->batch_head = watch->batch_tail = NULL;
+		watch->batch_len = 0;
+	}
+	_mutex_unlock(&watch->lock);
+}
+
+/*
+ * Adds file 'name' of directory 'dir' to the pending batch, unless it is hidden, already encrypted or not a regular
+ * file. With 'skip_done', files whose encrypted copy is newer than them are skipped too. A file that is already pending
+ * is not added again; if a worker has started on it, it is encrypted once more when the worker is done.
+ */
+static void __watch_add(CzarrapoWatch* watch, int dir, const char* name, bool skip_done) {
+	size_t name_len = strlen(name), suffix_len = strlen(WATCH_SUFFIX);
+	struct stat plaintext_st, output_st;
+	watch_item_t* item;
+	watch_item_t* pending;
+	watch_item_t** bucket;
+
+	if (name[0] == '.' || (name_len >= suffix_len && strcmp(&name[name_len - suffix_len], WATCH_SUFFIX) == 0))
+		return;
+
+	if ( (item = calloc(1, sizeof(watch_item_t))) == NULL )
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &item->detected);
+	if ( (item->path = malloc(strlen(watch->dirs[dir]) + name_len + 2)) == NULL
+		|| (item->output = malloc(strlen(watch->outputs[dir]) + name_len + suffix_len + 2)) == NULL ) {
+		__watch_items_free(item);
+		return;
+	}
+	sprintf(item->path, "%s/%s", watch->dirs[dir], name);
+	sprintf(item->output, "%s/%s%s", watch->outputs[dir], name, WATCH_SUFFIX);
+
+	/* Checked under the lock, so a worker cannot remove the file in between */
+	_mutex_lock(&watch->lock);
+	if ( (pending = __watch_pending_find(watch, item->path)) != NULL ) {
+		if (pending->running)
+			pending->again = true;
+		_mutex_unlock(&watch->lock);
+		__watch_items_free(item);
+		return;
+	}
+	if (stat(item->path, &plaintext_st) != 0 || !S_ISREG(plaintext_st.st_mode)
+		|| (skip_done && stat(item->output, &output_st) == 0 && output_st.st_mtime >= plaintext_st.st_mtime)) {
+		_mutex_unlock(&watch->lock);
+		__watch_items_free(item);
+		return;
+	}
+	bucket = __watch_bucket(watch, item->path);
+	item->bucket_next = *bucket;
+	*bucket = item;
+	_mutex_unlock(&watch->lock);
+
+	if (watch->batch_tail != NULL)
+		watch->batch_tail->next = item;
+	else {
+		watch->batch_head = item;
+		watch->batch_start = item->detected;
+	}
+	watch->batch_tail = item;
+	++watch->batch_len;
+
+	__watch_flush(watch, false);
+}
+
+/* Queues every file already in directory 'dir' that has no up to date encrypted copy */
+static void __watch_scan(CzarrapoWatch* watch, int dir) {
+	DIR* dp;
+	struct dirent* entry;
+
+	if ( (dp = opendir(watch->dirs[dir])) == NULL )
+		return;
+	while ( (entry = readdir(dp)) != NULL )
+		__watch_add(watch, dir, entry->d_name, true);
+	closedir(dp);
+}
+
+/* Queues the files named by every pending inotify event */
+static void __watch_read_events(CzarrapoWatch* watch) {
+	union {
+		struct inotify_event event;		/* Aligns the buffer for the events read into it */
+		char raw[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+	} buf;
+	const struct inotify_event* event;
+	ssize_t len;
+
+	while ( (len = read(watch->inotify_fd, buf.raw, sizeof(buf.raw))) > 0 ) {
+		for (char* p = buf.raw; p < &buf.raw[len]; p += sizeof(struct inotify_event) + event->len) {
+			event = (const struct inotify_event*) p;
+
+			/* Events were lost: look at every directory again */
+			if (event->mask & IN_Q_OVERFLOW) {
+				for (int i=0; i<watch->num_dirs; ++i)
+					__watch_scan(watch, i);
+				continue;
+			}
+			if (event->len == 0 || (event->mask & IN_ISDIR))
+				continue;
+
+			for (int i=0; i<watch->num_dirs; ++i) {
+				if (watch->wds[i] == event->wd) {
+					__watch_add(watch, i, event->name, false);
+					break;
+				}
+			}
+		}
+	}
+}
+
+/* Watcher thread: turns inotify events into batches until czarrapo_watch_stop() */
+static int __watch_main(void* watch_ptr) {
+	CzarrapoWatch* watch = (CzarrapoWatch*) watch_ptr;
+	struct pollfd fds[2] = { { watch->inotify_fd, POLLIN, 0 }, { watch->stop_pipe[0], POLLIN, 0 } };
+	long long int waited_ms;
+	int timeout;
+
+	while (true) {
+
+		/* Wake up in time to hand over a batch that has waited long enough */
+		timeout = -1;
+		if (watch->batch_len > 0) {
+			waited_ms = __elapsed_ns(&watch->batch_start) / 1000000;
+			timeout = (waited_ms >= WATCH_BATCH_DELAY_MS) ? 0 : (int) (WATCH_BATCH_DELAY_MS - waited_ms);
+		}
+
+		if (poll(fds, 2, timeout) < 0 && errno != EINTR)
+			break;
+		if (fds[1].revents != 0)
+			break;
+		if (fds[0].revents & POLLIN)
+			__watch_read_events(watch);
+		__watch_flush(watch, false);
+	}
+
+	/* Whatever arrived before the stop still gets encrypted */
+	__watch_read_events(watch);
+	__watch_flush(watch, true);
+	_mutex_lock(&watch->lock);
+	watch->done = true;
+	_cond_broadcast(&watch->ready);
+	_mutex_unlock(&watch->lock);
+
+	return 0;
+}
+
+/* Worker thread: encrypts a share of the queue at a time, until the queue is empty and closed */
+static int __watch_worker_main(void* worker_ptr) {
+	watch_worker_t* worker = (watch_worker_t*) worker_ptr;
+	CzarrapoWatch* watch = worker->watch;
+	watch_item_t* items;
+	watch_item_t* last;
+	watch_item_t* next;
+	watch_item_t* done;
+	watch_item_t* again_head;
+	watch_item_t* again_tail;
+	int again_count;
+	long long int take, size;
+	long long int queue_latency, latency;
+	CzarrapoWatchStats local;
+	struct stat path_st;
+	char fd_path[32];
+	const char* source;
+	int fd;
+
+	_mutex_lock(&watch->lock);
+	while (true) {
+
+		while (watch->head == NULL && !watch->done) {
+			++watch->idle;
+			_cond_wait(&watch->ready, &watch->lock);
+			--watch->idle;
+		}
+		if (watch->head == NULL)
+			break;
+
+		/* Take a fair share of the queue, so a burst is spread over every worker */
+		take = (watch->queued + watch->num_workers - 1) / watch->num_workers;
+		if (take > WATCH_BATCH_SIZE)
+			take = WATCH_BATCH_SIZE;
+		items = last = watch->head;
+		items->running = true;
+		for (long long int i=1; i<take; ++i) {
+			last = last->next;
+			last->running = true;
+		}
+		watch->head = last->next;
+		if (watch->head == NULL)
+			watch->tail = NULL;
+		last->next = NULL;
+		watch->queued -= take;
+		_mutex_unlock(&watch->lock);
+
+		memset(&local, 0, sizeof(local));
+		for (watch_item_t* item = items; item != NULL; item = item->next) {
+			queue_latency = __elapsed_ns(&item->detected);
+
+			/* The descriptor pins the version encrypted; read it through the descriptor where /proc can name it */
+			if ( (fd = open(item->path, O_RDONLY | O_CLOEXEC)) < 0 ) {
+				DEBUG_PRINT(("[DEBUG] Could not open %s.\n", item->path));
+				++local.failures;
+				continue;
+			}
+			snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+			source = (access(fd_path, R_OK) == 0) ? fd_path : item->path;
+			if (fstat(fd, &item->encrypted_st) != 0 || czarrapo_encrypt(worker->ctx, source, item->output, -1) == ERR_FAILURE) {
+				DEBUG_PRINT(("[DEBUG] Could not encrypt %s.\n", item->path));
+				++local.failures;
+				close(fd);
+				continue;
+			}
+			close(fd);
+			item->encrypted = true;
+			size = item->encrypted_st.st_size;
+
+			latency = __elapsed_ns(&item->detected);
+			++local.files;
+			local.bytes += size;
+			local.queue_latency_avg_ns += queue_latency;
+			local.latency_avg_ns += latency;
+			if (queue_latency > local.queue_latency_max_ns)
+				local.queue_latency_max_ns = queue_latency;
+			if (latency > local.latency_max_ns)
+				local.latency_max_ns = latency;
+		}
+
+		/* One sync for the whole batch; plaintext is only removed once its encrypted copy is durable */
+		bool synced = (worker->ctx->durability != CZ_DURABILITY_BATCH || czarrapo_sync(worker->ctx) == 0);
+
+		/*
+		 * Files written again meanwhile go back to the queue, and keep their plaintext: those the watcher saw an event
+		 * for, and, when plaintext is removed, those whose path no longer names the version encrypted (the event may not
+		 * have been read yet). The rest leave the pending set with their plaintext removed, under the lock so a new
+		 * event for the same path sees either one or the other.
+		 */
+		done = again_head = again_tail = NULL;
+		again_count = 0;
+		_mutex_lock(&watch->lock);
+		for (watch_item_t* item = items; item != NULL; item = next) {
+			next = item->next;
+			item->next = NULL;
+			if (watch->remove_plaintext && synced && item->encrypted) {
+				if (lstat(item->path, &path_st) != 0)
+					item->encrypted = false;	/* Gone: nothing to remove */
+				else if (!__watch_same_file(&path_st, &item->encrypted_st))
+					item->again = true;
+			}
+			if (item->again) {
+				item->running = item->again = item->encrypted = false;
+				clock_gettime(CLOCK_MONOTONIC, &item->detected);
+				if (again_tail != NULL)
+					again_tail->next = item;
+				else
+					again_head = item;
+				again_tail = item;
+				++again_count;
+				continue;
+			}
+			if (watch->remove_plaintext && synced && item->encrypted)
+				unlink(item->path);
+			__watch_pending_remove(watch, item);
+			item->next = done;
+			done = item;
+		}
+		if (again_count > 0)
+			__watch_enqueue(watch, again_head, again_tail, again_count);
+
+		++watch->stats.batches;
+		watch->stats.pending -= take;
+		watch->stats.files += local.files;
+		watch->stats.failures += local.failures;
+		watch->stats.bytes += local.bytes;
+		watch->stats.queue_latency_avg_ns += local.queue_latency_avg_ns;
+		watch->stats.latency_avg_ns += local.latency_avg_ns;
+		if (local.queue_latency_max_ns > watch->stats.queue_latency_max_ns)
+			watch->stats.queue_latency_max_ns = local.queue_latency_max_ns;
+		if (local.latency_max_ns > watch->stats.latency_max_ns)
+			watch->stats.latency_max_ns = local.latency_max_ns;
+		_mutex_unlock(&watch->lock);
+		__watch_items_free(done);
+		_mutex_lock(&watch->lock);
+	}
+	_mutex_unlock(&watch->lock);
+
+	return 0;
+}
+
+/* Frees the service; every thread must have been joined */
+static void __watch_free(CzarrapoWatch* watch) {
+	__watch_items_free(watch->batch_head);
+	__watch_items_free(watch->head);
+
+	if (watch->workers != NULL) {
+		for (int i=0; i<watch->num_workers; ++i)
+			czarrapo_free(watch->workers[i].ctx);
+		free(watch->workers);
+	}
+	if (watch->synchronized) {
+		_cond_destroy(&watch->ready);
+		_mutex_destroy(&watch->lock);
+	}
+
+	if (watch->inotify_fd >= 0)
+		close(watch->inotify_fd);
+	for (int i=0; i<2; ++i) {
+		if (watch->stop_pipe[i] >= 0)
+			close(watch->stop_pipe[i]);
+	}
+
+	for (int i=0; i<watch->num_dirs; ++i) {
+		free(watch->dirs[i]);
+		free(watch->outputs[i]);
+	}
+	free(watch->dirs);
+	free(watch->outputs);
+	free(watch->wds);
+	free(watch);
+}
+
+/*
+ * Picks where the files of each directory are encrypted to: 'output_dir' itself for a single directory, otherwise a
+ * subdirectory of it named after each one, so equal file names in different directories do not clash. Subdirectories
+ * are created if needed.
+ * RETURNS: zero on success, negative value if two directories have the same name or a subdirectory cannot be created.
+ */
+static int __watch_outputs(CzarrapoWatch* watch, const char* output_dir) {
+	char* resolved;
+	const char* name;
+	struct stat st;
+
+	if (watch->num_dirs == 1)
+		return ( (watch->outputs[0] = strdup(output_dir)) == NULL ) ? ERR_FAILURE : 0;
+
+	for (int i=0; i<watch->num_dirs; ++i) {
+
+		/* Name of the directory itself, whatever path it was given by ("in/", "../in", ".") */
+		if ( (resolved = realpath(watch->dirs[i], NULL)) == NULL )
+			return ERR_FAILURE;
+		name = strrchr(resolved, '/') + 1;
+		if (*name == '\0' || (watch->outputs[i] = malloc(strlen(output_dir) + strlen(name) + 2)) == NULL) {
+			free(resolved);
+			return ERR_FAILURE;
+		}
+		sprintf(watch->outputs[i], "%s/%s", output_dir, name);
+		free(resolved);
+
+		for (int j=0; j<i; ++j) {
+			if (strcmp(watch->outputs[i], watch->outputs[j]) == 0) {
+				DEBUG_PRINT(("[DEBUG] Two watched directories are named %s.\n", name));
+				return ERR_FAILURE;
+			}
+		}
+		if (mkdir(watch->outputs[i], 0777) != 0
+			&& (errno != EEXIST || stat(watch->outputs[i], &st) != 0 || !S_ISDIR(st.st_mode)))
+			return ERR_FAILURE;
+	}
+	return 0;
+}
+
+/* Caps 'num_workers' to the files the storage of 'path' serves well at once. RETURNS: the new number of workers. */
+static int __watch_workers_cap(const char* path, int num_workers) {
+	CzarrapoIoPolicy policy;
+
+	czarrapo_storage_policy(path, &policy);
+	if (policy.parallelism < num_workers) {
+		DEBUG_PRINT(("[DEBUG] %s is on %s storage: %d workers.\n", path, _storage_name(policy.storage), policy.parallelism));
+		return policy.parallelism;
+	}
+	return num_workers;
+}
+
+CzarrapoWatch* czarrapo_watch_start(const CzarrapoContext* ctx, const char* const* dirs, int num_dirs, const char* output_dir, int num_workers, bool remove_plaintext) {
+	CzarrapoWatch* watch;
+
+	if (num_dirs < 1 || num_workers < 1 || output_dir == NULL)
+		return NULL;
+
+	/* More workers than the storage handles only turn sequential I/O into seeks */
+	for (int i=0; i<num_dirs; ++i)
+		num_workers = __watch_workers_cap(dirs[i], num_workers);
+	num_workers = __watch_workers_cap(output_dir, num_workers);
+
+	if ( (watch = calloc(1, sizeof(CzarrapoWatch))) == NULL )
+		return NULL;
+	watch->inotify_fd = watch->stop_pipe[0] = watch->stop_pipe[1] = -1;
+	watch->remove_plaintext = remove_plaintext;
+	clock_gettime(CLOCK_MONOTONIC, &watch->start);
+
+	/* Own copies of every path */
+	if ( (watch->dirs = calloc(num_dirs, sizeof(char*))) == NULL
+		|| (watch->outputs = calloc(num_dirs, sizeof(char*))) == NULL
+		|| (watch->wds = malloc(num_dirs * sizeof(int))) == NULL ) {
+		__watch_free(watch);
+		return NULL;
+	}
+	watch->num_dirs = num_dirs;
+	for (int i=0; i<num_dirs; ++i) {
+		if ( (watch->dirs[i] = strdup(dirs[i])) == NULL ) {
+			__watch_free(watch);
+			return NULL;
+		}
+	}
+	if (__watch_outputs(watch, output_dir) == ERR_FAILURE) {
+		__watch_free(watch);
+		return NULL;
+	}
+
+	/* Watch every directory before scanning them, so no file can slip in between */
+	if ( (watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0 || pipe2(watch->stop_pipe, O_CLOEXEC) != 0 ) {
+		__watch_free(watch);
+		return NULL;
+	}
+	for (int i=0; i<num_dirs; ++i) {
+		if ( (watch->wds[i] = inotify_add_watch(watch->inotify_fd, dirs[i], IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR)) < 0 ) {
+			__watch_free(watch);
+			return NULL;
+		}
+	}
+
+	if (_mutex_init(&watch->lock) == ERR_FAILURE) {
+		__watch_free(watch);
+		return NULL;
+	}
+	if (_cond_init(&watch->ready) == ERR_FAILURE) {
+		_mutex_destroy(&watch->lock);
+		__watch_free(watch);
+		return NULL;
+	}
+	watch->synchronized = true;
+
+	/* Keys are parsed once: each worker gets a copy of the loaded context */
+	if ( (watch->workers = calloc(num_workers, sizeof(watch_worker_t))) == NULL ) {
+		__watch_free(watch);
+		return NULL;
+	}
+	watch->num_workers = num_workers;
+	for (int i=0; i<num_workers; ++i) {
+		watch->workers[i].watch = watch;
+		if ( (watch->workers[i].ctx = czarrapo_copy(ctx)) == NULL ) {
+			__watch_free(watch);
+			return NULL;
+		}
+	}
+	for (int i=0; i<num_workers; ++i) {
+		if (_thread_create(&watch->workers[i].thread, __watch_worker_main, &watch->workers[i]) == ERR_FAILURE) {
+			czarrapo_watch_stop(watch);
+			return NULL;
+		}
+		watch->workers[i].started = true;
+	}
+
+	/* Files dropped while the service was down */
+	for (int i=0; i<num_dirs; ++i)
+		__watch_scan(watch, i);
+
+	if (_thread_create(&watch->watcher, __watch_main, watch) == ERR_FAILURE) {
+		czarrapo_watch_stop(watch);
+		return NULL;
+	}
+	watch->watcher_started = true;
+
+	return watch;
+}
+
+void czarrapo_watch_stats(CzarrapoWatch* watch, CzarrapoWatchStats* stats) {
+	_mutex_lock(&watch->lock);
+	*stats = watch->stats;
+	_mutex_unlock(&watch->lock);
+
+	if (stats->files > 0) {
+		stats->queue_latency_avg_ns /= (long long int) stats->files;
+		stats->latency_avg_ns /= (long long int) stats->files;
+	}
+	stats->elapsed_ns = __elapsed_ns(&watch->start);
+}
+
+void czarrapo_watch_stop(CzarrapoWatch* watch) {
+	if (watch == NULL)
+		return;
+
+	/* The watcher queues what it has left and closes the queue; without a watcher, close it here */
+	if (watch->watcher_started) {
+		while (write(watch->stop_pipe[1], "", 1) < 0 && errno == EINTR)
+			;
+		_thread_join(watch->watcher, NULL);
+	} else {
+		__watch_flush(watch, true);
+		_mutex_lock(&watch->lock);
+		watch->done = true;
+		_cond_broadcast(&watch->ready);
+		_mutex_unlock(&watch->lock);
+	}
+
+	for (int i=0; i<watch->num_workers; ++i) {
+		if (watch->workers[i].started)
+			_thread_join(watch->workers[i].thread, NULL);
+	}
+
+	__watch_free(watch);
+}
+
+#else
+
+/* No inotify or no threads: the service is unavailable */
+CzarrapoWatch* czarrapo_watch_start(const CzarrapoContext* ctx, const char* const* dirs, int num_dirs, const char* output_dir, int num_workers, bool remove_plaintext) {
+	(void) ctx; (void) dirs; (void) num_dirs; (void) output_dir; (void) num_workers; (void) remove_plaintext;
+	return NULL;
+}
+
+void czarrapo_watch_stats(CzarrapoWatch* watch, CzarrapoWatchStats* stats) {
+	(void) watch;
+	memset(stats, 0, sizeof(CzarrapoWatchStats));
+}
+
+void czarrapo_watch_stop(CzarrapoWatch* watch) {
+	(void) watch;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef _CZWATCH_H
+#define _CZWATCH_H
+
+/* Standard library */
+#include <stdbool.h>
+
+/* Internal modules */
+#include "context.h"
+
+/* Most files handed to a worker at once; the worker syncs once per batch in CZ_DURABILITY_BATCH mode */
+#ifndef WATCH_BATCH_SIZE
+	#define WATCH_BATCH_SIZE	64
+#endif
+
+/* How long, in milliseconds, new files may wait to be batched while every worker is busy */
+#ifndef WATCH_BATCH_DELAY_MS
+	#define WATCH_BATCH_DELAY_MS	2
+#endif
+
+/* Appended to the name of each encrypted file. Files already carrying it are never encrypted. */
+#ifndef WATCH_SUFFIX
+	#define WATCH_SUFFIX		".crypt"
+#endif
+
+/*
+ * Service encrypting every file that appears in a set of directories. New files are detected with inotify when they
+ * are closed after writing or moved in, so writers never have a half-written file picked up. They are batched and
+ * encrypted by a pool of workers, each with its own copy of the context.
+ */
+typedef struct czarrapo_watch CzarrapoWatch;
+
+/* Service activity since it started */
+typedef struct {
+	unsigned long long files;		/* Files encrypted */
+	unsigned long long failures;		/* Files that could not be encrypted */
+	unsigned long long bytes;		/* Plaintext bytes encrypted */
+	unsigned long long batches;		/* Batches taken by workers */
+	unsigned long long pending;		/* Files detected and not processed yet */
+	long long queue_latency_avg_ns;		/* From detection until a worker starts on the file */
+	long long queue_latency_max_ns;
+	long long latency_avg_ns;		/* From detection until the encrypted file is published */
+	long long latency_max_ns;
+	long long elapsed_ns;			/* Time since the service started */
+} CzarrapoWatchStats;
+
+/*
+ * Starts watching 'num_dirs' directories (not their subdirectories) and encrypting each new regular file into
+ * 'output_dir', under its own name followed by WATCH_SUFFIX. Hidden files are ignored, so writers that need a temporary
+ * name should use a hidden one and rename it when done. Files already in the directories are encrypted first, unless
+ * their encrypted copy is newer. With more than one directory, each one's files go to a subdirectory of 'output_dir'
+ * with the directory's name, created if needed; directories with the same name are rejected. A file is queued once
+ * however many events it gets, and encrypted again if written while a worker has it. If 'remove_plaintext' is set, each
+ * file is deleted once its encrypted copy is published (and synced, in CZ_DURABILITY_BATCH mode), unless the path no
+ * longer names the version encrypted, which is then encrypted again. Up to 'num_workers' threads encrypt files, each
+ * with a copy of 'ctx' (see czarrapo_copy()), so 'ctx' stays free for the caller; fewer are started if the directories
+ * are on storage that serves fewer files at once (see czarrapo_storage_policy()). Linux only.
+ * RETURNS: a pointer to the running service, NULL on failure.
+ */
+CzarrapoWatch* czarrapo_watch_start(const CzarrapoContext* ctx, const char* const* dirs, int num_dirs, const char* output_dir, int num_workers, bool remove_plaintext);
+
+/* Fills 'stats' with the service activity so far */
+void czarrapo_watch_stats(CzarrapoWatch* watch, CzarrapoWatchStats* stats);
+
+/* Stops watching, waits for the files that arrived until now to be encrypted, and frees the service */
+void czarrapo_watch_stop(CzarrapoWatch* watch);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Checks every _block_compare() variant the running CPU supports against the scalar reference: random data, lengths
+ * that are not multiples of the vector widths, and a first difference at each byte position. Run with `make test`.
+ */
+
+/* Standard library */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Internal modules */
+#include "cpu.h"
+
+/* Longest input checked: several AVX-512 vectors plus a tail */
+#define MAX_LEN		300
+
+/* Random inputs checked for each length */
+#define RANDOM_ROUNDS	64
+
+#define MAX_VARIANTS	8
+
+static const char* names[MAX_VARIANTS];
+static block_compare_fn fns[MAX_VARIANTS];
+static int num_variants;
+static int failures;
+
+/* Compares every variant with the scalar one (variant 0) on one input */
+static void check(const unsigned char* a, const unsigned char* b, size_t len, const char* what) {
+	int expected = fns[0](a, b, len);
+
+	for (int v=1; v<num_variants; ++v) {
+		int got = fns[v](a, b, len);
+		if (got != expected) {
+			if (failures++ < 10)
+				printf("[FAIL] %s: len=%zu %s: got %i, scalar %i\n", names[v], len, what, got, expected);
+		}
+	}
+}
+
+int main(void) {
+	unsigned char a[MAX_LEN], b[MAX_LEN];
+	long long int checks = 0;
+
+	num_variants = _block_compare_variants(names, fns, MAX_VARIANTS);
+	printf("[*] Variants:");
+	for (int v=0; v<num_variants; ++v)
+		printf(" %s", names[v]);
+	printf(" (selected: %s)\n", czarrapo_capabilities()->block_compare);
+
+	srand(1234);
+	for (size_t len=0; len<=MAX_LEN; ++len) {
+
+		/* Unrelated random buffers, and equal ones */
+		for (int r=0; r<RANDOM_ROUNDS; ++r) {
+			for (size_t i=0; i<len; ++i) {
+				a[i] = rand() & 0xff;
+				b[i] = rand() & 0xff;
+			}
+			check(a, b, len, "random");
+			check(a, a, len, "equal");
+			checks += 2;
+		}
+
+		/* Equal up to 'pos', then differing by one in either direction, with a random tail behind that must not matter */
+		for (size_t pos=0; pos<len; ++pos) {
+			for (size_t i=0; i<len; ++i)
+				a[i] = b[i] = rand() & 0xff;
+			for (size_t i=pos+1; i<len; ++i)
+				b[i] = rand() & 0xff;
+
+			b[pos] = a[pos] + 1;
+			check(a, b, len, "first difference, a < b");
+			check(b, a, len, "first difference, a > b");
+			b[pos] = a[pos] ^ 0x80;
+			check(a, b, len, "first difference, high bit");
+			checks += 3;
+		}
+	}
+
+	if (failures > 0) {
+		printf("[-] %i of %lli checks failed\n", failures, checks * (num_variants - 1));
+		return EXIT_FAILURE;
+	}
+	printf("[+] %lli checks passed\n", checks * (num_variants - 1));
+	return EXIT_SUCCESS;
+}